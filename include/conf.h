@@ -33,5 +33,7 @@
 #define CONF_H
 
 extern void config_type(char *, char *, char *, char *, void *a);
+extern void config_depth(char *, char *, char *, void *a);
+extern void config_direction(char *, char *, char *, void *a);
 
 #endif /* CONF_H */
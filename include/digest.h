@@ -0,0 +1,52 @@
+/*
+ * digest.h - streaming file digests
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_SHA_NI 1
+#endif
+
+/** which digests to keep */
+#define DIGEST_MD5          0x01
+#define DIGEST_SHA1         0x02
+#define DIGEST_SHA256       0x04
+#define DIGEST_ALL          (DIGEST_MD5 | DIGEST_SHA1 | DIGEST_SHA256)
+
+#define DIGEST_MD5_LEN      16
+#define DIGEST_SHA1_LEN     20
+#define DIGEST_SHA256_LEN   32
+#define DIGEST_BLOCK        64          /** all three work on 64 byte blocks */
+
+/*
+ * MD5, SHA-1 and SHA-256 of one stream at once.  They all take the same
+ * size blocks, so there's one block buffer and every full block goes
+ * through each digest that's wanted before the next one is looked at.
+ */
+struct digest
+{
+    uint8_t which;                  /* DIGEST_ bits */
+    uint64_t len;                   /* bytes so far */
+    uint32_t md5[4];                /* chaining values */
+    uint32_t sha1[5];
+    uint32_t sha256[8];
+    uint8_t buf[DIGEST_BLOCK];      /* partial block */
+};
+typedef struct digest digest_t;
+
+const char *digest_setup(void);
+void digest_init(digest_t *, uint8_t);
+void digest_update(digest_t *, const uint8_t *, size_t);
+void digest_final(digest_t *, uint8_t *, uint8_t *, uint8_t *);
+
+#endif /* DIGEST_H */
@@ -0,0 +1,65 @@
+/*
+ * ebpf.h - kernel side flow bypass
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef EBPF_H
+#define EBPF_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+/*
+ * This header can't pull in pcap.h (or anything that does), the kernel's
+ * struct bpf_insn and libpcap's have the same name.
+ */
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#if defined(SO_ATTACH_BPF)
+#define HAVE_EBPF 1
+#endif
+#endif
+
+#define NFEX_EBPF_MAP_SIZE   262144     /** flows the kernel remembers */
+#define NFEX_EBPF_ERRBUF     256        /** PCAP_ERRBUF_SIZE */
+
+/*
+ * Bypassed flows as the kernel sees them.  The program loads packet
+ * fields with BPF_ABS/BPF_IND which byte swap them for us, so the key is
+ * in host order.
+ */
+struct ebpf_key
+{
+    uint32_t ip_src;
+    uint32_t ip_dst;
+    uint16_t port_src;
+    uint16_t port_dst;
+};
+typedef struct ebpf_key ebpf_key_t;
+
+/*
+ * An LRU hash of four tuples and a socket filter that drops packets that
+ * belong to them before they're copied up to us.  SYNs always get through
+ * and take their flow out of the map on the way, a new connection gets a
+ * fresh look.
+ */
+struct ebpf
+{
+    int map_fd;                     /* bypassed flows */
+    int prog_fd;                    /* the socket filter */
+    uint32_t flows;                 /* flows handed to the kernel */
+    uint32_t errors;                /* map updates that failed */
+};
+typedef struct ebpf ebpf_t;
+
+int ebpf_init(ebpf_t *, char *);
+int ebpf_attach(ebpf_t *, int, char *);
+void ebpf_bypass(ebpf_t *, uint32_t, uint32_t, uint16_t, uint16_t);
+void ebpf_close(ebpf_t *);
+
+#endif /* EBPF_H */
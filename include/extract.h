@@ -35,16 +35,22 @@
 #include <sys/types.h>
 #include <inttypes.h>
 #include "search.h"
+#include "pool.h"
+#include "index.h"
 
 #ifndef FILENAME_BUFFER_SIZE
 #define FILENAME_BUFFER_SIZE 4096
 #endif
 
+#define NFEX_XBUF_SIZE      (64 * 1024)        /** staging buffer, each */
+#define NFEX_XBUF_MAX       (16 * 1024 * 1024) /** all of them, all workers */
+#define NFEX_XBUF_SLAB      16                 /** buffers per pool slab */
+
 struct extract_list
 {
     struct extract_list *next;
     struct extract_list *prev;
-    fileid_t *fileid;        /* the data about the file type */
+    fileid_t fileid;         /* the file type, ours to outlive a reload */
     time_t timestamp;        /* update this guy everytime we touch him */
     int fd;                  /* file descriptor to write data to file */
     off_t nwritten;          /* number of bytes written */
@@ -54,7 +60,29 @@ struct extract_list
         int end;
     } segment;
     int finish;              /* set when a FOOTER is found */
+    uint8_t *buf;            /* staged data not handed to the writer yet */
+    uint32_t buffered;       /* how much */
+    struct extract_list *older;  /* holding a buffer, least recently */
+    struct extract_list *newer;  /* touched first */
+    digest_t digest;         /* of everything written so far */
+    index_rec_t rec;         /* for the index, once it's closed */
 };
 typedef struct extract_list extract_list_t;
 
+/*
+ * Staging buffers for one worker's extractions.  Segments are gathered
+ * up in a buffer and go to the writer NFEX_XBUF_SIZE at a time instead of
+ * one write per packet.  There are only so many buffers; when they're all
+ * taken the extraction that was touched longest ago is flushed and gives
+ * its buffer up.
+ */
+struct xbuf_cache
+{
+    pool_t bufs;             /* NFEX_XBUF_SIZE bytes each */
+    uint32_t max;            /* most we'll hand out */
+    extract_list_t *oldest;  /* extractions holding one */
+    extract_list_t *newest;
+};
+typedef struct xbuf_cache xbuf_cache_t;
+
 #endif /* EXTRACT_H */
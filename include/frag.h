@@ -0,0 +1,77 @@
+/*
+ * frag.h - IPv4 fragment reassembly
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef FRAG_H
+#define FRAG_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <time.h>
+#include "pool.h"
+
+#define NFEX_FRAG_MAX       (16 * 1024 * 1024)  /** bytes held, all caches */
+#define NFEX_FRAG_TIMEOUT   30                  /** seconds to wait on a hole */
+#define NFEX_FRAG_BUCKETS   1024                /** queue hash table, pow2 */
+#define NFEX_FRAG_DGRAM_MAX 65535               /** biggest IPv4 datagram */
+
+/** one piece of a datagram, by offset into its payload */
+struct frag_piece
+{
+    struct frag_piece *next;        /* next one up */
+    uint16_t off;                   /* first byte */
+    uint16_t len;                   /* bytes of data */
+    uint8_t data[];
+};
+typedef struct frag_piece frag_piece_t;
+
+/*
+ * A datagram being put back together.  Pieces never overlap: whatever
+ * arrived first wins and only the new bytes of a later fragment are
+ * kept, so once the last fragment has told us the size, have == total
+ * means there are no holes.
+ */
+struct frag_queue
+{
+    struct frag_queue *next;        /* hash chain */
+    struct frag_queue *older;       /* age list, by arrival of the first */
+    struct frag_queue *newer;
+    uint32_t ip_src;                /* what RFC 791 says identifies it */
+    uint32_t ip_dst;
+    uint16_t ip_id;
+    uint8_t ip_p;
+    uint8_t hlen;                   /* header length, 0 until offset 0 */
+    time_t first;                   /* capture time of the first piece */
+    uint32_t total;                 /* payload length, 0 until the last */
+    uint32_t have;                  /* payload bytes held */
+    frag_piece_t *pieces;           /* sorted by offset */
+    uint8_t hdr[60];                /* header (with options) of offset 0 */
+};
+typedef struct frag_queue frag_queue_t;
+
+/*
+ * Fragments for one thread.  Memory is bounded: past max the oldest
+ * datagrams are thrown out to make room, and any datagram that hasn't
+ * come together NFEX_FRAG_TIMEOUT seconds after its first fragment is
+ * thrown out too.  Finished datagrams are built in an arena that the
+ * owner resets once it's done with them.
+ */
+struct frag_cache
+{
+    frag_queue_t *buckets[NFEX_FRAG_BUCKETS];
+    frag_queue_t *oldest;           /* age list, expired from here */
+    frag_queue_t *newest;
+    uint32_t queues;                /* datagrams in progress */
+    uint64_t bytes;                 /* held right now */
+    uint64_t max;                   /* and the cap */
+    uint64_t peak;                  /* high water mark */
+    arena_t out;                    /* finished datagrams */
+};
+typedef struct frag_cache frag_cache_t;
+
+#endif /* FRAG_H */
@@ -18,31 +18,115 @@
 
 #include <sys/types.h>
 #include <inttypes.h>
+#include "pool.h"
 #include "search.h"
 #include "extract.h"
+#include "reasm.h"
 
-#define FNV_PRIME         0x811C9DC5
 #define SESSION_THRESHOLD 30        /** a session will stale out in 30s */
-#define NFEX_HT_SIZE      33211     /** randomly chosen largish prime */
+#define NFEX_HT_INIT_SIZE 32768     /** initial slots, must be a power of 2 */
+#define NFEX_HT_MAX_SIZE  0x40000000 /** we stop growing here */
+#define NFEX_HT_LOAD_NUM  3         /** grow when more than 3/4 full */
+#define NFEX_HT_LOAD_DEN  4
+#define NFEX_TW_BITS      6         /** 64 slots per timer wheel level */
+#define NFEX_TW_SLOTS     (1 << NFEX_TW_BITS)
+#define NFEX_TW_MASK      (NFEX_TW_SLOTS - 1)
+#define NFEX_TW_LEVELS    2         /** 1s and 64s ticks, ~68 min horizon */
+#define NFEX_HT_V6        0x80000000 /** hash tag for IPv6 sessions */
 
+/*
+ * The session key.  IPv4 addresses fit as they are; for IPv6 each address
+ * is folded down to 32 bits, the hash is tagged with NFEX_HT_V6 and the
+ * full addresses hang off the session, checked only when the fold and
+ * the hash both match.  IPv4 sessions pay nothing for IPv6.
+ */
 struct four_tuple
 {
-    uint32_t ip_src;
+    uint32_t ip_src;                /* address, or fold of an IPv6 one */
     uint32_t ip_dst;
     uint16_t port_src;
     uint16_t port_dst;
 };
 typedef struct four_tuple four_tuple_t;
 
+/** both IPv6 addresses, laid out as in the IPv6 header */
+struct ip6_pair
+{
+    uint8_t src[16];
+    uint8_t dst[16];
+};
+typedef struct ip6_pair ip6_pair_t;
+
+/*
+ * One direction of a connection: everything that follows the bytes one
+ * side sends, so a session carries two of these.
+ */
+struct ht_flow
+{
+    uint8_t flags;
+#define SESSION_BYPASS 0x01         /* past stream depth, don't look */
+    uint8_t role;                   /* SRCH_DIR_CLIENT/SERVER, both if unsure */
+    uint64_t depth;                 /* stream bytes searched so far */
+    uint32_t srch_state;            /* search machine state */
+    uint32_t srch_epoch;            /* config srch_state belongs to */
+    extract_list_t *extract_list;   /* list of current files being extracted */
+    reasm_t stream;                 /* TCP reassembly state */
+};
+typedef struct ht_flow ht_flow_t;
+
+/*
+ * A connection.  The key is in canonical order, the lower (address, port)
+ * endpoint first, so both directions land on the same session; flow[0]
+ * is what goes from the key's src to its dst and flow[1] the way back.
+ */
 struct hash_table_node
 {
-    four_tuple_t ft;                /* four tuple information */
+    four_tuple_t ft;                /* four tuple, canonical order */
+    ip6_pair_t *ip6;                /* full addresses, NULL for IPv4 */
     time_t timestamp;               /* the last time a packet was seen */
-    srchptr_list_t *srchptr_list;   /* current search threads */
-    extract_list_t *extract_list;   /* list of current files being extracted */
-    struct hash_table_node *next;   /* next entry in the list */
-    struct hash_table_node *prev;   /* prev entry in the list */
+    ht_flow_t flow[2];              /* src -> dst, dst -> src */
+    time_t expires;                 /* when our timer wheel slot fires */
+    struct hash_table_node *tw_next;    /* next entry in timer wheel slot */
+    struct hash_table_node **tw_pprev;  /* whoever points at us */
 };
 typedef struct hash_table_node ht_node_t;
 
+/*
+ * A slot in the session table.  The key lives inline next to its hash so
+ * a probe never has to chase the node pointer to rule out a mismatch; 
+ * sessions themselves stay put when slots get shuffled around.
+ */
+struct hash_table_slot
+{
+    uint32_t hash;                  /* full hash of ft */
+    four_tuple_t ft;                /* key */
+    ht_node_t *node;                /* the session, NULL if slot is empty */
+};
+typedef struct hash_table_slot ht_slot_t;
+
+/** open addressed, Robin Hood, linear probing session table */
+struct hash_table
+{
+    ht_slot_t *slots;               /* size slots */
+    uint32_t size;                  /* number of slots, a power of 2 */
+    uint32_t mask;                  /* size - 1 */
+    uint32_t entries;               /* occupied slots */
+    uint32_t longest_probe;         /* longest probe sequence seen */
+    uint32_t grows;                 /* number of times we doubled */
+};
+typedef struct hash_table ht_t;
+
+/*
+ * Hierarchical timing wheel for session expiry, in packet time.  Sessions
+ * are filed by when they would expire if they went quiet and are not moved
+ * when packets arrive; when their slot fires they're either expired or
+ * filed again, so each tick only touches sessions that are due.
+ */
+struct timer_wheel
+{
+    time_t now;                     /* the last second we processed */
+    ht_node_t *slot[NFEX_TW_LEVELS][NFEX_TW_SLOTS];
+};
+typedef struct timer_wheel tw_t;
+
 #endif /* HASH_H */
@@ -0,0 +1,126 @@
+/*
+ * index.h - extraction index
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include "ring.h"
+#include "search.h"
+#include "digest.h"
+
+#define NFEX_INDEX_RING     (256 * 1024)  /** bytes of records, per worker */
+#define NFEX_INDEX_BATCH    1024          /** records written in one go */
+#define NFEX_INDEX_BUF      (64 * 1024)   /** stdio buffer for the file */
+#define NFEX_INDEX_SECS     1             /** write at least this often */
+#define NFEX_INDEX_IDLE_USEC 10000        /** index thread nap when empty */
+#define NFEX_INDEX_VERSION  2             /** binary format */
+#define NFEX_INDEX_SOURCE   240           /** capture source, binary header */
+
+/** index file formats */
+#define INDEX_CSV           0             /** source, time, from, to, file... */
+#define INDEX_JSON          1             /** one JSON object a line */
+#define INDEX_BINARY        2             /** index_hdr_t, index_rec_t[] */
+
+/** with the content addressed store the file is sha256.ext, and it was */
+#define INDEX_STORE_NEW     1             /** put there by this extraction */
+#define INDEX_STORE_DUP     2             /** already there, this is a copy */
+
+/*
+ * One extracted file, queued by the worker once it's done with it.  This
+ * is also, as is, what the binary index is made of: fixed width in host
+ * byte order, so the file can be mapped and searched by timestamp (when
+ * the file was finished, the order records are written in, as long as
+ * the capture's own timestamps never go backwards).  Addresses
+ * are as they were on the wire, IPv4 in the first four bytes.  Digests
+ * that weren't asked for are left zeroed and their bit clear.
+ */
+struct index_rec
+{
+    int64_t ts_sec;                 /* capture time it was finished */
+    uint32_t ts_usec;
+    uint32_t filenum;               /* pid-filenum.ext is the file */
+    int64_t start_sec;              /* capture time its header was seen */
+    uint32_t start_usec;
+    uint8_t family;                 /* 4 or 6 */
+    uint8_t digests;                /* DIGEST_ bits filled in below */
+    uint8_t store;                  /* INDEX_STORE_*, 0 outside the store */
+    uint8_t pad;
+    uint64_t size;                  /* bytes extracted */
+    uint8_t src[16];                /* whoever sent it */
+    uint8_t dst[16];                /* whoever got it */
+    uint16_t sport;                 /* host order */
+    uint16_t dport;
+    char ext[SRCH_EXT_MAX];
+    uint8_t md5[DIGEST_MD5_LEN];
+    uint8_t sha1[DIGEST_SHA1_LEN];
+    uint8_t sha256[DIGEST_SHA256_LEN];
+};
+typedef struct index_rec index_rec_t;
+
+/** binary index files start with this, the records follow */
+struct index_hdr
+{
+    char magic[4];                  /* "NFXI" */
+    uint16_t version;               /* NFEX_INDEX_VERSION */
+    uint16_t reclen;                /* sizeof (index_rec_t) */
+    uint32_t order;                 /* 0x01020304, in the writer's order */
+    uint32_t pid;                   /* the pid in every file name */
+    char source[NFEX_INDEX_SOURCE]; /* capture file, or "live-capture" */
+};
+typedef struct index_hdr index_hdr_t;
+
+/** how far a worker has got, so the index thread knows what can't come */
+struct index_clock
+{
+    int64_t now;                    /* worker: capture time, usec */
+    int64_t seen;                   /* index thread: now, last it looked */
+    time_t moved;                   /* and when (wall clock) that changed */
+};
+typedef struct index_clock index_clock_t;
+
+/*
+ * The index file, written by a thread of its own.  Each worker queues
+ * records on a ring only it fills, in capture time order, and after every
+ * batch says how far it's got.  Nothing a worker queues later can be
+ * older than that, so the index thread holds records back until every
+ * worker is past them and writes them out merged, NFEX_INDEX_BATCH at a
+ * time or at least every NFEX_INDEX_SECS.  A worker that hasn't moved in
+ * NFEX_INDEX_SECS has nothing queued for it and holds nobody up.
+ */
+struct index
+{
+    pthread_t thread;               /* the index thread */
+    int running;                    /* thread was started */
+    int format;                     /* INDEX_* */
+    FILE *fp;                       /* the file */
+    char *source;                   /* capture file, or "live-capture" */
+    pid_t pid;
+    ring_t *rings;                  /* one per worker */
+    index_clock_t *clocks;          /* and how far each has got */
+    int nrings;
+    index_rec_t *pend;              /* gathered up, in capture time order */
+    uint32_t npend;
+    uint32_t maxpend;               /* room in pend, grows as need be */
+    time_t last;                    /* last time we wrote */
+    uint32_t records;               /* written so far */
+};
+typedef struct index index_t;
+
+int index_init(index_t *, int, const char *, char *, int, char *);
+void index_add(index_t *, int, index_rec_t *);
+void index_clock(index_t *, int, struct timeval *);
+void index_shutdown(index_t *);
+
+#endif /* INDEX_H */
@@ -0,0 +1,50 @@
+/*
+ * link.h - link layer decoders
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef LINK_H
+#define LINK_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+#define NFEX_LINK_TAGS_MAX  8           /** VLAN tags and MPLS labels */
+#define NFEX_LINK_ERR       -1          /** frame cut short */
+
+/** the datalinks pcap won't name for us everywhere */
+#ifndef DLT_LINUX_SLL2
+#define DLT_LINUX_SLL2      276
+#endif
+#ifndef DLT_IPV4
+#define DLT_IPV4            228
+#endif
+#ifndef DLT_IPV6
+#define DLT_IPV6            229
+#endif
+
+/*
+ * Find the network layer in a frame.  Returns its offset and puts its
+ * ethertype (host order) in the last argument; anything that isn't IPv4
+ * or IPv6 gets a type of 0.  NFEX_LINK_ERR if the frame is too short to
+ * tell.  VLAN/QinQ tags and MPLS label stacks are stripped on the way.
+ */
+typedef int (*link_decode_t)(const uint8_t *, uint32_t, uint16_t *);
+
+/** one datalink we know how to take apart */
+struct link
+{
+    int dlt;                        /* pcap DLT_ */
+    char *name;                     /* for the startup banner */
+    char *filter;                   /* default pcap filter */
+    link_decode_t decode;           /* the decoder */
+};
+typedef struct link link_t;
+
+link_t *link_select(int);
+
+#endif /* LINK_H */
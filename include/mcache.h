@@ -0,0 +1,56 @@
+/*
+ * mcache.h - compiled search machine cache
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef MCACHE_H
+#define MCACHE_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#define NFEX_MCACHE_MAGIC   "nfexsm\r\n"      /** catches text mode mangling */
+#define NFEX_MCACHE_VERSION 2                 /** bump on any layout change */
+#define NFEX_MCACHE_SUFFIX  ".cache"          /** next to the config file */
+#define NFEX_MCACHE_ALIGN   64                /** sections start on a line */
+
+/*
+ * A cache file is this header followed by the machine's tables, each at
+ * an offset from the start of the file.  Nothing in it is a pointer, so
+ * the tables are used right where they're mapped.  The file is only good
+ * for the config file that hashes to key, compiled by a build of nfex
+ * with the same layout.
+ */
+struct mcache_hdr
+{
+    char magic[8];                  /* NFEX_MCACHE_MAGIC */
+    uint32_t version;               /* NFEX_MCACHE_VERSION */
+    uint16_t hdr_size;              /* sizeof (mcache_hdr_t) */
+    uint16_t sparse_size;           /* sizeof (srch_sparse_t) */
+    uint16_t match_size;            /* sizeof (srch_match_t) */
+    uint16_t pad;
+    uint32_t nstates;               /* srch_machine_t fields */
+    uint32_t nmatches;
+    uint32_t nclasses;
+    uint32_t shift;
+    uint32_t ndense;
+    uint64_t key;                   /* hash of the config file */
+    uint64_t stream_depth;          /* depth(n) from the config file */
+    uint64_t bypass_depth;          /* what search_depth() made of it */
+    uint64_t trans;                 /* table offsets */
+    uint64_t sparse;
+    uint64_t mfirst;
+    uint64_t mcount;
+    uint64_t match;
+    uint64_t size;                  /* the whole file */
+    uint8_t class[256];
+    uint8_t lead[256];
+};
+typedef struct mcache_hdr mcache_hdr_t;
+
+#endif /* MCACHE_H */
@@ -37,7 +37,17 @@
 #include <sys/ioctl.h>
 #include <sys/resource.h>
 #include <termios.h>
+#include <pthread.h>
 #include "hash.h"
+#include "ring.h"
+#include "writer.h"
+#include "tpacket.h"
+#include "ebpf.h"
+#include "mcache.h"
+#include "link.h"
+#include "frag.h"
+#include "index.h"
+#include "store.h"
 #include "config.h"
 
 #if (HAVE_GEOIP)
@@ -52,8 +62,26 @@
 #define NFEX_DEFAULT_CONFIG_FILE "/usr/local/etc/nfex/nfex.conf"
 #endif
 
-/** as we add more protocols this needs to change */
-#define NFEX_PCAP_FILTER "tcp"
+/**
+ * as we add more protocols this needs to change; "tcp" alone misses TCP
+ * behind IPv6 extension headers, so the rest of IPv6 is let through too.
+ * A vlan keyword shifts every offset after it, so tagged traffic (one or
+ * two tags) goes last.  pcap can only do that on some datalinks.
+ */
+#define NFEX_PCAP_FILTER      "tcp or (ip6 and not udp and not icmp6)"
+#define NFEX_PCAP_FILTER_VLAN NFEX_PCAP_FILTER                            \
+    " or (vlan and (tcp or ip6 or (vlan and (tcp or ip6))))"
+#define NFEX_SNAPLEN     65535
+
+#define NFEX_MAX_WORKERS      64                 /** flow sharding threads */
+#define NFEX_WORKER_RING_SIZE (16 * 1024 * 1024) /** bytes of queued packets */
+#define NFEX_WORKER_BATCH     64                 /** packets per lock hold */
+#define NFEX_BATCH_MAX        256                /** packets per pipeline */
+#ifndef NFEX_BATCH
+#define NFEX_BATCH            32                 /** default, -B overrides */
+#endif
+#define NFEX_BATCH_COPY       (1024 * 1024)      /** transient packet bytes */
+#define NFEX_IP6_EXT_MAX      8                  /** IPv6 headers we'll walk */
 
 /* BEGIN MACROS */
 /** simple way to subtract timeval based timers */
@@ -72,6 +100,9 @@
 #ifndef MAX
 #define MAX( x, y ) ((x) > (y) ? (x) : (y))
 #endif
+#ifndef MIN
+#define MIN( x, y ) ((x) < (y) ? (x) : (y))
+#endif
 /* END MACROS */
 
 /** statistics */
@@ -82,42 +113,167 @@ struct nfex_statistics
     uint32_t total_files;             /* total files extracted */
     uint32_t packet_errors;           /* packet-level errors */
     uint32_t extraction_errors;       /* extraction errors */
-    uint32_t ht_entries;              /* hash table: number of entries */
-    uint32_t ht_nc;                   /* hash table: non-chained entries */
-    uint32_t ht_ic;                   /* hash table: chained entries */
-    uint32_t ht_lc;                   /* hash table: longest chain */
+    uint32_t ht_inserts;              /* hash table: sessions created */
+    uint32_t ht_expired;              /* hash table: sessions expired */
+    uint32_t reasm_ooo;               /* segments queued out of order */
+    uint32_t reasm_dups;              /* segments dropped as duplicates */
+    uint32_t reasm_gaps;              /* holes we gave up waiting on */
+    uint32_t bypass_sessions;         /* sessions past stream depth */
+    uint32_t bypass_packets;          /* packets we didn't look at */
+    uint64_t bypass_bytes;            /* and their payload */
+    uint32_t frag_packets;            /* IPv4 fragments seen */
+    uint32_t frag_datagrams;          /* and put back together */
+    uint32_t frag_timeouts;           /* datagrams we gave up waiting on */
+    uint32_t frag_drops;              /* bad fragments, or no room */
+    uint32_t xbuf_writes;             /* staged extraction data written */
+    uint32_t xbuf_evictions;          /* written early to free a buffer */
+    uint32_t store_dups;              /* files the store already had */
+    uint64_t store_bytes;             /* and their size */
+    uint32_t batches;                 /* packet batches run */
+    uint32_t batch_packets;           /* packets that went through them */
+    uint64_t cycles_parse;            /* batch stages: header decode */
+    uint64_t cycles_lookup;           /* session table */
+    uint64_t cycles_stream;           /* reassembly, search and extract */
     struct timeval ts_start;          /* total uptime timestamp */
     struct timeval ts_last;           /* last file extracted timestamp */
     uint32_t ip_last;                 /* last packet seen ip */
 };
 typedef struct nfex_statistics n_stats_t;
 
+/*
+ * Everything the config file compiles down to.  Workers only ever see one
+ * through ncc->sc, a reload builds a new one off to the side and swaps it
+ * in whole.  The old one is freed once every worker has moved past it.
+ */
+struct nfex_search_config
+{
+    srch_machine_t *sm;               /* compiled search machine */
+    u_long stream_depth;              /* global stream depth, 0 is none */
+    u_long bypass_depth;              /* stop searching sessions here */
+    uint8_t dirs;                     /* SRCH_DIR_ bits worth searching */
+    uint32_t epoch;                   /* bumped on every reload */
+    struct nfex_search_config *next;  /* retired, waiting on the workers */
+};
+typedef struct nfex_search_config nsc_t;
+
+/** one packet on its way through a batch, filled in a stage at a time */
+struct nfex_packet
+{
+    struct pcap_pkthdr h;             /* capture header */
+    const u_char *packet;             /* the frame, or our copy of it */
+    const uint8_t *payload;           /* TCP payload */
+    int32_t payload_size;             /* and how much of it was captured */
+    uint32_t seq;                     /* TCP sequence number */
+    uint8_t th_flags;                 /* TCP flags */
+    uint8_t dir;                      /* 1 if going dst -> src of ft */
+    four_tuple_t ft;                  /* session key, canonical order */
+    const uint8_t *ip6;               /* IPv6 addresses, NULL for IPv4 */
+    uint32_t hash;                    /* ht_hash(&ft, ip6 != NULL) */
+    ht_node_t *session;               /* once it's been looked up */
+};
+typedef struct nfex_packet npkt_t;
+
+/*
+ * Packets are taken a batch at a time: every header is decoded and every
+ * session slot prefetched before any of them are looked up, and every
+ * session looked up before any stream work starts, so the cache misses of
+ * one stage overlap across the batch instead of being paid one by one.
+ */
+struct nfex_batch
+{
+    npkt_t pkt[NFEX_BATCH_MAX];       /* packets waiting */
+    int n;                            /* how many */
+    uint8_t *copy;                    /* for packets the caller will reuse */
+    size_t copied;                    /* bytes of it in use */
+};
+typedef struct nfex_batch nbatch_t;
+
+#define NFEX_RELOAD_IDLE    0         /** no reload thread */
+#define NFEX_RELOAD_RUNNING 1         /** building a new search config */
+#define NFEX_RELOAD_DONE    2         /** built (or failed), join it */
+
+/*
+ * worker context, one per flow shard.  A worker owns every session that 
+ * hashes to it along with their search state and extractions, so nothing
+ * in here is shared with the other workers.
+ */
+struct nfex_worker_context
+{
+    struct nfex_control_context *ncc; /* shared, read-mostly */
+    int id;                           /* worker number */
+    pthread_t thread;                 /* worker thread (if threaded) */
+    int running;                      /* thread was started */
+    int stop;                         /* time to wrap it up */
+    ring_t ring;                      /* packets from the capture thread */
+    tpacket_t tp;                     /* or our own capture ring */
+    pthread_mutex_t lock;             /* held while processing packets */
+    ht_t ht;                          /* our hash table of sessions */
+    tw_t tw;                          /* session expiry timer wheel */
+    time_t now;                       /* packet clock, from pcap headers */
+    nsc_t *sc;                        /* search config we're running */
+    uint32_t epoch;                   /* its epoch, read by the reclaimer */
+    ht_node_t *session;               /* current session in focus */
+    reasm_pool_t reasm;               /* out of order data we're holding */
+    frag_cache_t frag;                /* IPv4 fragments we're holding */
+    nbatch_t batch;                   /* packets on their way through */
+    pool_t sessions;                  /* ht_node_t */
+    pool_t extracts;                  /* extract_list_t */
+    xbuf_cache_t xbufs;               /* their staging buffers */
+    pool_t addrs;                     /* ip6_pair_t, IPv6 sessions only */
+    arena_t results;                  /* srch_results_t, per stream chunk */
+    writer_t writer;                  /* asynchronous extraction writer */
+    n_stats_t stats;                  /* this worker's share of the stats */
+};
+typedef struct nfex_worker_context nwc_t;
+
 /** monolithic opaque control context, everything imporant is here */
 struct nfex_control_context
 {
     pcap_t *p;                        /* pcap context */
     int pcap_fd;                      /* pcap fd used to select across */
     char *device;                     /* pcap device */
-    ht_node_t *ht[NFEX_HT_SIZE];      /* our hash table of sessions */
-    ht_node_t *session;               /* current session in focus */
-    srch_node_t *srch_machine;
+    int nworkers;                     /* number of flow shards */
+    nwc_t *workers;                   /* and their contexts */
+    srch_node_t *srch_tree;           /* search parse tree, config time */
+    srch_depth_t *srch_depths;        /* per file type depths, directions */
+    u_long stream_depth;              /* global stream depth, config time */
+    uint8_t stream_dir;               /* global direction, config time */
+    nsc_t *sc;                        /* search config, swapped on reload */
+    nsc_t *retired;                   /* replaced ones still in use */
+    nsc_t *reload_sc;                 /* what the reload thread built */
+    pthread_t reload_thread;          /* builds it in the background */
+    int reload_state;                 /* NFEX_RELOAD_* */
     struct termios term;              /* save terminal info to restore later */
     uint16_t flags;                   /* control context flags */
 #define NFEX_VERBOSE       0x0001     /* toggle verbosity */
 #define NFEX_GEOIP         0x0002     /* toggle geoIP mode */
 #define NFEX_DEBUG         0x0004     /* debug mode */
 #define NFEX_SESSIONS_LOCK 0x0008     /* locked, don't go in here */
+#define NFEX_TPACKET       0x0010     /* capture from TPACKET_V3 rings */
+#define NFEX_EBPF          0x0020     /* bypass flows in the kernel */
+#define NFEX_NO_URING      0x0040     /* writer threads, not io_uring */
+#define NFEX_STORE         0x0080     /* content addressed output */
     FILE *log;                        /* logfile FILE descriptor */
 #if (HAVE_GEOIP)
     GeoIP *gi;                        /* geoip database pointer */
     char geoip_data[128];             /* geoip database path */
 #endif /** HAVE_GEOIP */
     char yyinfname[128];
+    char mcachefname[136];            /* compiled search machine cache */
     char output_dir[128];             /* output directory prefix */
-    u_int16_t filenum;                /* number of files we've written */
+    uint32_t filenum;                 /* number of files we've written */
     char indexfname[128];
-    FILE *indexfp;
+    index_t index;                    /* and its writer */
+    uint8_t digests;                  /* DIGEST_ bits to index */
+    store_t store;                    /* what's in the store, with -C */
     char capfname[128];               /* pcap capture file name */
+    struct bpf_program filter;        /* compiled capture filter */
+    link_t *link;                     /* decoder for the datalink */
+    frag_cache_t frag;                /* fragments, before sharding */
+    int ring_mb;                      /* capture buffer size */
+    int fanout;                       /* PACKET_FANOUT group, -1 for none */
+    int batch;                        /* packets per batch */
+    ebpf_t ebpf;                      /* kernel side flow bypass */
     off_t capfsize;                   /* size of capfile */
     n_stats_t stats;                  /* stats */
     char errbuf[PCAP_ERRBUF_SIZE];    /* bad things reported here */
@@ -126,13 +282,31 @@ typedef struct nfex_control_context ncc_t;
 
 /** call back when we have a packet */
 void process_packet(u_char *, const struct pcap_pkthdr *, const u_char *);
+void process_batch_end(u_char *);
+void worker_batch_add(nwc_t *, const struct pcap_pkthdr *, const u_char *);
+void worker_batch_flush(nwc_t *);
 void quit_signal(int);
 
 /** initialization functions */
 ncc_t *control_context_init(char *, char *, char *, char *, char *, char *,
-uint16_t, char *);
+uint16_t, int, int, int, int, int, int, int, int, char *);
 void control_context_destroy(ncc_t *);
 
+/** configuration functions */
+nsc_t *config_load(ncc_t *, int);
+void config_free(nsc_t *);
+int config_reload(ncc_t *);
+void config_reload_signal(int);
+void config_reload_poll(ncc_t *);
+void config_destroy(ncc_t *);
+
+/** worker functions */
+int workers_init(ncc_t *, int, int, char *);
+void worker_config_sync(nwc_t *);
+void workers_stop(ncc_t *);
+void workers_destroy(ncc_t *);
+void worker_enqueue(nwc_t *, const struct pcap_pkthdr *, const u_char *);
+
 /** main loop functions */
 int the_game(ncc_t *);
 int process_keypress(ncc_t *);
@@ -174,23 +348,48 @@ int log_init(char *logfile, ncc_t *ncc);
 void log_msg(u_int8_t priority, ncc_t *ncc, char *fmt, ...);
 void log_close(ncc_t *ncc);
 
+/** IPv4 fragment reassembly functions */
+void frag_init(frag_cache_t *, uint64_t);
+uint8_t *frag_add(frag_cache_t *, const uint8_t *, uint32_t, time_t, uint32_t,
+uint32_t *, n_stats_t *);
+void frag_release(frag_cache_t *);
+void frag_destroy(frag_cache_t *);
+
+/** stream reassembly functions */
+int reasm_syn(nwc_t *, ht_flow_t *, uint32_t);
+void reasm_segment(nwc_t *, ht_node_t *, ht_flow_t *, uint32_t, 
+const uint8_t *, uint32_t);
+void reasm_flush(nwc_t *, ht_node_t *, ht_flow_t *);
+void reasm_free(nwc_t *, ht_flow_t *);
+void stream_deliver(nwc_t *, ht_node_t *, ht_flow_t *, const uint8_t *, 
+uint32_t);
+
+/** search machine cache functions */
+uint64_t mcache_key(FILE *);
+srch_machine_t *mcache_load(char *, uint64_t, u_long *, u_long *);
+int mcache_save(srch_machine_t *, char *, uint64_t, u_long, u_long);
+
 /** extraction functions */
 static void add_extract(extract_list_t **, fileid_t *, ht_node_t *, int, int,
-ncc_t *);
+int, nwc_t *);
 static void set_segment_marks(extract_list_t *, size_t);
 static void mark_footer(extract_list_t *, srch_results_t *);
-static void extract_segment(extract_list_t *, const uint8_t *, ncc_t *);
-static void sweep_extract_list(extract_list_t **);
-static  int open_extract(char *ext, uint32_t src_ip, uint16_t src_prt, 
-                         uint32_t dst_ip, uint16_t dst_prt, char **fname,
-                         ncc_t *);
-void extract(extract_list_t **elist, srch_results_t *results, 
-             ht_node_t *session, const uint8_t *data, size_t size, ncc_t *ncc);
+static void extract_segment(extract_list_t *, const uint8_t *, nwc_t *);
+static void sweep_extract_list(extract_list_t **, nwc_t *);
+static void xbuf_flush(extract_list_t *, nwc_t *);
+static void xbuf_release(extract_list_t *, nwc_t *);
+void extract_close(extract_list_t *, nwc_t *);
+static  int open_extract(char *ext, ht_node_t *session, int dir, 
+                         char **fname, index_rec_t *, nwc_t *);
+static void extract_name(char *, ncc_t *, uint32_t, const char *);
+void extract(ht_flow_t *flow, srch_results_t *results, 
+             ht_node_t *session, const uint8_t *data, size_t size, nwc_t *w);
 
 /** misc functions */
 #define NFEX_STATS_UPDATE   0
 #define NFEX_STATS_CLOSEOUT 1
 void stats(ncc_t *n, int mode);
+void stats_sum(ncc_t *n, n_stats_t *);
 void usage(char *);
 void quit_signal(int sig);
 void print_hex(uint8_t *, uint16_t);
@@ -198,14 +397,18 @@ void convert_seconds(uint32_t, uint32_t *, uint32_t *, uint32_t *,
                      uint32_t *);
 
 /** session table functions */
-ht_node_t *ht_insert(four_tuple_t *ft, ncc_t *ncc);
-ht_node_t *ht_find(four_tuple_t *ft, ncc_t *ncc);
-uint16_t ht_hash(four_tuple_t *ft);
+int ht_init(nwc_t *w);
+int ht_key(four_tuple_t *ft, const uint8_t *ip6);
+ht_node_t *ht_insert(four_tuple_t *ft, uint32_t h, const uint8_t *ip6, 
+int dir, nwc_t *w);
+ht_node_t *ht_find(four_tuple_t *ft, const uint8_t *ip6, nwc_t *w);
+uint32_t ht_hash(four_tuple_t *ft, int v6);
 uint32_t ht_count_extracts(ncc_t *ncc);
 void ht_dump(ncc_t *ncc);
-void ht_free(ncc_t *ncc);
+void ht_shutitdown(nwc_t *w);
 void ht_status(ncc_t *ncc);
-void ht_expire_session(ncc_t *ncc);
+void ht_expire_session(nwc_t *w);
+static void tw_schedule(tw_t *, ht_node_t *);
 
 #endif /** NFEX_H */
 /** EOF */
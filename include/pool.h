@@ -0,0 +1,80 @@
+/*
+ * pool.h - fixed size object pools and a bump arena
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+#define NFEX_POOL_ALIGN   16                 /** object alignment */
+#define NFEX_POOL_SLAB    256                /** objects per slab */
+#define NFEX_ARENA_BLOCK  (16 * 1024)        /** bytes per arena block */
+
+#define POOL_ROUND(n) (((n) + NFEX_POOL_ALIGN - 1) & ~(NFEX_POOL_ALIGN - 1))
+
+/** a chunk of objects carved out of one malloc() */
+struct pool_slab
+{
+    struct pool_slab *next;         /* next slab we own */
+};
+typedef struct pool_slab pool_slab_t;
+
+/*
+ * Objects of one size.  Freed objects go on a free list and come right
+ * back out again, the heap is only touched when the free list runs dry
+ * and another slab is needed.  Slabs are kept until the pool is
+ * destroyed.  Each worker has its own pools, so there's no locking.
+ */
+struct pool
+{
+    size_t size;                    /* object size, rounded up */
+    uint32_t per_slab;              /* objects per slab */
+    void *free;                     /* free list, linked through objects */
+    pool_slab_t *slabs;             /* every slab we've allocated */
+    uint32_t nslabs;                /* how many */
+    uint32_t in_use;                /* objects handed out right now */
+    uint32_t peak;                  /* high water mark */
+};
+typedef struct pool pool_t;
+
+/** a block of arena memory, bumped through and never freed piecemeal */
+struct arena_block
+{
+    struct arena_block *next;       /* next block in the arena */
+    size_t size;                    /* bytes of data */
+    size_t used;                    /* bytes handed out */
+};
+typedef struct arena_block arena_block_t;
+
+/*
+ * Short lived allocations that all die together.  arena_get() bumps a
+ * pointer, arena_reset() gives everything back at once and keeps the
+ * blocks around for next time.
+ */
+struct arena
+{
+    arena_block_t *head;            /* first block */
+    arena_block_t *cur;             /* block we're allocating from */
+    size_t used;                    /* bytes handed out since reset */
+    size_t peak;                    /* high water mark */
+    size_t size;                    /* bytes in all blocks */
+};
+typedef struct arena arena_t;
+
+void pool_init(pool_t *, size_t, uint32_t);
+void *pool_get(pool_t *);
+void pool_put(pool_t *, void *);
+void pool_destroy(pool_t *);
+void arena_init(arena_t *);
+void *arena_get(arena_t *, size_t);
+void arena_reset(arena_t *);
+void arena_destroy(arena_t *);
+
+#endif /* POOL_H */
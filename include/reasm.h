@@ -0,0 +1,60 @@
+/*
+ * reasm.h - TCP stream reassembly
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef REASM_H
+#define REASM_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+#define NFEX_REASM_FLOW_MAX (256 * 1024)        /** bytes held per stream */
+#define NFEX_REASM_MAX      (64 * 1024 * 1024)  /** bytes held, all workers */
+
+/** sequence space comparisons, these wrap */
+#define SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((int32_t)((a) - (b)) > 0)
+
+/** an out of order segment waiting for the hole in front of it to fill */
+struct reasm_segment
+{
+    struct reasm_segment *next;     /* next one up in sequence space */
+    uint32_t seq;                   /* first byte */
+    uint32_t len;                   /* bytes of data */
+    uint8_t data[];
+};
+typedef struct reasm_segment reasm_seg_t;
+
+/*
+ * Reassembly state for one direction of a connection.  next_seq is the
+ * next byte we'll hand to the search machine, everything past it waits
+ * in segs, sorted by sequence number.
+ */
+struct reasm_stream
+{
+    uint8_t state;
+#define REASM_NONE   0              /* haven't seen anything yet */
+#define REASM_SYNCED 1              /* next_seq is good */
+    uint32_t isn;                   /* initial sequence number, if seen */
+    uint32_t next_seq;              /* next byte expected */
+    uint32_t queued;                /* bytes sitting in segs */
+    reasm_seg_t *segs;              /* out of order segments */
+};
+typedef struct reasm_stream reasm_t;
+
+/** what a worker's streams hold between them, bounded */
+struct reasm_pool
+{
+    uint64_t bytes;                 /* held right now */
+    uint64_t max;                   /* this worker's share of the cap */
+    uint64_t peak;                  /* high water mark */
+};
+typedef struct reasm_pool reasm_pool_t;
+
+#endif /* REASM_H */
@@ -0,0 +1,54 @@
+/*
+ * ring.h - lock-free single producer, single consumer byte ring
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+#define NFEX_RING_ALIGN   16                 /** record alignment */
+#define NFEX_RING_WRAP    0xffffffff         /** rest of the ring is unused */
+#define NFEX_RING_IDLE_USEC 1000             /** consumer nap when empty */
+
+/** every record starts with one of these, the payload follows */
+struct ring_record
+{
+    uint32_t len;                   /* payload bytes, or NFEX_RING_WRAP */
+    uint32_t pad[3];                /* keep payload NFEX_RING_ALIGN aligned */
+};
+typedef struct ring_record ring_record_t;
+
+/*
+ * Variable sized records in a power of two sized buffer.  head and tail
+ * only ever increase, so head - tail is the number of bytes in flight and
+ * neither side ever takes a lock: the producer owns head, the consumer
+ * owns tail and each only reads the other's.
+ */
+struct ring
+{
+    uint8_t *buf;                   /* size bytes of records */
+    uint64_t size;                  /* a power of 2 */
+    uint64_t head;                  /* producer offset */
+    uint64_t tail;                  /* consumer offset */
+    uint64_t reserved;              /* producer: offset of pending record */
+    uint32_t stalls;                /* times the producer had to wait */
+    int done;                       /* producer is finished for good */
+};
+typedef struct ring ring_t;
+
+int ring_init(ring_t *, uint64_t);
+void ring_free(ring_t *);
+void *ring_reserve(ring_t *, uint32_t);
+void ring_commit(ring_t *);
+void *ring_peek(ring_t *, uint64_t *, uint32_t *);
+void ring_release(ring_t *, uint64_t);
+uint64_t ring_backlog(ring_t *);
+
+#endif /* RING_H */
@@ -34,6 +34,14 @@
 
 #include <sys/types.h>
 #include <inttypes.h>
+#include <stdio.h>
+
+/** x86 builds get the SSE2/AVX2 prefilters, picked at runtime via CPUID */
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+#define NFEX_SIMD 1
+#else
+#define NFEX_SIMD 0
+#endif
 
 /** search node types */
 enum srch_nodetype
@@ -51,21 +59,40 @@ enum spectype
 } spectype;
 typedef enum spectype spectype_t;
 
-/** file identifier */
+#define SRCH_EXT_MAX      16           /* file extension, with the NUL */
+
+#define SRCH_DIR_CLIENT   0x01         /* client to server */
+#define SRCH_DIR_SERVER   0x02         /* server to client */
+#define SRCH_DIR_BOTH     0x03
+
+/** file identifier, no pointers so a machine can be mapped from disk */
 struct fileid
 {
     int id;           /* id number of search pattern */
-    char *ext;        /* file extension canonical type */
+    char ext[SRCH_EXT_MAX]; /* file extension canonical type */
     u_long maxlen;    /* maximum length of file */
     size_t len;       /* the length of the HEADER or FOOTER */
+    u_long depth;     /* HEADERs past this far into a stream don't count */
+    uint8_t dir;      /* SRCH_DIR_ bits, which way the file has to travel */
 };
 typedef struct fileid fileid_t;
 
-/** the compiled form of a set of search keywords */
+/** a per file type stream depth or direction from the config file */
+struct srch_depth
+{
+    struct srch_depth *next;
+    char *ext;        /* file extension it applies to */
+    u_long depth;     /* bytes, 0 for no limit */
+    uint8_t dir;      /* SRCH_DIR_ bits for a direction rule, 0 for depth */
+};
+typedef struct srch_depth srch_depth_t;
+
+/** the parse tree form of a set of search keywords */
 struct srch_node
 {
     srch_nodetype_t nodetype;          /* node type */
     spectype_t spectype;               /* specifier type */
+    uint32_t n;                        /* node number, used by search_build */
     union
     {
         struct srch_node *table[256];  /* table of search node pointers */
@@ -74,14 +101,74 @@ struct srch_node
 };
 typedef struct srch_node srch_node_t;
 
-/** the list of concurrent search threads */
-struct srchptr_list
+/** a pattern match emitted when the search machine enters a state */
+struct srch_match
+{
+    fileid_t fileid;                   /* file identifier */
+    spectype_t spectype;               /* specifier type */
+};
+typedef struct srch_match srch_match_t;
+
+/** past this many distinct first bytes the SIMD compare isn't worth it */
+#define SRCH_PREFILTER_MAX 8
+
+/** exceptions a sparse state can hold before it gets a full row */
+#define SRCH_SPARSE_MAX 6              /* 8 at the most */
+#define SRCH_DENSE      0xffffffff     /* no base, the state gets a row */
+#define SRCH_DENSE_MAX  (256 * 1024)   /* bytes of rows for shallow states */
+
+/*
+ * A state that behaves like some smaller state (the same partial matches
+ * less one) on all but a few bytes: it just lists those, anything else is
+ * looked up in the base state.
+ */
+struct srch_sparse
+{
+    uint64_t class;                    /* byte classes that differ, packed */
+    uint32_t base;                     /* state for every other byte */
+    uint32_t n;                        /* number of exceptions */
+    uint32_t next[SRCH_SPARSE_MAX];    /* and where they go */
+};
+typedef struct srch_sparse srch_sparse_t;
+
+/*
+ * the compiled form of a set of search keywords: the parse tree determinized
+ * into a single contiguous transition table.  Each session carries a single
+ * state number and every byte costs a table lookup or two.  Bytes that
+ * no keyword tells apart share a column.  States that differ from every
+ * smaller state on lots of bytes (the start state, wildcards) get a full
+ * row, as do the shallowest states while there's room, the rest are
+ * sparse.  Rows are padded to a power of 2 columns so finding one is a
+ * shift.  Dense states are numbered first, then the sparse ones.
+ */
+struct srch_machine
 {
-    struct srchptr_list *next;         /* next entry in the list */
-    struct srchptr_list *prev;         /* prev entry in the list */
-    srch_node_t *node;                 /* a search node set */
+    uint32_t nstates;                  /* number of states */
+    uint32_t nmatches;                 /* number of entries in match */
+    uint32_t nclasses;                 /* byte equivalence classes */
+    uint32_t shift;                    /* log2 of the row width */
+    uint8_t class[256];                /* byte -> class, the column */
+    uint32_t ndense;                   /* states with a full row */
+    uint32_t *trans;                   /* ndense x columns next state table */
+    srch_sparse_t *sparse;             /* nstates - ndense sparse states */
+    uint32_t *mfirst;                  /* per state index into match */
+    uint32_t *mcount;                  /* per state number of matches */
+    srch_match_t *match;               /* match table */
+    size_t size;                       /* bytes of all of the above */
+    uint8_t lead[256];                 /* bytes that leave the start state */
+    uint32_t nfirst;                   /* how many of them there are */
+    uint8_t first[SRCH_PREFILTER_MAX]; /* and those bytes, if few enough */
+    char *skip_name;                   /* name of the prefilter in use */
+    size_t (*skip)(struct srch_machine *, uint8_t *, size_t, size_t);
+    void *map;                         /* tables mapped from a cache file */
+    size_t maplen;                     /* and how big the mapping is */
 };
-typedef struct srchptr_list srchptr_list_t;
+typedef struct srch_machine srch_machine_t;
+
+#define SRCH_STATE_START  0x00000000   /* every session starts here */
+#define SRCH_STATE_MATCH  0x80000000   /* set in trans: state emits matches */
+#define SRCH_STATE_MASK   0x7fffffff   /* state number bits */
+#define SRCH_MAX_STATES   0x00040000   /* bail out past 256MB of table */
 
 struct srch_results
 {
@@ -98,17 +185,33 @@ struct srch_results
 typedef struct srch_results srch_results_t;
 
 void search_compile(srch_node_t **, int, char *, u_long, char *, spectype_t);
-extern srch_results_t *search(srch_node_t *, srchptr_list_t **, uint8_t *, 
-size_t);
-extern void free_results_list(srch_results_t **);
+srch_machine_t *search_build(srch_node_t **);
+void search_free(srch_machine_t *);
+u_long search_depth(srch_machine_t *, srch_depth_t *, u_long, uint8_t);
+uint8_t search_dirs(srch_machine_t *);
+void search_dump(srch_machine_t *, FILE *);
+void search_prefilter_init(srch_machine_t *);
+extern srch_results_t *search(srch_machine_t *, arena_t *, uint32_t *, 
+uint8_t *, size_t);
 
 static srch_node_t *new_srch_node(srch_nodetype_t);
 static srch_node_t *add_simple(srch_node_t *, uint8_t, int, int, char *,
 unsigned long, spectype_t);
 static srch_node_t *add_wildcard(srch_node_t *, int, int, char *,
 unsigned long, spectype_t);
-static void update_search(srch_node_t *, srchptr_list_t **, srch_results_t **,
-uint8_t, int);
-static void add_result(srch_results_t **, fileid_t *, spectype_t, int);
+static void number_srch_nodes(srch_node_t *, srch_node_t ***, uint32_t *, 
+uint32_t *);
+static uint32_t search_classes(srch_node_t **, uint32_t, uint8_t *, 
+uint8_t *);
+static uint32_t search_find(uint32_t *, uint32_t, uint32_t *, uint32_t *,
+uint32_t *, uint32_t *, uint32_t);
+static void search_pack(srch_machine_t *, uint32_t *, uint32_t *);
+static void add_result(arena_t *, srch_results_t **, fileid_t *, spectype_t,
+int);
+static size_t skip_scalar(srch_machine_t *, uint8_t *, size_t, size_t);
+#if (NFEX_SIMD)
+static size_t skip_sse2(srch_machine_t *, uint8_t *, size_t, size_t);
+static size_t skip_avx2(srch_machine_t *, uint8_t *, size_t, size_t);
+#endif /** NFEX_SIMD */
 
 #endif /* SEARCH_H */
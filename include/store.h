@@ -0,0 +1,59 @@
+/*
+ * store.h - content addressed extraction store
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "search.h"
+#include "digest.h"
+
+#define NFEX_STORE_SLOTS    4096        /** table size to start with, pow2 */
+#define NFEX_STORE_MAX      (1 << 20)   /** most slots we'll grow to */
+#define NFEX_STORE_TMP      ".part"     /** suffix while being written */
+
+/** one object, sha256.ext in the output directory */
+struct store_obj
+{
+    uint8_t sha256[DIGEST_SHA256_LEN];
+    char ext[SRCH_EXT_MAX];         /* "" for an empty slot */
+    uint8_t state;
+#define STORE_PENDING   1           /* a copy is on its way to the writer */
+#define STORE_HAVE      2           /* it's in the directory */
+};
+typedef struct store_obj store_obj_t;
+
+/*
+ * The objects in the store, shared by every worker.  Files are written
+ * under a temporary name and, once their SHA-256 is known, linked in as
+ * sha256.ext; if that's already here the copy is thrown away.  This table
+ * is what we know is here, it's read from the directory at startup and
+ * keeps up as objects are added.  An object is only here once the writer
+ * says it linked it in, until then copies of it are written out in full
+ * too and the link failing with EEXIST is what finds the duplicate, as it
+ * is once the table hits the cap.  It only saves work.
+ */
+struct store
+{
+    pthread_mutex_t lock;
+    store_obj_t *slots;             /* open addressed by digest */
+    uint32_t size;                  /* slots, pow2 */
+    uint32_t count;                 /* in use */
+};
+typedef struct store store_t;
+
+int store_init(store_t *, const char *, char *);
+int store_add(store_t *, const uint8_t *, const char *);
+void store_done(store_t *, const char *, int);
+char *store_name(char *, size_t, const char *, const uint8_t *, const char *);
+void store_destroy(store_t *);
+
+#endif /* STORE_H */
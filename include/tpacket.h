@@ -0,0 +1,57 @@
+/*
+ * tpacket.h - Linux AF_PACKET TPACKET_V3 capture ring
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef TPACKET_H
+#define TPACKET_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <pcap.h>
+
+#if defined(__linux__)
+#include <linux/if_packet.h>
+#if defined(TPACKET3_HDRLEN) && defined(PACKET_FANOUT)
+#define HAVE_TPACKET3 1
+#endif
+#endif
+
+#define NFEX_TP_RING_MB       64               /** default ring, per socket */
+#define NFEX_TP_BLOCK_SIZE    (1 << 22)        /** 4MB blocks */
+#define NFEX_TP_FRAME_SIZE    (1 << 11)        /** nominal, v3 packs frames */
+#define NFEX_TP_BLOCK_TOV     64               /** ms before a block retires */
+#define NFEX_TP_SNAPLEN       65535            /** never truncate payloads */
+
+/*
+ * One mmap'd receive ring.  The kernel fills whole blocks of packets and
+ * hands them over by flipping the block status, we read the packets in
+ * place and flip it back.
+ */
+struct tpacket
+{
+    int fd;                         /* AF_PACKET socket */
+    uint8_t *map;                   /* the ring */
+    size_t map_len;                 /* its length */
+    uint32_t block_size;            /* bytes per block */
+    uint32_t nblocks;               /* blocks in the ring */
+    uint32_t cur;                   /* next block we expect back */
+    int fanout;                     /* fanout group id, -1 for none */
+    uint32_t packets;               /* kernel counters, see tpacket_stats() */
+    uint32_t drops;
+    uint32_t freezes;
+};
+typedef struct tpacket tpacket_t;
+
+int tpacket_open(tpacket_t *, char *, int, int, struct bpf_program *, char *);
+int tpacket_datalink(char *, char *);
+int tpacket_dispatch(tpacket_t *, pcap_handler, void (*)(u_char *), u_char *);
+int tpacket_wait(tpacket_t *, int);
+void tpacket_stats(tpacket_t *);
+void tpacket_close(tpacket_t *);
+
+#endif /* TPACKET_H */
@@ -0,0 +1,118 @@
+/*
+ * uring.h - io_uring extraction output
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <time.h>
+#include "pool.h"
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/** CQE_SKIP is 5.17, older headers lack the fixed slots or linkat we use */
+#if defined(IORING_FEAT_CQE_SKIP)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+#endif
+
+#define NFEX_URING_ENTRIES  256         /** submission queue entries */
+#define NFEX_URING_FILES    4096        /** extractions open at once */
+#define NFEX_URING_CHUNK    (64 * 1024) /** buffer is handed out in these */
+#define NFEX_URING_CHUNKS   256         /** 16MB, same as the writer ring */
+
+/** a write held back until the open it depends on is done */
+struct uring_pend
+{
+    struct uring_pend *next;
+    uint32_t chunk;                 /* where the data is */
+    uint32_t boff;
+    uint32_t len;
+    uint64_t foff;                  /* and where it goes in the file */
+};
+typedef struct uring_pend uring_pend_t;
+
+/** one extraction, it lives in the fixed file slot of the same number */
+struct uring_file
+{
+    uint8_t state;
+#define URING_FREE     0            /* slot's available */
+#define URING_OPENING  1            /* openat submitted */
+#define URING_OPEN     2            /* the file is in the slot */
+#define URING_FAILED   3            /* openat failed, writes are dropped */
+#define URING_CLOSING  4            /* close submitted */
+#define URING_CLOSED   5            /* closed, still being linked in */
+    uint8_t closing;                /* close once nothing's in flight */
+    uint8_t commit;                 /* link in under a new name once closed */
+    uint8_t dirty;                  /* written since the last sync */
+    uint8_t failed;                 /* a write fell short, never link it */
+    uint32_t inflight;              /* ops the kernel has for us */
+    uint64_t off;                   /* where the next write goes */
+    uring_pend_t *pend;             /* writes waiting on the open */
+    uring_pend_t **pend_tail;
+    uint32_t name_chunk;            /* temporary and new name, for commit */
+    uint32_t name_off;
+    int32_t next_free;              /* free slot list */
+};
+typedef struct uring_file uring_file_t;
+
+/*
+ * Extraction output through io_uring: opens, writes and closes are queued
+ * up as the worker goes, handed to the kernel once a batch and reaped
+ * whenever the worker comes back around, so nothing ever waits on the
+ * disk unless the buffer runs out.  Files are never given a descriptor,
+ * openat puts them straight into a fixed file slot and that slot number
+ * is what the extractor holds on to.  File data is copied into a
+ * registered buffer (plain writes if we can't register it), handed out a
+ * chunk at a time; a chunk comes back once every op that used it is done.
+ * Only the worker that owns the writer ever touches it.
+ */
+struct uring
+{
+    int fd;                         /* the ring */
+    uint32_t *sq_head;              /* submission queue, shared */
+    uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    void *sqes;                     /* struct io_uring_sqe[] */
+    uint32_t *cq_head;              /* completion queue, shared */
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    void *cqes;                     /* struct io_uring_cqe[] */
+    void *sq_map;                   /* and the mappings behind them */
+    size_t sq_maplen;
+    void *cq_map;
+    size_t cq_maplen;
+    size_t sqes_maplen;
+    uint32_t queued;                /* entries not yet submitted */
+    uint32_t inflight;              /* ops not yet reaped */
+    int fixed;                      /* buffer is registered */
+    uint8_t *buf;                   /* NFEX_URING_CHUNKS chunks */
+    uint32_t refs[NFEX_URING_CHUNKS];   /* ops using each chunk */
+    uint32_t free_chunks[NFEX_URING_CHUNKS];
+    uint32_t nfree_chunks;
+    uint32_t cur;                   /* chunk being filled */
+    uint32_t cur_off;               /* and how far */
+    uring_file_t *files;            /* one per fixed file slot */
+    uint32_t nfiles;
+    int32_t free_file;              /* head of the free slot list */
+    pool_t pends;                   /* uring_pend_t */
+    time_t last_sync;               /* for WQ_SYNC_PERIODIC */
+    uint64_t backlog;               /* file bytes not written yet */
+    uint32_t stalls;                /* times we waited on the kernel */
+};
+typedef struct uring uring_t;
+
+#endif /* URING_H */
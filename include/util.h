@@ -35,12 +35,15 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <inttypes.h>
+#include <setjmp.h>
 
-extern void error(char *);
+extern __thread jmp_buf *error_jmp;
+extern void error(char *) __attribute__((noreturn));
 extern void report(char *, ...);
 extern void *emalloc(size_t);
 extern void *ecalloc(size_t, size_t);
 void build_bpf_filter(register char **argv, char **buf);
 void fprintip(FILE *stream, uint32_t ip, ncc_t *ncc);
+void fprintsession(FILE *stream, ht_node_t *p, int dir, ncc_t *ncc);
 
 #endif /* UTIL_H */
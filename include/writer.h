@@ -0,0 +1,82 @@
+/*
+ * writer.h - extraction writer
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "ring.h"
+#include "uring.h"
+#include "store.h"
+
+#define NFEX_WQ_SIZE      (16 * 1024 * 1024) /** bytes of queued file data */
+#define NFEX_WQ_IOV_MAX   64                 /** max segments per writev() */
+#define NFEX_WQ_SYNC_SECS 5                  /** default periodic interval */
+
+/** durability policy for extracted files */
+#define WQ_SYNC_NONE      0                  /** leave it to the kernel */
+#define WQ_SYNC_CLOSE     1                  /** fdatasync() before close() */
+#define WQ_SYNC_PERIODIC  2                  /** fdatasync() every n seconds */
+
+/** queued operations */
+#define WQ_OP_WRITE       1                  /** append data to fd */
+#define WQ_OP_CLOSE       2                  /** all done with fd */
+#define WQ_OP_COMMIT      3                  /** close, then link into place */
+
+/** a queue record, data (for WQ_OP_WRITE) immediately follows */
+struct wq_record
+{
+    int fd;                         /* file descriptor this applies to */
+    uint32_t op;                    /* what to do */
+    uint32_t len;                   /* bytes of data following */
+    uint32_t pad;                   /* keep data aligned */
+};
+typedef struct wq_record wq_record_t;
+
+/*
+ * One producer (whoever does the extracting) and either one writer thread
+ * or, where the kernel has it, an io_uring the producer drives itself.
+ */
+struct writer
+{
+    uring_t *uring;                 /* set if we're going through io_uring */
+    pthread_t thread;               /* the writer thread */
+    ring_t ring;                    /* NFEX_WQ_SIZE bytes of records */
+    int running;                    /* thread was started */
+    int sync_policy;                /* WQ_SYNC_* */
+    int sync_interval;              /* seconds, for WQ_SYNC_PERIODIC */
+    uint8_t *dirty;                 /* per fd: written since last sync */
+    uint8_t *failed;                /* per fd: a write to it fell short */
+    int ndirty;                     /* size of dirty and failed */
+    store_t *store;                 /* told how commits went, or NULL */
+    uint64_t bytes_written;         /* bytes that made it to disk */
+    uint32_t write_errors;          /* failed or short writes */
+};
+typedef struct writer writer_t;
+
+int writer_init(writer_t *, int, int, int, char *);
+int writer_open(writer_t *, const char *);
+void writer_write(writer_t *, int, const uint8_t *, size_t);
+void writer_close(writer_t *, int);
+void writer_commit(writer_t *, int, const char *, const char *);
+void writer_flush(writer_t *);
+uint64_t writer_queued(writer_t *);
+uint32_t writer_stalled(writer_t *);
+void writer_shutdown(writer_t *);
+int uring_init(writer_t *, char *);
+int uring_open(writer_t *, const char *);
+void uring_write(writer_t *, int, const uint8_t *, size_t);
+void uring_close(writer_t *, int);
+void uring_commit(writer_t *, int, const char *, const char *);
+void uring_flush(writer_t *);
+void uring_shutdown(writer_t *);
+
+#endif /* WRITER_H */
@@ -18,6 +18,10 @@
  * srcip.port:   destination ip addess and destination port
  * filename:     new filename for extracted binary: PID-counter-md5.exe
  * malware name: as reported by clamav; "name" or "*UNKNOWN" or "*ERROR"
+ *
+ * nfex's own index also has the size and md5, sha1 and sha256 of each file
+ * after the filename; when the md5 is there we use it instead of reading
+ * the file again.
  */
 
 #include <stdio.h>
@@ -49,9 +53,11 @@ main(int argc, char *argv[])
     uint32_t pehdr, pesig;
     struct cl_engine *engine;
     FILE *oldlog, *newlog;
-    char p[256], pp[128];
+    char p[1024], pp[128];
     unsigned char md5[16];
     char *q, *src_file, *timestamp, *src_ip, *dst_ip, *filename, *suffix;
+    char *md5s;
+    int have_md5;
     const char *vname;
     unsigned long int size;
     uint8_t b[512];
@@ -152,10 +158,25 @@ next_entry:
             goto next_entry;
         }
 
-        /** step over last bit of whitespace and replace newline with a NULL */
+        /** step over last bit of whitespace and chop off any newline */
 	for (i = 0; filename[i] == ' '; i++);
         filename = filename + i;
-        filename[strlen(filename) - 1] = 0;
+        filename[strcspn(filename, " \r\n")] = 0;
+
+        /** size then md5, if the index has them ("-" if it wasn't kept) */
+        have_md5 = 0;
+        if (strsep(&q, ",") && (md5s = strsep(&q, ",")))
+        {
+            for (; *md5s == ' '; md5s++);
+            for (j = 0; j < 16; j++)
+            {
+                if (sscanf(&md5s[j * 2], "%2hhx", &md5[j]) != 1)
+                {
+                    break;
+                }
+            }
+            have_md5 = (j == 16);
+        }
         fd = open(filename, O_RDONLY);
         if (fd == -1)
         {
@@ -195,8 +216,11 @@ next_entry:
             fprintf(newlog, "%s,", src_ip);
             fprintf(newlog, "%s,", dst_ip);
            
-            /** md5 hash of file */ 
-            md5file(fd, md5);
+            /** md5 hash of file, unless nfex already worked it out */ 
+            if (have_md5 == 0)
+            {
+                md5file(fd, md5);
+            }
             
             /** build new filename for file based off of md5 */
             memset(pp, 0, sizeof (pp));
@@ -16,6 +16,7 @@ the_game(ncc_t *ncc)
 {
     int c, n, j;
     fd_set read_set;
+    struct timeval tv;
 
     /** file extraction */
     for (j = 0; ncc->capfname[1]; j++)
@@ -27,6 +28,8 @@ the_game(ncc_t *ncc)
          * filter that was specified at the command line.
          */
         c = pcap_dispatch(ncc->p, 100, process_packet, (uint8_t *)ncc);
+        process_batch_end((u_char *)ncc);
+        config_reload_poll(ncc);
         /** hand the keypress off be processed */
         switch (process_keypress(ncc))
         {
@@ -37,12 +40,6 @@ the_game(ncc_t *ncc)
             default:
                 break;
         }
-        /** every 10,000 packets let's clean house */
-        if (j == 100)
-        {
-            ht_expire_session(ncc);
-            j = 0;
-        }
         if (c < 0)
         {
             error(pcap_geterr(ncc->p));
@@ -60,28 +57,41 @@ the_game(ncc_t *ncc)
     /** network extraction */
     for (j = 0; ; j++)
     {
-        /** we multiplex input across the network and STDIN */
+        /** 
+         * we multiplex input across the network and STDIN, unless the
+         * workers are reading their own capture rings
+         */
         FD_ZERO(&read_set);
         FD_SET(STDIN_FILENO, &read_set);
-        FD_SET(ncc->pcap_fd, &read_set);
+        if (ncc->pcap_fd != -1)
+        {
+            FD_SET(ncc->pcap_fd, &read_set);
+        }
 
         /** check the status of our file descriptors */
-        c = select(FD_SETSIZE, &read_set, 0, 0, NULL);
+        tv.tv_sec  = 1;
+        tv.tv_usec = 0;
+        c = select(FD_SETSIZE, &read_set, 0, 0, &tv);
         if (c > 0)
         {
             /** input from the network */
-            if (FD_ISSET(ncc->pcap_fd, &read_set))
+            if (ncc->pcap_fd != -1 && FD_ISSET(ncc->pcap_fd, &read_set))
             {
-                n = pcap_dispatch(ncc->p, 100, process_packet, (u_char *)ncc);
-                /** every 10,000 packets let's clean house */
-                if (j == 100)
+                if (ncc->flags & NFEX_TPACKET)
                 {
-                    ht_expire_session(ncc);
-                    j = 0;
+                    /** a block may retire empty, that's not EOF */
+                    tpacket_dispatch(&ncc->workers[0].tp, process_packet,
+                        process_batch_end, (u_char *)ncc);
                 }
-                if (n == 0)
+                else
                 {
-                    return (EXIT_SUCCESS);
+                    n = pcap_dispatch(ncc->p, 100, process_packet, 
+                        (u_char *)ncc);
+                    process_batch_end((u_char *)ncc);
+                    if (n == 0)
+                    {
+                        return (EXIT_SUCCESS);
+                    }
                 }
             }
             /** input from the user */
@@ -98,11 +108,14 @@ the_game(ncc_t *ncc)
                 }
             }
         }
-        if (c == -1)
+        if (c == -1 && errno != EINTR)
         {
             perror("error fatal select");
             return (-1);
         }
+
+        /** wake up now and again even when it's quiet, for reloads */
+        config_reload_poll(ncc);
     }
     /* NOTREACHED */
     return (1);
@@ -111,6 +124,7 @@ the_game(ncc_t *ncc)
 int
 process_keypress(ncc_t *ncc)
 {
+    int n;
     char buf[1];
 
     if (read(STDIN_FILENO, buf, 1) == -1)
@@ -145,6 +159,10 @@ process_keypress(ncc_t *ncc)
         case 'h':
             ht_status(ncc); 
             break;
+        case 'l':
+            /* reload the config file */
+            config_reload(ncc);
+            break;
         case 'f':
             //search_dump_types(ncc);
             break;
@@ -152,6 +170,13 @@ process_keypress(ncc_t *ncc)
             /* clear stats */
             /** FIXME: save uptime */
             memset(&ncc->stats, 0, sizeof (ncc->stats));
+            for (n = 0; n < ncc->nworkers; n++)
+            {
+                pthread_mutex_lock(&ncc->workers[n].lock);
+                memset(&ncc->workers[n].stats, 0, 
+                    sizeof (ncc->workers[n].stats));
+                pthread_mutex_unlock(&ncc->workers[n].lock);
+            }
             printf("nfex statistics cleared\n");
             break;
         case 's':
@@ -184,6 +209,7 @@ process_keypress(ncc_t *ncc)
 #if (HAVE_GEOIP)
             printf("[g]   - toggle geoIP mode\n");
 #endif /** HAVE_GEOIP */
+            printf("[l]   - reload configuration file\n");
             printf("[r]   - reset statistics\n");
             printf("[s]   - display statistics\n");
             printf("[q]   - quit\n");
@@ -217,11 +243,64 @@ process_keypress(ncc_t *ncc)
     return (1);
 }
 
+/** add one worker's pool to the totals */
+static void
+stats_pool(pool_t *total, pool_t *p, uint64_t *bytes)
+{
+    total->in_use += p->in_use;
+    total->peak   += p->peak;
+    *bytes        += (uint64_t)p->nslabs * p->per_slab * p->size;
+}
+
 void
 stats(ncc_t *ncc, int mode)
 {
     struct timeval r, e;
     u_int32_t day, hour, min, sec;
+    n_stats_t s;
+    nwc_t *w;
+    int i;
+    uint32_t entries, write_errors, writer_stalls, worker_stalls;
+    uint32_t ring_packets, ring_drops;
+    uint64_t writer_backlog, worker_backlog, reasm_bytes, frag_bytes;
+    pool_t sessions, extracts, xbufs, addrs;
+    uint64_t pool_bytes, arena_bytes;
+
+    stats_sum(ncc, &s);
+    entries = write_errors = writer_stalls = worker_stalls = 0;
+    writer_backlog = worker_backlog = 0;
+    ring_packets = ring_drops = 0;
+    reasm_bytes = 0;
+    frag_bytes  = ncc->frag.bytes;
+    memset(&sessions, 0, sizeof (pool_t));
+    memset(&extracts, 0, sizeof (pool_t));
+    memset(&xbufs, 0, sizeof (pool_t));
+    memset(&addrs, 0, sizeof (pool_t));
+    pool_bytes = arena_bytes = 0;
+    for (i = 0; i < ncc->nworkers; i++)
+    {
+        w               = &ncc->workers[i];
+        entries        += w->ht.entries;
+        write_errors   += __atomic_load_n(&w->writer.write_errors, 
+                              __ATOMIC_RELAXED);
+        writer_stalls  += writer_stalled(&w->writer);
+        writer_backlog += writer_queued(&w->writer);
+        worker_stalls  += w->ring.stalls;
+        worker_backlog += ring_backlog(&w->ring);
+        reasm_bytes    += w->reasm.bytes;
+        frag_bytes     += w->frag.bytes;
+        stats_pool(&sessions, &w->sessions, &pool_bytes);
+        stats_pool(&extracts, &w->extracts, &pool_bytes);
+        stats_pool(&xbufs, &w->xbufs.bufs, &pool_bytes);
+        stats_pool(&addrs, &w->addrs, &pool_bytes);
+        arena_bytes    += w->results.size;
+        if (ncc->flags & NFEX_TPACKET)
+        {
+            tpacket_stats(&w->tp);
+            ring_packets += w->tp.packets;
+            ring_drops   += w->tp.drops;
+        }
+    }
 
     gettimeofday(&e, NULL);
     PTIMERSUB(&e, &(ncc->stats.ts_start), &r);
@@ -279,24 +358,143 @@ stats(ncc_t *ncc, int mode)
     printf("\n");
     if (mode == NFEX_STATS_UPDATE)
     {
-       printf("sessions watched:\t\t%d\n", ncc->stats.ht_entries);
+       printf("sessions watched:\t\t%d\n", entries);
     }
-    printf("packets churned:\t\t%d\n", ncc->stats.total_packets);
-    printf("bytes churned:\t\t\t%lld\n", ncc->stats.total_bytes);
+    printf("packets churned:\t\t%d\n", s.total_packets);
+    printf("bytes churned:\t\t\t%lld\n", s.total_bytes);
     if (ncc->capfname[0])
     {
         printf("pcap file processed:\t\t%.1f%%\n", 
-            ((double)ncc->stats.total_bytes * 100) / (double)ncc->capfsize);
+            ((double)s.total_bytes * 100) / (double)ncc->capfsize);
     }
-    printf("files extracted:\t\t%d\n", ncc->stats.total_files);
+    printf("files extracted:\t\t%d\n", s.total_files);
     if (mode == NFEX_STATS_UPDATE)
     {
         printf("files currently extracting:\t%d\n", 
             ht_count_extracts(ncc));
     }
-    printf("packet errors:\t\t\t%d\n", ncc->stats.packet_errors);
-    printf("extraction errors:\t\t%d\n", ncc->stats.extraction_errors);
+    if (ncc->flags & NFEX_TPACKET)
+    {
+        printf("ring packets received:\t\t%d\n", ring_packets);
+        printf("ring packets dropped:\t\t%d\n", ring_drops);
+    }
+    printf("segments out of order:\t\t%d\n", s.reasm_ooo);
+    printf("segments duplicated:\t\t%d\n", s.reasm_dups);
+    printf("stream gaps skipped:\t\t%d\n", s.reasm_gaps);
+    if (mode == NFEX_STATS_UPDATE)
+    {
+        printf("reassembly queued:\t\t%lld bytes\n", 
+            (long long)reasm_bytes);
+    }
+    if (s.frag_packets)
+    {
+        printf("IPv4 fragments:\t\t\t%u\n", s.frag_packets);
+        printf("datagrams reassembled:\t\t%u\n", s.frag_datagrams);
+        printf("datagrams timed out:\t\t%u\n", s.frag_timeouts);
+        printf("fragments dropped:\t\t%u\n", s.frag_drops);
+    }
+    if (mode == NFEX_STATS_UPDATE && frag_bytes)
+    {
+        printf("fragments queued:\t\t%lld bytes\n", (long long)frag_bytes);
+    }
+    if (ncc->sc->bypass_depth || s.bypass_sessions || 
+        (ncc->flags & NFEX_EBPF))
+    {
+        printf("sessions bypassed:\t\t%d\n", s.bypass_sessions);
+        printf("packets bypassed:\t\t%d\n", s.bypass_packets);
+        printf("bytes bypassed:\t\t\t%lld\n", (long long)s.bypass_bytes);
+    }
+    if (ncc->flags & NFEX_EBPF)
+    {
+        printf("kernel bypassed flows:\t\t%u\n", ncc->ebpf.flows);
+        printf("kernel bypass errors:\t\t%u\n", ncc->ebpf.errors);
+    }
+    if (s.batches)
+    {
+        printf("packet batches:\t\t\t%u, %.1f packets each\n", s.batches,
+            (double)s.batch_packets / s.batches);
+        printf("cycles per packet:\t\tparse %.0f, lookup %.0f, "
+            "stream %.0f\n", (double)s.cycles_parse / s.batch_packets,
+            (double)s.cycles_lookup / s.batch_packets,
+            (double)s.cycles_stream / s.batch_packets);
+    }
+    printf("sessions pooled:\t\t%u in use, %u peak\n", sessions.in_use,
+        sessions.peak);
+    printf("extractions pooled:\t\t%u in use, %u peak\n", 
+        extracts.in_use, extracts.peak);
+    printf("extraction buffers:\t\t%u in use, %u peak\n", xbufs.in_use,
+        xbufs.peak);
+    printf("extraction writes:\t\t%u, %u to free a buffer\n",
+        s.xbuf_writes, s.xbuf_evictions);
+    if (ncc->flags & NFEX_STORE)
+    {
+        printf("files already stored:\t\t%u, %lld bytes\n", s.store_dups,
+            (long long)s.store_bytes);
+    }
+    printf("IPv6 sessions:\t\t\t%u in use, %u peak\n", addrs.in_use,
+        addrs.peak);
+    printf("pool memory:\t\t\t%lld KB, %lld KB results arena\n",
+        (long long)pool_bytes / 1024, (long long)arena_bytes / 1024);
+    printf("packet errors:\t\t\t%d\n", s.packet_errors);
+    printf("extraction errors:\t\t%d\n", s.extraction_errors);
+    printf("file write errors:\t\t%d\n", write_errors);
+    printf("writer stalls:\t\t\t%d\n", writer_stalls);
+    printf("writer backlog:\t\t\t%lld bytes\n", (long long)writer_backlog);
+    if (ncc->nworkers > 1)
+    {
+        printf("worker stalls:\t\t\t%d\n", worker_stalls);
+        printf("worker backlog:\t\t\t%lld bytes\n", 
+            (long long)worker_backlog);
+    }
     fflush(stdout);
 }
 
+/*
+ * Add up the capture thread's counters and each worker's (workers reading
+ * their own capture rings count their own packets).  Workers may be
+ * mid-batch, so live numbers are a snapshot and not exact.
+ */
+void
+stats_sum(ncc_t *ncc, n_stats_t *s)
+{
+    int i;
+    n_stats_t *ws;
+
+    memcpy(s, &ncc->stats, sizeof (n_stats_t));
+    for (i = 0; i < ncc->nworkers; i++)
+    {
+        ws = &ncc->workers[i].stats;
+        s->total_packets     += ws->total_packets;
+        s->total_bytes       += ws->total_bytes;
+        s->total_files       += ws->total_files;
+        s->packet_errors     += ws->packet_errors;
+        s->extraction_errors += ws->extraction_errors;
+        s->ht_inserts        += ws->ht_inserts;
+        s->ht_expired        += ws->ht_expired;
+        s->reasm_ooo         += ws->reasm_ooo;
+        s->reasm_dups        += ws->reasm_dups;
+        s->reasm_gaps        += ws->reasm_gaps;
+        s->bypass_sessions   += ws->bypass_sessions;
+        s->bypass_packets    += ws->bypass_packets;
+        s->bypass_bytes      += ws->bypass_bytes;
+        s->frag_packets      += ws->frag_packets;
+        s->frag_datagrams    += ws->frag_datagrams;
+        s->frag_timeouts     += ws->frag_timeouts;
+        s->frag_drops        += ws->frag_drops;
+        s->xbuf_writes       += ws->xbuf_writes;
+        s->xbuf_evictions    += ws->xbuf_evictions;
+        s->store_dups        += ws->store_dups;
+        s->store_bytes       += ws->store_bytes;
+        s->batches           += ws->batches;
+        s->batch_packets     += ws->batch_packets;
+        s->cycles_parse      += ws->cycles_parse;
+        s->cycles_lookup     += ws->cycles_lookup;
+        s->cycles_stream     += ws->cycles_stream;
+        if (timercmp(&ws->ts_last, &s->ts_last, >))
+        {
+            s->ts_last = ws->ts_last;
+        }
+    }
+}
+
 /** EOF */
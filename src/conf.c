@@ -31,8 +31,17 @@
 
 #include "nfex.h"
 #include "conf.h"
+#include "util.h"
+
+extern FILE *yyin;
+extern int yyparse(void *);
+extern void yyrestart(FILE *);
 
 static int id;
+static volatile sig_atomic_t reload_signalled;
+
+static void config_depths_free(ncc_t *);
+static void *config_reload_thread(void *);
 
 void
 config_type(char *extension, char *maxlength, char *hspec, char *fspec, void *a)
@@ -47,18 +56,370 @@ config_type(char *extension, char *maxlength, char *hspec, char *fspec, void *a)
         error("Invalid maximum length in file format specifier");
     }
 
-    search_compile(&(ncc->srch_machine), id, strdup(extension), maxlen, hspec, 
-            HEADER);
+    if (strlen(extension) >= SRCH_EXT_MAX)
+    {
+        error("File type name too long in file format specifier");
+    }
+
+    search_compile(&(ncc->srch_tree), id, extension, maxlen, hspec, HEADER);
 
     /** if a footer is specified in the confi file, compile it here */
     if (fspec)
     {
-        search_compile(&(ncc->srch_machine), id, strdup(extension), maxlen, 
-            fspec, FOOTER);
+        search_compile(&(ncc->srch_tree), id, extension, maxlen, fspec, 
+            FOOTER);
     }
     id++;
     printf("%2d %s search code compiled (%ld byte max)\n", id, extension, 
             maxlen);
 }
 
+/*
+ * depth(n) sets how far into a stream we look for headers, depth(ext, n)
+ * overrides that for one file type.  0 is no limit.
+ */
+void
+config_depth(char *keyword, char *extension, char *depth, void *a)
+{
+    unsigned long n;
+    srch_depth_t *d;
+    ncc_t *ncc;
+
+    ncc = (ncc_t *)a;
+
+    if (strcmp(keyword, "depth"))
+    {
+        error("Unknown directive in configuration file");
+    }
+    if (!sscanf(depth, "%lu", &n))
+    {
+        error("Invalid stream depth");
+    }
+
+    if (extension == NULL)
+    {
+        ncc->stream_depth = n;
+        printf("   stream depth %lu bytes\n", n);
+        return;
+    }
+
+    /** applied once the search machine is built */
+    d = emalloc(sizeof (srch_depth_t));
+    d->ext   = strdup(extension);
+    d->depth = n;
+    d->dir   = 0;
+    d->next  = ncc->srch_depths;
+    ncc->srch_depths = d;
+    printf("   %s stream depth %lu bytes\n", extension, n);
+}
+
+/*
+ * direction(server|client|both) says which way a file has to be going to
+ * be carved, direction(ext, ...) overrides that for one file type.  The
+ * server is whoever answered the SYN.
+ */
+void
+config_direction(char *keyword, char *extension, char *direction, void *a)
+{
+    uint8_t dir;
+    srch_depth_t *d;
+    ncc_t *ncc;
+
+    ncc = (ncc_t *)a;
+
+    if (strcmp(keyword, "direction"))
+    {
+        error("Unknown directive in configuration file");
+    }
+    if (strcmp(direction, "server") == 0)
+    {
+        dir = SRCH_DIR_SERVER;
+    }
+    else if (strcmp(direction, "client") == 0)
+    {
+        dir = SRCH_DIR_CLIENT;
+    }
+    else if (strcmp(direction, "both") == 0)
+    {
+        dir = SRCH_DIR_BOTH;
+    }
+    else
+    {
+        error("Invalid direction, want server, client or both");
+    }
+
+    if (extension == NULL)
+    {
+        ncc->stream_dir = dir;
+        printf("   carving %s\n", direction);
+        return;
+    }
+
+    /** applied once the search machine is built, along with the depths */
+    d = emalloc(sizeof (srch_depth_t));
+    d->ext   = strdup(extension);
+    d->depth = 0;
+    d->dir   = dir;
+    d->next  = ncc->srch_depths;
+    ncc->srch_depths = d;
+    printf("   %s carving %s\n", extension, direction);
+}
+
+/*
+ * Turn the config file into a search config, straight from the cache if
+ * the file hasn't changed since the machine was last built.  At startup a
+ * bad config is fatal.  On a reload the errors are reported, NULL comes
+ * back and whatever's running keeps running; the half built parse tree is
+ * leaked, it's the price of not exiting.
+ */
+nsc_t *
+config_load(ncc_t *ncc, int reload)
+{
+    nsc_t *sc;
+    uint64_t key;
+    jmp_buf jb;
+
+    yyin = fopen(ncc->yyinfname, "r");
+    if (yyin == NULL)
+    {
+        fprintf(stderr, "can't open config file %s: %s\n", ncc->yyinfname,
+            strerror(errno));
+        return (NULL);
+    }
+    sc = ecalloc(1, sizeof (nsc_t));
+
+    /** same config as last time?  then the machine's already built */
+    key = mcache_key(yyin);
+    sc->sm = mcache_load(ncc->mcachefname, key, &sc->stream_depth, 
+        &sc->bypass_depth);
+    if (sc->sm)
+    {
+        printf("search machine loaded from %s: %d states (%ld KB), "
+            "%s prefilter\n", ncc->mcachefname, sc->sm->nstates,
+            (long)sc->sm->size / 1024, sc->sm->skip_name);
+    }
+    else
+    {
+        if (reload)
+        {
+            /** error() lands back here instead of exiting */
+            if (setjmp(jb))
+            {
+                error_jmp = NULL;
+                fclose(yyin);
+                free(sc);
+                return (NULL);
+            }
+            error_jmp = &jb;
+        }
+
+        /** the parser's scratch space, whatever the last parse left */
+        config_depths_free(ncc);
+        ncc->srch_tree    = NULL;
+        ncc->stream_depth = 0;
+        ncc->stream_dir   = SRCH_DIR_BOTH;
+        id                = 0;
+        yyrestart(yyin);
+
+        printf("loading configuration file...\n");
+        if (yyparse((void *)ncc) && reload)
+        {
+            error("configuration file has errors\n");
+        }
+
+        /** turn the parse tree into something we can run at line rate */
+        sc->sm = search_build(&(ncc->srch_tree));
+        printf("search machine built: %d states (%ld KB), %s prefilter\n", 
+            sc->sm->nstates, (long)sc->sm->size / 1024, sc->sm->skip_name);
+
+        /** work out how far into a stream anybody needs us to look */
+        sc->stream_depth = ncc->stream_depth;
+        sc->bypass_depth = search_depth(sc->sm, ncc->srch_depths, 
+            sc->stream_depth, ncc->stream_dir);
+        error_jmp = NULL;
+
+        if (mcache_save(sc->sm, ncc->mcachefname, key, sc->stream_depth, 
+            sc->bypass_depth) == -1)
+        {
+            fprintf(stderr, "can't write search machine cache %s: %s\n",
+                ncc->mcachefname, strerror(errno));
+        }
+    }
+    fclose(yyin);
+    sc->dirs = search_dirs(sc->sm);
+    if (ncc->flags & NFEX_DEBUG)
+    {
+        search_dump(sc->sm, stdout);
+    }
+    if (sc->bypass_depth)
+    {
+        printf("sessions bypassed past %lu bytes\n", sc->bypass_depth);
+    }
+    return (sc);
+}
+
+void
+config_free(nsc_t *sc)
+{
+    search_free(sc->sm);
+    free(sc);
+}
+
+/** SIGHUP: config_reload_poll() takes it from here */
+void
+config_reload_signal(int sig)
+{
+    reload_signalled = 1;
+}
+
+/** build a new search config off to the side, the workers don't wait */
+int
+config_reload(ncc_t *ncc)
+{
+    int n;
+
+    if (ncc->reload_state != NFEX_RELOAD_IDLE)
+    {
+        printf("configuration reload already in progress\n");
+        return (-1);
+    }
+    ncc->reload_state = NFEX_RELOAD_RUNNING;
+    n = pthread_create(&ncc->reload_thread, NULL, config_reload_thread, ncc);
+    if (n)
+    {
+        fprintf(stderr, "can't start configuration reload: %s\n", 
+            strerror(n));
+        ncc->reload_state = NFEX_RELOAD_IDLE;
+        return (-1);
+    }
+    printf("reloading configuration file %s\n", ncc->yyinfname);
+    return (1);
+}
+
+static void *
+config_reload_thread(void *arg)
+{
+    ncc_t *ncc;
+
+    ncc = (ncc_t *)arg;
+    ncc->reload_sc = config_load(ncc, 1);
+    __atomic_store_n(&ncc->reload_state, NFEX_RELOAD_DONE, __ATOMIC_RELEASE);
+    return (NULL);
+}
+
+/*
+ * Called from the main loop between packet batches.  A finished reload is
+ * published with a new epoch and the config it replaces is retired.  Each
+ * worker picks up the new one before its next batch and says so through
+ * its epoch; sessions notice the change themselves and start searching
+ * over, extractions already under way carry on as they were.  A retired
+ * config is freed once every worker has moved past it.
+ */
+void
+config_reload_poll(ncc_t *ncc)
+{
+    int i;
+    nsc_t *sc, **pp;
+    nwc_t *w;
+    uint32_t epoch;
+
+    if (reload_signalled)
+    {
+        reload_signalled = 0;
+        config_reload(ncc);
+    }
+
+    if (__atomic_load_n(&ncc->reload_state, __ATOMIC_ACQUIRE) == 
+        NFEX_RELOAD_DONE)
+    {
+        pthread_join(ncc->reload_thread, NULL);
+        ncc->reload_state = NFEX_RELOAD_IDLE;
+        sc = ncc->reload_sc;
+        ncc->reload_sc = NULL;
+        if (sc)
+        {
+            sc->epoch     = ncc->sc->epoch + 1;
+            ncc->sc->next = ncc->retired;
+            ncc->retired  = ncc->sc;
+            __atomic_store_n(&ncc->sc, sc, __ATOMIC_RELEASE);
+            printf("configuration reloaded, epoch %u\n", sc->epoch);
+        }
+        else
+        {
+            fprintf(stderr, "configuration reload failed, nothing changed\n");
+        }
+    }
+
+    if (ncc->retired == NULL)
+    {
+        return;
+    }
+
+    /** workers without a thread of their own are run by us */
+    epoch = ncc->sc->epoch;
+    for (i = 0; i < ncc->nworkers; i++)
+    {
+        w = &ncc->workers[i];
+        if (w->running == 0)
+        {
+            worker_config_sync(w);
+        }
+        epoch = MIN(epoch, __atomic_load_n(&w->epoch, __ATOMIC_ACQUIRE));
+    }
+    for (pp = &ncc->retired; (sc = *pp); )
+    {
+        if (sc->epoch < epoch)
+        {
+            *pp = sc->next;
+            config_free(sc);
+        }
+        else
+        {
+            pp = &sc->next;
+        }
+    }
+}
+
+/** the workers are gone, so everything can go */
+void
+config_destroy(ncc_t *ncc)
+{
+    nsc_t *sc;
+
+    if (ncc->reload_state != NFEX_RELOAD_IDLE)
+    {
+        pthread_join(ncc->reload_thread, NULL);
+        ncc->reload_state = NFEX_RELOAD_IDLE;
+        if (ncc->reload_sc)
+        {
+            config_free(ncc->reload_sc);
+            ncc->reload_sc = NULL;
+        }
+    }
+    while ((sc = ncc->retired))
+    {
+        ncc->retired = sc->next;
+        config_free(sc);
+    }
+    if (ncc->sc)
+    {
+        config_free(ncc->sc);
+        ncc->sc = NULL;
+    }
+    config_depths_free(ncc);
+}
+
+static void
+config_depths_free(ncc_t *ncc)
+{
+    srch_depth_t *d;
+
+    while ((d = ncc->srch_depths))
+    {
+        ncc->srch_depths = d->next;
+        free(d->ext);
+        free(d);
+    }
+}
+
 /** EOF */
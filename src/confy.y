@@ -53,6 +53,10 @@ expression: WORD '(' NUMBER ',' SPECIFIER ')' ENDLINE			{config_type($1, $3, $5,
 	|	WORD '(' NUMBER ',' NUMBER ',' SPECIFIER ')' ENDLINE	{config_type($1, $3, $5, $7, a);}
 	|	WORD '(' NUMBER ',' NUMBER ',' NUMBER ')' ENDLINE		{config_type($1, $3, $5, $7, a);}
 	|	WORD '(' NUMBER ',' NUMBER ',' WORD ')' ENDLINE			{config_type($1, $3, $5, $7, a);}
+	|	WORD '(' NUMBER ')' ENDLINE								{config_depth($1, NULL, $3, a);}
+	|	WORD '(' WORD ',' NUMBER ')' ENDLINE					{config_depth($1, $3, $5, a);}
+	|	WORD '(' WORD ')' ENDLINE								{config_direction($1, NULL, $3, a);}
+	|	WORD '(' WORD ',' WORD ')' ENDLINE						{config_direction($1, $3, $5, a);}
 	;
 
 %%
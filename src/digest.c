@@ -0,0 +1,434 @@
+/*
+ * digest.c - streaming file digests
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include "nfex.h"
+#include "digest.h"
+
+#if (HAVE_SHA_NI)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define ROTL(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define LE32(p)     ((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8 |              \
+                    (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24)
+#define BE32(p)     ((uint32_t)(p)[0] << 24 | (uint32_t)(p)[1] << 16 |       \
+                    (uint32_t)(p)[2] << 8 | (uint32_t)(p)[3])
+
+static void md5_blocks(uint32_t *, const uint8_t *, size_t);
+static void sha1_blocks(uint32_t *, const uint8_t *, size_t);
+static void sha256_blocks_c(uint32_t *, const uint8_t *, size_t);
+static void digest_blocks(digest_t *, const uint8_t *, size_t);
+
+/** SHA-256 goes through whatever the CPU does best, see digest_setup() */
+static void (*sha256_blocks)(uint32_t *, const uint8_t *, size_t) =
+    sha256_blocks_c;
+
+static const uint32_t md5_k[64] =
+{
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_r[16] =
+{
+    7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+};
+
+static const uint32_t sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#if (HAVE_SHA_NI)
+/*
+ * SHA-256 on the SHA extensions: two rounds an instruction, with the
+ * message schedule done four words at a time alongside.
+ */
+__attribute__((target("sha,ssse3,sse4.1")))
+static void
+sha256_blocks_ni(uint32_t *h, const uint8_t *p, size_t n)
+{
+    __m128i state0, state1, save0, save1, msg, tmp, m[4];
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+    int i;
+
+    /** the instructions want the state as ABEF and CDGH */
+    tmp    = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; n; n--, p += DIGEST_BLOCK)
+    {
+        save0 = state0;
+        save1 = state1;
+#pragma GCC unroll 16
+        for (i = 0; i < 16; i++)
+        {
+            if (i < 4)
+            {
+                m[i] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *)(p + i * 16)), mask);
+            }
+            msg    = _mm_add_epi32(m[i & 3],
+                         _mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            if (i >= 3 && i <= 14)
+            {
+                tmp = _mm_alignr_epi8(m[i & 3], m[(i - 1) & 3], 4);
+                m[(i + 1) & 3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(m[(i + 1) & 3], tmp), m[i & 3]);
+            }
+            msg    = _mm_shuffle_epi32(msg, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+            if (i >= 1 && i <= 12)
+            {
+                m[(i - 1) & 3] = _mm_sha256msg1_epu32(m[(i - 1) & 3],
+                                     m[i & 3]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+    }
+
+    /** and back to ABCD EFGH */
+    tmp    = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&h[0], state0);
+    _mm_storeu_si128((__m128i *)&h[4], state1);
+}
+#endif /* HAVE_SHA_NI */
+
+/** pick the SHA-256 code for this CPU, returns what it went with */
+const char *
+digest_setup(void)
+{
+#if (HAVE_SHA_NI)
+    uint32_t a, b, c, d;
+
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSSE3) && (c & bit_SSE4_1)
+        && __get_cpuid_max(0, NULL) >= 7)
+    {
+        __cpuid_count(7, 0, a, b, c, d);
+        if (b & (1 << 29))
+        {
+            sha256_blocks = sha256_blocks_ni;
+            return ("SHA extensions");
+        }
+    }
+#endif
+    sha256_blocks = sha256_blocks_c;
+    return ("portable");
+}
+
+void
+digest_init(digest_t *d, uint8_t which)
+{
+    d->which = which;
+    d->len   = 0;
+    d->md5[0] = 0x67452301;
+    d->md5[1] = 0xefcdab89;
+    d->md5[2] = 0x98badcfe;
+    d->md5[3] = 0x10325476;
+    d->sha1[0] = 0x67452301;
+    d->sha1[1] = 0xefcdab89;
+    d->sha1[2] = 0x98badcfe;
+    d->sha1[3] = 0x10325476;
+    d->sha1[4] = 0xc3d2e1f0;
+    d->sha256[0] = 0x6a09e667;
+    d->sha256[1] = 0xbb67ae85;
+    d->sha256[2] = 0x3c6ef372;
+    d->sha256[3] = 0xa54ff53a;
+    d->sha256[4] = 0x510e527f;
+    d->sha256[5] = 0x9b05688c;
+    d->sha256[6] = 0x1f83d9ab;
+    d->sha256[7] = 0x5be0cd19;
+}
+
+/** run more of the stream through, whole blocks straight from data */
+void
+digest_update(digest_t *d, const uint8_t *data, size_t len)
+{
+    size_t n, c;
+
+    if (d->which == 0 || len == 0)
+    {
+        return;
+    }
+    n       = d->len & (DIGEST_BLOCK - 1);
+    d->len += len;
+    if (n)
+    {
+        c = DIGEST_BLOCK - n < len ? DIGEST_BLOCK - n : len;
+        memcpy(d->buf + n, data, c);
+        data += c;
+        len  -= c;
+        if (n + c < DIGEST_BLOCK)
+        {
+            return;
+        }
+        digest_blocks(d, d->buf, 1);
+    }
+    if (len >= DIGEST_BLOCK)
+    {
+        digest_blocks(d, data, len / DIGEST_BLOCK);
+        data += len & ~(size_t)(DIGEST_BLOCK - 1);
+        len  &= DIGEST_BLOCK - 1;
+    }
+    memcpy(d->buf, data, len);
+}
+
+/** pad out the last block and write each digest that was kept */
+void
+digest_final(digest_t *d, uint8_t *md5, uint8_t *sha1, uint8_t *sha256)
+{
+    uint8_t pad[DIGEST_BLOCK * 2], *l;
+    uint64_t bits;
+    size_t n, nblk;
+    int i;
+
+    n = d->len & (DIGEST_BLOCK - 1);
+    memcpy(pad, d->buf, n);
+    pad[n] = 0x80;
+    nblk   = n < DIGEST_BLOCK - 8 ? 1 : 2;
+    memset(pad + n + 1, 0, nblk * DIGEST_BLOCK - n - 1);
+    l      = pad + nblk * DIGEST_BLOCK - 8;
+    bits   = d->len << 3;
+
+    if (d->which & DIGEST_MD5)
+    {
+        for (i = 0; i < 8; i++)
+        {
+            l[i] = bits >> (i * 8);
+        }
+        md5_blocks(d->md5, pad, nblk);
+        for (i = 0; i < DIGEST_MD5_LEN; i++)
+        {
+            md5[i] = d->md5[i / 4] >> ((i % 4) * 8);
+        }
+    }
+    for (i = 0; i < 8; i++)
+    {
+        l[i] = bits >> ((7 - i) * 8);
+    }
+    if (d->which & DIGEST_SHA1)
+    {
+        sha1_blocks(d->sha1, pad, nblk);
+        for (i = 0; i < DIGEST_SHA1_LEN; i++)
+        {
+            sha1[i] = d->sha1[i / 4] >> ((3 - i % 4) * 8);
+        }
+    }
+    if (d->which & DIGEST_SHA256)
+    {
+        sha256_blocks(d->sha256, pad, nblk);
+        for (i = 0; i < DIGEST_SHA256_LEN; i++)
+        {
+            sha256[i] = d->sha256[i / 4] >> ((3 - i % 4) * 8);
+        }
+    }
+}
+
+static void
+digest_blocks(digest_t *d, const uint8_t *p, size_t n)
+{
+    if (d->which & DIGEST_MD5)
+    {
+        md5_blocks(d->md5, p, n);
+    }
+    if (d->which & DIGEST_SHA1)
+    {
+        sha1_blocks(d->sha1, p, n);
+    }
+    if (d->which & DIGEST_SHA256)
+    {
+        sha256_blocks(d->sha256, p, n);
+    }
+}
+
+/** one MD5 step, the four words turn over by one */
+#define MD5_STEP(fn, x, i)                                                   \
+    f = a + (fn) + md5_k[i] + (x);                                           \
+    a = d;                                                                   \
+    d = c;                                                                   \
+    c = b;                                                                   \
+    b = b + ROTL(f, md5_r[((i) >> 4) * 4 + ((i) & 3)])
+
+/** RFC 1321 */
+static void
+md5_blocks(uint32_t *h, const uint8_t *p, size_t n)
+{
+    uint32_t m[16], a, b, c, d, f;
+    int i;
+
+    for (; n; n--, p += DIGEST_BLOCK)
+    {
+        for (i = 0; i < 16; i++)
+        {
+            m[i] = LE32(p + i * 4);
+        }
+        a = h[0];
+        b = h[1];
+        c = h[2];
+        d = h[3];
+        for (i = 0; i < 16; i++)
+        {
+            MD5_STEP(d ^ (b & (c ^ d)), m[i], i);
+        }
+        for (; i < 32; i++)
+        {
+            MD5_STEP(c ^ (d & (b ^ c)), m[(5 * i + 1) & 15], i);
+        }
+        for (; i < 48; i++)
+        {
+            MD5_STEP(b ^ c ^ d, m[(3 * i + 5) & 15], i);
+        }
+        for (; i < 64; i++)
+        {
+            MD5_STEP(c ^ (b | ~d), m[(7 * i) & 15], i);
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+    }
+}
+
+/** the next word of the SHA-1 schedule, kept in a 16 word window */
+#define SHA1_W(i)                                                            \
+    (t = w[((i) - 3) & 15] ^ w[((i) - 8) & 15] ^ w[((i) - 14) & 15] ^        \
+        w[(i) & 15], w[(i) & 15] = ROTL(t, 1))
+
+#define SHA1_STEP(fn, k, x)                                                  \
+    t = ROTL(a, 5) + (fn) + e + (k) + (x);                                   \
+    e = d;                                                                   \
+    d = c;                                                                   \
+    c = ROTL(b, 30);                                                         \
+    b = a;                                                                   \
+    a = t
+
+/** FIPS 180-4 */
+static void
+sha1_blocks(uint32_t *h, const uint8_t *p, size_t n)
+{
+    uint32_t w[16], a, b, c, d, e, t;
+    int i;
+
+    for (; n; n--, p += DIGEST_BLOCK)
+    {
+        a = h[0];
+        b = h[1];
+        c = h[2];
+        d = h[3];
+        e = h[4];
+        for (i = 0; i < 16; i++)
+        {
+            w[i] = BE32(p + i * 4);
+            SHA1_STEP(d ^ (b & (c ^ d)), 0x5a827999, w[i]);
+        }
+        for (; i < 20; i++)
+        {
+            SHA1_STEP(d ^ (b & (c ^ d)), 0x5a827999, SHA1_W(i));
+        }
+        for (; i < 40; i++)
+        {
+            SHA1_STEP(b ^ c ^ d, 0x6ed9eba1, SHA1_W(i));
+        }
+        for (; i < 60; i++)
+        {
+            SHA1_STEP((b & c) | (d & (b | c)), 0x8f1bbcdc, SHA1_W(i));
+        }
+        for (; i < 80; i++)
+        {
+            SHA1_STEP(b ^ c ^ d, 0xca62c1d6, SHA1_W(i));
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+}
+
+static void
+sha256_blocks_c(uint32_t *h, const uint8_t *p, size_t n)
+{
+    uint32_t w[64], s[8], t1, t2;
+    int i;
+
+    for (; n; n--, p += DIGEST_BLOCK)
+    {
+        for (i = 0; i < 16; i++)
+        {
+            w[i] = BE32(p + i * 4);
+        }
+        for (; i < 64; i++)
+        {
+            w[i] = w[i - 16] + w[i - 7] +
+                (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+                (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+        }
+        memcpy(s, h, sizeof (s));
+        for (i = 0; i < 64; i++)
+        {
+            t1 = s[7] + (ROTR(s[4], 6) ^ ROTR(s[4], 11) ^ ROTR(s[4], 25)) +
+                (s[6] ^ (s[4] & (s[5] ^ s[6]))) + sha256_k[i] + w[i];
+            t2 = (ROTR(s[0], 2) ^ ROTR(s[0], 13) ^ ROTR(s[0], 22)) +
+                ((s[0] & s[1]) | (s[2] & (s[0] | s[1])));
+            s[7] = s[6];
+            s[6] = s[5];
+            s[5] = s[4];
+            s[4] = s[3] + t1;
+            s[3] = s[2];
+            s[2] = s[1];
+            s[1] = s[0];
+            s[0] = t1 + t2;
+        }
+        for (i = 0; i < 8; i++)
+        {
+            h[i] += s[i];
+        }
+    }
+}
+
+/** EOF */
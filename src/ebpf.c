@@ -0,0 +1,225 @@
+/*
+ * ebpf.c - kernel side flow bypass
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "ebpf.h"
+
+#if (HAVE_EBPF)
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+/** just enough of an assembler for the one program we need */
+#define EI(c, d, s, o, i)                                                    \
+    { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) }
+#define E_MOV_X(d, s)     EI(BPF_ALU64|BPF_MOV|BPF_X, d, s, 0, 0)
+#define E_MOV_K(d, i)     EI(BPF_ALU64|BPF_MOV|BPF_K, d, 0, 0, i)
+#define E_MOV32_K(d, i)   EI(BPF_ALU|BPF_MOV|BPF_K, d, 0, 0, i)
+#define E_ALU_K(op, d, i) EI(BPF_ALU64|(op)|BPF_K, d, 0, 0, i)
+#define E_LD_ABS(sz, k)   EI(BPF_LD|(sz)|BPF_ABS, 0, 0, 0, k)
+#define E_LD_IND(sz, s, k) EI(BPF_LD|(sz)|BPF_IND, 0, s, 0, k)
+#define E_STX(sz, d, s, o) EI(BPF_STX|(sz)|BPF_MEM, d, s, o, 0)
+#define E_JMP_K(op, d, i, o) EI(BPF_JMP|(op)|BPF_K, d, 0, o, i)
+#define E_CALL(f)         EI(BPF_JMP|BPF_CALL, 0, 0, 0, f)
+#define E_EXIT()          EI(BPF_JMP|BPF_EXIT, 0, 0, 0, 0)
+#define E_LD_MAP(d, fd)                                                      \
+    EI(BPF_LD|BPF_DW|BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd),                  \
+    EI(0, 0, 0, 0, 0)
+
+static int
+ebpf_sys(int cmd, union bpf_attr *attr)
+{
+    return (syscall(__NR_bpf, cmd, attr, sizeof (*attr)));
+}
+
+/*
+ * Build the map and load the filter.  Offsets are from the start of an
+ * Ethernet frame, same as the pcap filter it replaces; anything that
+ * isn't an unfragmented (or first fragment) TCP/IPv4 packet is passed.
+ */
+int
+ebpf_init(ebpf_t *e, char *errbuf)
+{
+    union bpf_attr attr;
+    char log[4096];
+    struct bpf_insn prog[] =
+    {
+        E_MOV_X(BPF_REG_6, BPF_REG_1),              /*  0 ctx for LD_ABS */
+        E_LD_ABS(BPF_H, 12),                        /*  1 ethertype */
+        E_JMP_K(BPF_JNE, BPF_REG_0, 0x0800, 29),    /*  2 not IPv4: pass */
+        E_LD_ABS(BPF_B, 23),                        /*  3 protocol */
+        E_JMP_K(BPF_JNE, BPF_REG_0, 6, 27),         /*  4 not TCP: pass */
+        E_LD_ABS(BPF_H, 20),                        /*  5 fragment offset */
+        E_ALU_K(BPF_AND, BPF_REG_0, 0x1fff),        /*  6 */
+        E_JMP_K(BPF_JNE, BPF_REG_0, 0, 24),         /*  7 no ports: pass */
+        E_LD_ABS(BPF_W, 26),                        /*  8 key.ip_src */
+        E_STX(BPF_W, BPF_REG_10, BPF_REG_0, -12),   /*  9 */
+        E_LD_ABS(BPF_W, 30),                        /* 10 key.ip_dst */
+        E_STX(BPF_W, BPF_REG_10, BPF_REG_0, -8),    /* 11 */
+        E_LD_ABS(BPF_B, 14),                        /* 12 IP header length */
+        E_ALU_K(BPF_AND, BPF_REG_0, 0x0f),          /* 13 */
+        E_ALU_K(BPF_LSH, BPF_REG_0, 2),             /* 14 */
+        E_MOV_X(BPF_REG_7, BPF_REG_0),              /* 15 */
+        E_LD_IND(BPF_H, BPF_REG_7, 14),             /* 16 key.port_src */
+        E_STX(BPF_H, BPF_REG_10, BPF_REG_0, -4),    /* 17 */
+        E_LD_IND(BPF_H, BPF_REG_7, 16),             /* 18 key.port_dst */
+        E_STX(BPF_H, BPF_REG_10, BPF_REG_0, -2),    /* 19 */
+        E_LD_IND(BPF_B, BPF_REG_7, 27),             /* 20 TCP flags */
+        E_ALU_K(BPF_AND, BPF_REG_0, 0x02),          /* 21 SYN */
+        E_LD_MAP(BPF_REG_1, 0),                     /* 22, 23 map */
+        E_MOV_X(BPF_REG_2, BPF_REG_10),             /* 24 &key */
+        E_ALU_K(BPF_ADD, BPF_REG_2, -12),           /* 25 */
+        E_JMP_K(BPF_JNE, BPF_REG_0, 0, 4),          /* 26 SYN: forget it */
+        E_CALL(BPF_FUNC_map_lookup_elem),           /* 27 */
+        E_JMP_K(BPF_JEQ, BPF_REG_0, 0, 3),          /* 28 not bypassed */
+        E_MOV_K(BPF_REG_0, 0),                      /* 29 drop */
+        E_EXIT(),                                   /* 30 */
+        E_CALL(BPF_FUNC_map_delete_elem),           /* 31 */
+        E_MOV32_K(BPF_REG_0, -1),                   /* 32 pass, all of it */
+        E_EXIT(),                                   /* 33 */
+    };
+
+    memset(e, 0, sizeof (ebpf_t));
+    e->prog_fd = -1;
+
+    memset(&attr, 0, sizeof (attr));
+    attr.map_type    = BPF_MAP_TYPE_LRU_HASH;
+    attr.key_size    = sizeof (ebpf_key_t);
+    attr.value_size  = sizeof (uint32_t);
+    attr.max_entries = NFEX_EBPF_MAP_SIZE;
+    e->map_fd = ebpf_sys(BPF_MAP_CREATE, &attr);
+    if (e->map_fd == -1)
+    {
+        snprintf(errbuf, NFEX_EBPF_ERRBUF, "BPF_MAP_CREATE: %s",
+            strerror(errno));
+        return (-1);
+    }
+    prog[22].imm = e->map_fd;
+
+    memset(&attr, 0, sizeof (attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns     = (uint64_t)(unsigned long)prog;
+    attr.insn_cnt  = sizeof (prog) / sizeof (prog[0]);
+    attr.license   = (uint64_t)(unsigned long)"BSD";
+    attr.log_buf   = (uint64_t)(unsigned long)log;
+    attr.log_size  = sizeof (log);
+    attr.log_level = 1;
+    log[0] = 0;
+    e->prog_fd = ebpf_sys(BPF_PROG_LOAD, &attr);
+    if (e->prog_fd == -1)
+    {
+        snprintf(errbuf, NFEX_EBPF_ERRBUF, "BPF_PROG_LOAD: %s",
+            strerror(errno));
+        if (log[0])
+        {
+            fprintf(stderr, "%s", log);
+        }
+        ebpf_close(e);
+        return (-1);
+    }
+    return (1);
+}
+
+/*
+ * Put the filter on a capture socket.  It replaces whatever pcap filter
+ * was there, the caller has to apply that one in userland from here on.
+ */
+int
+ebpf_attach(ebpf_t *e, int fd, char *errbuf)
+{
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_BPF, &e->prog_fd,
+        sizeof (e->prog_fd)) == -1)
+    {
+        snprintf(errbuf, NFEX_EBPF_ERRBUF, "SO_ATTACH_BPF: %s",
+            strerror(errno));
+        return (-1);
+    }
+    return (1);
+}
+
+/** stop this flow at the kernel, everything's in network byte order */
+void
+ebpf_bypass(ebpf_t *e, uint32_t ip_src, uint32_t ip_dst, uint16_t port_src,
+uint16_t port_dst)
+{
+    union bpf_attr attr;
+    ebpf_key_t key;
+    uint32_t v;
+
+    memset(&key, 0, sizeof (key));
+    key.ip_src   = ntohl(ip_src);
+    key.ip_dst   = ntohl(ip_dst);
+    key.port_src = ntohs(port_src);
+    key.port_dst = ntohs(port_dst);
+    v = 1;
+
+    memset(&attr, 0, sizeof (attr));
+    attr.map_fd = e->map_fd;
+    attr.key    = (uint64_t)(unsigned long)&key;
+    attr.value  = (uint64_t)(unsigned long)&v;
+    attr.flags  = BPF_ANY;
+    if (ebpf_sys(BPF_MAP_UPDATE_ELEM, &attr) == -1)
+    {
+        __atomic_add_fetch(&e->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(&e->flows, 1, __ATOMIC_RELAXED);
+}
+
+void
+ebpf_close(ebpf_t *e)
+{
+    if (e->prog_fd != -1)
+    {
+        close(e->prog_fd);
+    }
+    if (e->map_fd != -1)
+    {
+        close(e->map_fd);
+    }
+    e->prog_fd = -1;
+    e->map_fd  = -1;
+}
+
+#else /* !HAVE_EBPF */
+
+int
+ebpf_init(ebpf_t *e, char *errbuf)
+{
+    memset(e, 0, sizeof (ebpf_t));
+    e->map_fd  = -1;
+    e->prog_fd = -1;
+    snprintf(errbuf, NFEX_EBPF_ERRBUF, "eBPF not supported here");
+    return (-1);
+}
+
+int
+ebpf_attach(ebpf_t *e, int fd, char *errbuf)
+{
+    return (-1);
+}
+
+void
+ebpf_bypass(ebpf_t *e, uint32_t ip_src, uint32_t ip_dst, uint16_t port_src,
+uint16_t port_dst)
+{
+}
+
+void
+ebpf_close(ebpf_t *e)
+{
+}
+
+#endif /* HAVE_EBPF */
+
+/** EOF */
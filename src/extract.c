@@ -36,15 +36,19 @@
 
 /*
  * called once for each packet, this function starts, updates, and closes
- * file extractions.  this is the one-stop-shop for all your file extraction 
- * needs
+ * file extractions in the direction of the session the data went.  this 
+ * is the one-stop-shop for all your file extraction needs
  */
 void
-extract(extract_list_t **elist, srch_results_t *results, ht_node_t *session, 
-const uint8_t *data, size_t size, ncc_t *ncc)
+extract(ht_flow_t *flow, srch_results_t *results, ht_node_t *session, 
+const uint8_t *data, size_t size, nwc_t *w)
 {
     srch_results_t *r;
-    extract_list_t *e;
+    extract_list_t *e, **elist;
+    int dir;
+
+    elist = &flow->extract_list;
+    dir   = flow - session->flow;
 
     /*
      * set all existing segment values to what they would be with no search 
@@ -60,8 +64,20 @@ const uint8_t *data, size_t size, ncc_t *ncc)
     {
         if (r->spectype == HEADER)
         {
-            add_extract(elist, r->fileid, session, r->offset.start, 
-                size, ncc);
+            if (r->fileid->depth &&
+                (int64_t)flow->depth + r->offset.start >=
+                (int64_t)r->fileid->depth)
+            {
+                /** too deep into the stream to count */
+                continue;
+            }
+            if ((r->fileid->dir & flow->role) == 0)
+            {
+                /** not carved going this way */
+                continue;
+            }
+            add_extract(elist, r->fileid, session, dir, r->offset.start, 
+                size, w);
         }
     }
 
@@ -77,37 +93,35 @@ const uint8_t *data, size_t size, ncc_t *ncc)
     /** now lets do all the file writing and whatnot */
     for (e = *elist; e; e = e->next)
     {
-        extract_segment(e, data, ncc);
+        extract_segment(e, data, w);
     }
 
     /** remove any finished extractions from the list */
-    sweep_extract_list(elist);
+    sweep_extract_list(elist, w);
 }
 
 /* Add a new header match to the list of files being extracted */
 static void
 add_extract(extract_list_t **elist, fileid_t *fileid, ht_node_t *session, 
-int offset, int size, ncc_t *ncc)
+int dir, int offset, int size, nwc_t *w)
 {
     int n;
     char *q;
     extract_list_t *p;
+    index_rec_t rec;
     char fname[FILENAME_BUFFER_SIZE] = {'\0'};
 
 
     /** open the file descriptor that we'll extract into */
     q = fname;
-    n = open_extract(fileid->ext, session->ft.ip_src, session->ft.port_src,
-            session->ft.ip_dst, session->ft.port_dst, &q, ncc);
+    n = open_extract(fileid->ext, session, dir, &q, &rec, w);
     if (n == -1)
     {
-        if (ncc->flags & NFEX_VERBOSE)
+        if (w->ncc->flags & NFEX_VERBOSE)
         {
             fprintf(stderr, "error extracting \"%s\" (", fileid->ext);
-            fprintip(stderr, session->ft.ip_src, ncc);
-            fprintf(stderr, ":%d -> ", ntohs(session->ft.port_src));
-            fprintip(stderr, session->ft.ip_dst, ncc);
-            fprintf(stderr, ":%d) to %s\n", ntohs(session->ft.port_dst), fname);
+            fprintsession(stderr, session, dir, w->ncc);
+            fprintf(stderr, ") to %s\n", fname);
         }
         else
         {
@@ -117,29 +131,29 @@ int offset, int size, ncc_t *ncc)
         //p->finish++;
         return;
     }
-    if (ncc->flags & NFEX_VERBOSE)
+    if (w->ncc->flags & NFEX_VERBOSE)
     {
         fprintf(stdout, "extracting \"%s\" (", fileid->ext);
-        fprintip(stdout, session->ft.ip_src, ncc);
-        fprintf(stdout, ":%d -> ", ntohs(session->ft.port_src));
-        fprintip(stdout, session->ft.ip_dst, ncc);
-        fprintf(stdout, ":%d) to %s\n", ntohs(session->ft.port_dst), fname);
+        fprintsession(stdout, session, dir, w->ncc);
+        fprintf(stdout, ") to %s\n", fname);
     }
-    ncc->stats.total_files++;
+    w->stats.total_files++;
 
     /** add new entry to the front extract linked list */
-    p = malloc(sizeof (*p));
+    p = pool_get(&w->extracts);
     if (p == NULL)
     {
-        fprintf(stderr, "malloc(): %s\n", strerror(errno));
+        fprintf(stderr, "pool_get(): %s\n", strerror(errno));
         return;
     }
     memset(p, 0, sizeof (*p));
 
     p->next      = *elist;
-    p->fileid    = fileid;
-    p->timestamp = time(NULL);
+    p->fileid    = *fileid;
+    p->timestamp = w->now;
     p->fd        = n;
+    p->rec       = rec;
+    digest_init(&p->digest, w->ncc->digests);
     if (p->next)
     {
         p->next->prev = p;
@@ -159,50 +173,68 @@ int offset, int size, ncc_t *ncc)
 
 /** open the next availible filename for writing */
 static int 
-open_extract(char *ext, uint32_t src_ip, uint16_t src_prt, uint32_t dst_ip, 
-uint16_t dst_prt, char **fname, ncc_t *ncc)
+open_extract(char *ext, ht_node_t *session, int dir, char **fname,
+index_rec_t *rec, nwc_t *w)
 {
     int n;
-    uint8_t ip_addr_s[4], ip_addr_d[4];
-    struct tm *time_machine;
-    char timestamp[50] = {'\0'};
-
-    /** build file name */
-    ncc->filenum++;
-    snprintf(*fname, FILENAME_BUFFER_SIZE, "%s%d-%06d.%s", 
-        ncc->output_dir == NULL ? "" : ncc->output_dir, 
-        getpid(), ncc->filenum, ext);
-
-    /** open file */
-    n = open(*fname, O_WRONLY|O_CREAT|O_EXCL, S_IRWXU|S_IRWXG|S_IRWXO);
+    ncc_t *ncc;
+    uint32_t filenum;
+
+    ncc = w->ncc;
+
+    /** build file name, the numbering is shared by all the workers */
+    filenum = __atomic_add_fetch(&ncc->filenum, 1, __ATOMIC_RELAXED);
+    extract_name(*fname, ncc, filenum, ext);
+
+    /** open file, with io_uring we only find out later if it didn't */
+    n = writer_open(&w->writer, *fname);
     if (n == -1)
     {
         fprintf(stderr, "error opening file: %s: %s\n", *fname, 
             strerror(errno));
-        ncc->stats.extraction_errors++;
+        w->stats.extraction_errors++;
         return (-1);
     }
 
-    /** write out details to index file */
-    fprintf(ncc->indexfp, "%s, ", ncc->device ? "live-capture" : ncc->capfname);
-    memcpy(ip_addr_s, &src_ip, 4);
-    memcpy(ip_addr_d, &dst_ip, 4);
-
-    time_machine = gmtime(&ncc->stats.ts_last.tv_sec);
-    strftime(timestamp, 50, "%Y-%m-%dT%H:%M:%S", time_machine);
-
-    fprintf(ncc->indexfp, 
-           "%s.%ldZ, %d.%d.%d.%d.%d, %d.%d.%d.%d.%d, %d-%06d.%s\n",
-           timestamp, (long)ncc->stats.ts_last.tv_usec,
-           ip_addr_s[0], ip_addr_s[1], ip_addr_s[2], ip_addr_s[3], 
-           ntohs(src_prt),
-           ip_addr_d[0], ip_addr_d[1], ip_addr_d[2], ip_addr_d[3],
-           ntohs(dst_prt), getpid(), ncc->filenum, ext);
-
-    fflush(ncc->indexfp);
+    /*
+     * start the index record, from whoever sent the file to whoever got
+     * it; the rest is filled in when it's closed
+     */
+    memset(rec, 0, sizeof (*rec));
+    rec->start_sec  = w->stats.ts_last.tv_sec;
+    rec->start_usec = w->stats.ts_last.tv_usec;
+    rec->filenum    = filenum;
+    if (session->ip6)
+    {
+        rec->family = 6;
+        memcpy(rec->src, dir ? session->ip6->dst : session->ip6->src, 16);
+        memcpy(rec->dst, dir ? session->ip6->src : session->ip6->dst, 16);
+    }
+    else
+    {
+        rec->family = 4;
+        memcpy(rec->src, dir ? &session->ft.ip_dst : &session->ft.ip_src, 4);
+        memcpy(rec->dst, dir ? &session->ft.ip_src : &session->ft.ip_dst, 4);
+    }
+    rec->sport = ntohs(dir ? session->ft.port_dst : session->ft.port_src);
+    rec->dport = ntohs(dir ? session->ft.port_src : session->ft.port_dst);
+    snprintf(rec->ext, sizeof (rec->ext), "%s", ext);
     return (n);
 }
 
+/*
+ * pid-filenum.ext in the output directory, or in the store a temporary
+ * name it has until we know what's in it
+ */
+static void
+extract_name(char *fname, ncc_t *ncc, uint32_t filenum, const char *ext)
+{
+    snprintf(fname, FILENAME_BUFFER_SIZE, "%s%d-%06d.%s%s",
+        ncc->output_dir == NULL ? "" : ncc->output_dir,
+        getpid(), filenum, ext,
+        ncc->flags & NFEX_STORE ? NFEX_STORE_TMP : "");
+}
+
 /*
  * set segment start and end values to the contraints of the data buffer or 
  * maxlen
@@ -215,9 +247,9 @@ set_segment_marks(extract_list_t *elist, size_t size)
     for (p = elist; p; p = p->next)
     {
         p->segment.start = 0;
-        if (p->fileid->maxlen - p->nwritten < size)
+        if (p->fileid.maxlen - p->nwritten < size)
         {
-            p->segment.end = p->fileid->maxlen - p->nwritten;
+            p->segment.end = p->fileid.maxlen - p->nwritten;
             p->finish++;
         }
         else
@@ -240,7 +272,9 @@ mark_footer(extract_list_t *elist, srch_results_t *footer)
      */
     for (p = elist; p; p = p->next)
     {
-        if (footer->fileid->id == p->fileid->id && 
+        /** ids are handed out again by a reload, the name has to match too */
+        if (footer->fileid->id == p->fileid.id &&
+            strcmp(footer->fileid->ext, p->fileid.ext) == 0 &&
             p->segment.start < footer->offset.start)
         {
             /** XXX this could extend beyond maxlen */
@@ -251,38 +285,203 @@ mark_footer(extract_list_t *elist, srch_results_t *footer)
     }
 }
 
-/** write data to a specified extract file */
+/*
+ * Stage data for a specified extract file, it goes to the writer once the
+ * buffer fills.  Anything a buffer wouldn't help with, or that we can't
+ * get a buffer for, goes straight to the writer.
+ */
 static void
-extract_segment(extract_list_t *p, const uint8_t *data, ncc_t *ncc)
+extract_segment(extract_list_t *p, const uint8_t *data, nwc_t *w)
 {
-    size_t c, nbytes;
+    xbuf_cache_t *xc;
+    size_t nbytes;
 
     nbytes = p->segment.end - p->segment.start;
+    data  += p->segment.start;
 
     /** update timestamp */
-    p->timestamp = time(NULL);
-    c = write(p->fd, data + p->segment.start, nbytes);
-    if (c != nbytes)
+    p->timestamp = w->now;
+    if (nbytes == 0)
     {
-        fprintf(stderr, "error writing fd: %d, wrote %ld of %ld bytes: %s\n", 
-            p->fd, c, nbytes, strerror(errno));
-        ncc->stats.extraction_errors++;
-        return; 
+        return;
     }
     p->nwritten += nbytes;
-    sync();
+
+    /** hashed on the way through, we never read the file back */
+    digest_update(&p->digest, data, nbytes);
+
+    xc = &w->xbufs;
+    if (p->buf && p->buffered + nbytes > NFEX_XBUF_SIZE)
+    {
+        xbuf_flush(p, w);
+    }
+    if (p->buf == NULL && nbytes < NFEX_XBUF_SIZE)
+    {
+        /** all taken, the one that's sat longest gives its up */
+        if (xc->bufs.in_use >= xc->max && xc->oldest)
+        {
+            w->stats.xbuf_evictions++;
+            xbuf_release(xc->oldest, w);
+        }
+        p->buf = pool_get(&xc->bufs);
+        if (p->buf)
+        {
+            p->newer = NULL;
+            p->older = xc->newest;
+            if (xc->newest)
+            {
+                xc->newest->newer = p;
+            }
+            else
+            {
+                xc->oldest = p;
+            }
+            xc->newest = p;
+        }
+    }
+    if (p->buf == NULL || nbytes >= NFEX_XBUF_SIZE)
+    {
+        writer_write(&w->writer, p->fd, data, nbytes);
+        return;
+    }
+    memcpy(p->buf + p->buffered, data, nbytes);
+    p->buffered += nbytes;
+
+    /** most recently touched goes to the back of the line */
+    if (xc->newest != p)
+    {
+        p->newer->older = p->older;
+        if (p->older)
+        {
+            p->older->newer = p->newer;
+        }
+        else
+        {
+            xc->oldest = p->newer;
+        }
+        p->newer = NULL;
+        p->older = xc->newest;
+        xc->newest->newer = p;
+        xc->newest = p;
+    }
+    if (p->buffered == NFEX_XBUF_SIZE)
+    {
+        xbuf_flush(p, w);
+    }
+}
+
+/** hand whatever's staged to the writer, the buffer is kept */
+static void
+xbuf_flush(extract_list_t *p, nwc_t *w)
+{
+    if (p->buffered)
+    {
+        writer_write(&w->writer, p->fd, p->buf, p->buffered);
+        w->stats.xbuf_writes++;
+        p->buffered = 0;
+    }
+}
+
+/** flush and give the buffer back */
+static void
+xbuf_release(extract_list_t *p, nwc_t *w)
+{
+    xbuf_cache_t *xc;
+
+    if (p->buf == NULL)
+    {
+        return;
+    }
+    xbuf_flush(p, w);
+    xc = &w->xbufs;
+    if (p->older)
+    {
+        p->older->newer = p->newer;
+    }
+    else
+    {
+        xc->oldest = p->newer;
+    }
+    if (p->newer)
+    {
+        p->newer->older = p->older;
+    }
+    else
+    {
+        xc->newest = p->older;
+    }
+    pool_put(&xc->bufs, p->buf);
+    p->buf = NULL;
+}
+
+/*
+ * All done with an extraction, staged data and all, off to the index.  In
+ * the store it's linked in by its SHA-256, and if that's a file we've
+ * already got whatever's still staged is never written at all.  One that
+ * another copy is still on its way in for is written out in full anyway,
+ * that copy may not make it.
+ */
+void
+extract_close(extract_list_t *p, nwc_t *w)
+{
+    char tmp[FILENAME_BUFFER_SIZE], path[FILENAME_BUFFER_SIZE];
+    ncc_t *ncc;
+
+    ncc = w->ncc;
+    p->rec.ts_sec  = w->stats.ts_last.tv_sec;
+    p->rec.ts_usec = w->stats.ts_last.tv_usec;
+    p->rec.size    = p->nwritten;
+    p->rec.digests = p->digest.which;
+    digest_final(&p->digest, p->rec.md5, p->rec.sha1, p->rec.sha256);
+
+    if (ncc->flags & NFEX_STORE)
+    {
+        if (store_add(&ncc->store, p->rec.sha256, p->rec.ext))
+        {
+            p->rec.store = INDEX_STORE_NEW;
+        }
+        else
+        {
+            p->rec.store = INDEX_STORE_DUP;
+            w->stats.store_dups++;
+            w->stats.store_bytes += p->nwritten;
+            p->buffered = 0;
+        }
+        xbuf_release(p, w);
+        extract_name(tmp, ncc, p->rec.filenum, p->rec.ext);
+        store_name(path, sizeof (path), ncc->output_dir, p->rec.sha256,
+            p->rec.ext);
+
+        /*
+         * the writer closes it and links it in once it's all written, a
+         * copy is just thrown away (it may be short, and it could beat the
+         * first one there)
+         */
+        writer_commit(&w->writer, p->fd, tmp,
+            p->rec.store == INDEX_STORE_NEW ? path : NULL);
+    }
+    else
+    {
+        xbuf_release(p, w);
+
+        /** the writer closes it once everything queued is written */
+        writer_close(&w->writer, p->fd);
+    }
+    index_add(&ncc->index, w->id, &p->rec);
+    pool_put(&w->extracts, p);
 }
 
 /** remove all finished extracts from the list */
 static void
-sweep_extract_list(extract_list_t **elist)
+sweep_extract_list(extract_list_t **elist, nwc_t *w)
 {
     time_t now;
     extract_list_t *p, *nxt;
 
-    now = time(NULL);
-    for (p = *elist; p; p = p->next)
+    now = w->now;
+    for (p = *elist; p; p = nxt)
     {
+        nxt = p->next;
         /** remove all finished or expired extracts */
         if (p->finish || (now - p->timestamp >= SESSION_THRESHOLD))
         {
@@ -300,8 +499,7 @@ sweep_extract_list(extract_list_t **elist)
             {
                 *elist = p->next;
             }
-            close(p->fd);
-            free(p);
+            extract_close(p, w);
         }
     }
 }
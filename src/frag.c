@@ -0,0 +1,291 @@
+/*
+ * frag.c - IPv4 fragment reassembly
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include "nfex.h"
+#include "frag.h"
+#include <libnet.h>
+
+static uint32_t frag_hash(uint32_t, uint32_t, uint16_t, uint8_t);
+static void frag_expire(frag_cache_t *, time_t, n_stats_t *);
+static void frag_drop(frag_cache_t *, frag_queue_t *);
+
+void
+frag_init(frag_cache_t *fc, uint64_t max)
+{
+    memset(fc, 0, sizeof (frag_cache_t));
+    fc->max = max;
+    arena_init(&fc->out);
+}
+
+/*
+ * Take a fragment (the caller has checked the header length is sane and
+ * there).  Returns the whole datagram once the last hole is filled, with
+ * headroom bytes free in front of it for a link header; it's good until
+ * frag_release().  NULL while we're still waiting, or if the fragment
+ * was no good.
+ */
+uint8_t *
+frag_add(frag_cache_t *fc, const uint8_t *pkt, uint32_t len, time_t now,
+uint32_t headroom, uint32_t *dlen, n_stats_t *st)
+{
+    const struct libnet_ipv4_hdr *ip;
+    struct libnet_ipv4_hdr *dip;
+    frag_queue_t *q;
+    frag_piece_t *s, **pp;
+    uint32_t hl, flen, off, start, end, n, h;
+    uint16_t frag;
+    uint8_t *d;
+
+    st->frag_packets++;
+    ip   = (const struct libnet_ipv4_hdr *)pkt;
+    hl   = ip->ip_hl << 2;
+    flen = ntohs(ip->ip_len);
+    frag = ntohs(ip->ip_off);
+    if (flen < hl || flen > len)
+    {
+        /** truncated by the snaplen, or just broken */
+        st->frag_drops++;
+        return (NULL);
+    }
+    flen -= hl;
+    start = off = (frag & IP_OFFMASK) << 3;
+    end   = off + flen;
+    if (end + LIBNET_IPV4_H > NFEX_FRAG_DGRAM_MAX ||
+        ((frag & IP_MF) && (flen & 7)) || flen == 0)
+    {
+        st->frag_drops++;
+        return (NULL);
+    }
+
+    frag_expire(fc, now, st);
+
+    h = frag_hash(ip->ip_src.s_addr, ip->ip_dst.s_addr, ip->ip_id, ip->ip_p);
+    for (q = fc->buckets[h]; q; q = q->next)
+    {
+        if (q->ip_id == ip->ip_id && q->ip_src == ip->ip_src.s_addr &&
+            q->ip_dst == ip->ip_dst.s_addr && q->ip_p == ip->ip_p)
+        {
+            break;
+        }
+    }
+    if (q == NULL)
+    {
+        q = calloc(1, sizeof (frag_queue_t));
+        if (q == NULL)
+        {
+            st->frag_drops++;
+            return (NULL);
+        }
+        q->ip_src = ip->ip_src.s_addr;
+        q->ip_dst = ip->ip_dst.s_addr;
+        q->ip_id  = ip->ip_id;
+        q->ip_p   = ip->ip_p;
+        q->first  = now;
+        q->next   = fc->buckets[h];
+        fc->buckets[h] = q;
+        q->older  = fc->newest;
+        if (fc->newest)
+        {
+            fc->newest->newer = q;
+        }
+        else
+        {
+            fc->oldest = q;
+        }
+        fc->newest = q;
+        fc->queues++;
+        fc->bytes += sizeof (frag_queue_t);
+    }
+
+    /** the last fragment says how big it is, nothing can go past that */
+    if ((frag & IP_MF) == 0)
+    {
+        s = q->pieces;
+        while (s && s->next)
+        {
+            s = s->next;
+        }
+        if ((q->total && q->total != end) || (s && s->off + s->len > end))
+        {
+            st->frag_drops++;
+            frag_drop(fc, q);
+            return (NULL);
+        }
+        q->total = end;
+    }
+    else if (q->total && end > q->total)
+    {
+        st->frag_drops++;
+        frag_drop(fc, q);
+        return (NULL);
+    }
+    if (off == 0 && q->hlen == 0)
+    {
+        memcpy(q->hdr, pkt, hl);
+        q->hlen = hl;
+    }
+
+    /** fill in the holes this one covers, leave what we have alone */
+    for (pp = &q->pieces; off < end; )
+    {
+        while (*pp && (*pp)->off + (*pp)->len <= off)
+        {
+            pp = &(*pp)->next;
+        }
+        if (*pp && (*pp)->off <= off)
+        {
+            off = (*pp)->off + (*pp)->len;
+            pp  = &(*pp)->next;
+            continue;
+        }
+        n = (*pp ? MIN(end, (*pp)->off) : end) - off;
+        s = malloc(sizeof (frag_piece_t) + n);
+        if (s == NULL)
+        {
+            st->frag_drops++;
+            frag_drop(fc, q);
+            return (NULL);
+        }
+        s->off  = off;
+        s->len  = n;
+        memcpy(s->data, pkt + hl + (off - start), n);
+        s->next = *pp;
+        *pp     = s;
+        pp      = &s->next;
+
+        q->have   += n;
+        fc->bytes += sizeof (frag_piece_t) + n;
+        off       += n;
+    }
+    if (fc->bytes > fc->peak)
+    {
+        fc->peak = fc->bytes;
+    }
+
+    if (q->total && q->hlen && q->have == q->total)
+    {
+        /** no holes left, put it back together */
+        d = NULL;
+        if (q->hlen + q->total <= NFEX_FRAG_DGRAM_MAX)
+        {
+            d = arena_get(&fc->out, headroom + q->hlen + q->total);
+        }
+        if (d == NULL)
+        {
+            st->frag_drops++;
+            frag_drop(fc, q);
+            return (NULL);
+        }
+        d  += headroom;
+        memcpy(d, q->hdr, q->hlen);
+        for (s = q->pieces; s; s = s->next)
+        {
+            memcpy(d + q->hlen + s->off, s->data, s->len);
+        }
+        dip         = (struct libnet_ipv4_hdr *)d;
+        dip->ip_len = htons(q->hlen + q->total);
+        dip->ip_off = 0;
+        *dlen       = q->hlen + q->total;
+
+        st->frag_datagrams++;
+        frag_drop(fc, q);
+        return (d);
+    }
+
+    /** over budget: give up on the oldest until there's room */
+    while (fc->bytes > fc->max && fc->oldest)
+    {
+        st->frag_drops++;
+        frag_drop(fc, fc->oldest);
+    }
+    return (NULL);
+}
+
+/** the datagrams frag_add() handed out are done with */
+void
+frag_release(frag_cache_t *fc)
+{
+    arena_reset(&fc->out);
+}
+
+void
+frag_destroy(frag_cache_t *fc)
+{
+    while (fc->oldest)
+    {
+        frag_drop(fc, fc->oldest);
+    }
+    arena_destroy(&fc->out);
+}
+
+static uint32_t
+frag_hash(uint32_t src, uint32_t dst, uint16_t id, uint8_t p)
+{
+    uint32_t h;
+
+    h  = src ^ dst ^ ((uint32_t)id << 8) ^ p;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    return (h & (NFEX_FRAG_BUCKETS - 1));
+}
+
+/** anything that's had its time, on capture time like everything else */
+static void
+frag_expire(frag_cache_t *fc, time_t now, n_stats_t *st)
+{
+    while (fc->oldest && fc->oldest->first + NFEX_FRAG_TIMEOUT <= now)
+    {
+        st->frag_timeouts++;
+        frag_drop(fc, fc->oldest);
+    }
+}
+
+static void
+frag_drop(frag_cache_t *fc, frag_queue_t *q)
+{
+    frag_queue_t **qp;
+    frag_piece_t *s;
+
+    qp = &fc->buckets[frag_hash(q->ip_src, q->ip_dst, q->ip_id, q->ip_p)];
+    while (*qp != q)
+    {
+        qp = &(*qp)->next;
+    }
+    *qp = q->next;
+
+    if (q->older)
+    {
+        q->older->newer = q->newer;
+    }
+    else
+    {
+        fc->oldest = q->newer;
+    }
+    if (q->newer)
+    {
+        q->newer->older = q->older;
+    }
+    else
+    {
+        fc->newest = q->older;
+    }
+
+    while ((s = q->pieces))
+    {
+        q->pieces  = s->next;
+        fc->bytes -= sizeof (frag_piece_t) + s->len;
+        free(s);
+    }
+    fc->bytes -= sizeof (frag_queue_t);
+    fc->queues--;
+    free(q);
+}
+
+/** EOF */
@@ -18,112 +18,329 @@
 #include "extract.h"
 #include "util.h"
 
+/** how far the entry in slot i is from where it hashed to */
+#define HT_DIST(t, i) (((i) - ((t)->slots[(i)].hash & (t)->mask)) & (t)->mask)
+
+int
+ht_init(nwc_t *w)
+{
+    w->ht.slots = calloc(NFEX_HT_INIT_SIZE, sizeof (ht_slot_t));
+    if (w->ht.slots == NULL)
+    {
+        fprintf(stderr, "ht_init(): calloc(): %s\n", strerror(errno));
+        return (-1);
+    }
+    w->ht.size          = NFEX_HT_INIT_SIZE;
+    w->ht.mask          = NFEX_HT_INIT_SIZE - 1;
+    w->ht.entries       = 0;
+    w->ht.longest_probe = 0;
+    w->ht.grows         = 0;
+    return (1);
+}
+
+
+/** drop slot into table t, displacing richer entries as we go */
+static void
+ht_place(ht_t *t, ht_slot_t *slot, uint32_t i, uint32_t dist)
+{
+    ht_slot_t tmp;
+    uint32_t d;
+
+    for (;;)
+    {
+        if (t->slots[i].node == NULL)
+        {
+            t->slots[i] = *slot;
+            break;
+        }
+        d = HT_DIST(t, i);
+        if (d < dist)
+        {
+            /** Robin Hood: take from the rich, keep going with their entry */
+            tmp          = t->slots[i];
+            t->slots[i]  = *slot;
+            *slot        = tmp;
+            dist         = d;
+        }
+        i = (i + 1) & t->mask;
+        dist++;
+        if (dist > t->longest_probe)
+        {
+            t->longest_probe = dist;
+        }
+    }
+}
+
+
+/** double the table, rehashing every entry */
+static int
+ht_grow(ht_t *t)
+{
+    ht_slot_t *old, slot;
+    uint32_t i, old_size;
+
+    if (t->size >= NFEX_HT_MAX_SIZE)
+    {
+        return (-1);
+    }
+    old      = t->slots;
+    old_size = t->size;
+
+    t->slots = calloc(old_size * 2, sizeof (ht_slot_t));
+    if (t->slots == NULL)
+    {
+        fprintf(stderr, "ht_grow(): calloc(): %s\n", strerror(errno));
+        t->slots = old;
+        return (-1);
+    }
+    t->size = old_size * 2;
+    t->mask = t->size - 1;
+    t->longest_probe = 0;
+    t->grows++;
+
+    for (i = 0; i < old_size; i++)
+    {
+        if (old[i].node)
+        {
+            slot = old[i];
+            ht_place(t, &slot, slot.hash & t->mask, 0);
+        }
+    }
+    free(old);
+    return (1);
+}
+
+
+/*
+ * Put a key in canonical order, the lower (address, port) endpoint first,
+ * so both directions of a connection come out the same.  ip6 is the IPv6
+ * source and destination, NULL for IPv4: folds can collide, so the full
+ * addresses decide.  Returns 1 if it was swapped, the packet is going from
+ * the key's dst to its src.
+ */
+int
+ht_key(four_tuple_t *ft, const uint8_t *ip6)
+{
+    uint32_t a;
+    uint16_t port;
+    int c;
+
+    if (ip6)
+    {
+        c = memcmp(ip6, ip6 + 16, 16);
+    }
+    else
+    {
+        c = (ft->ip_src > ft->ip_dst) - (ft->ip_src < ft->ip_dst);
+    }
+    if (c == 0)
+    {
+        c = (ft->port_src > ft->port_dst) - (ft->port_src < ft->port_dst);
+    }
+    if (c <= 0)
+    {
+        return (0);
+    }
+    a            = ft->ip_src;
+    ft->ip_src   = ft->ip_dst;
+    ft->ip_dst   = a;
+    port         = ft->port_src;
+    ft->port_src = ft->port_dst;
+    ft->port_dst = port;
+    return (1);
+}
+
+
+/** a session's IPv6 addresses against a packet's, turned round if need be */
+static inline int
+ht_match6(const ip6_pair_t *k, const uint8_t *ip6, int dir)
+{
+    if (dir)
+    {
+        return (memcmp(k->src, ip6 + 16, 16) == 0 && 
+            memcmp(k->dst, ip6, 16) == 0);
+    }
+    return (memcmp(k, ip6, sizeof (ip6_pair_t)) == 0);
+}
+
+
+static void
+ht_flow_init(ht_flow_t *f, uint8_t role, nwc_t *w)
+{
+    f->flags        = 0;
+    f->role         = role;
+    f->depth        = 0;
+    f->srch_state   = SRCH_STATE_START;
+    f->srch_epoch   = w->sc->epoch;
+    f->extract_list = NULL;
+    memset(&f->stream, 0, sizeof (reasm_t));
+}
+
+
+/*
+ * find a session or create it if it doesn't exist, in one pass: with Robin
+ * Hood ordering the first slot that is empty or closer to home than we are
+ * is both proof of absence and the place the new session goes.  ft is in
+ * canonical order and dir is what ht_key() said about it; h is 
+ * ht_hash(ft, ip6 != NULL), the caller has it already from prefetching the
+ * slot.  ip6 is the IPv6 source and destination as they are in the packet,
+ * NULL for IPv4.
+ */
 ht_node_t *
-ht_insert(four_tuple_t *ft, ncc_t *ncc)
+ht_insert(four_tuple_t *ft, uint32_t h, const uint8_t *ip6, int dir, 
+nwc_t *w)
 {
-    uint16_t n, j;
+    uint32_t i, dist;
+    uint16_t sport, dport;
+    uint8_t role;
+    ht_slot_t slot;
     ht_node_t *p;
+    ht_t *t;
 
-    n = ht_hash(ft);
+    t = &w->ht;
 
-    if (ncc->ht[n] == NULL)
+    /** keep the load factor in check before we start probing */
+    if ((uint64_t)(t->entries + 1) * NFEX_HT_LOAD_DEN > 
+        (uint64_t)t->size * NFEX_HT_LOAD_NUM)
     {
-        /** create first entry in this slot */
-        ncc->ht[n] = malloc(sizeof (ht_node_t));
-        if (ncc->ht[n] == NULL)
+        if (ht_grow(t) == -1 && t->entries + 1 >= t->size)
         {
-            fprintf(stderr, "ht_insert(): malloc(): %s\n", strerror(errno));
             return (NULL);
         }
-        memcpy(&(ncc->ht[n]->ft), ft, sizeof (four_tuple_t));
-        ncc->ht[n]->timestamp    = time(NULL);
-        ncc->ht[n]->srchptr_list = NULL;
-        ncc->ht[n]->extract_list = NULL;
-        ncc->ht[n]->next         = NULL; 
-        ncc->ht[n]->prev         = NULL; 
-        p = ncc->ht[n];
-
-        /** update ht stats: non chained entry */
-        ncc->stats.ht_nc++;
     }
-    else  /** collision */
+
+    for (i = h & t->mask, dist = 0; ; i = (i + 1) & t->mask, dist++)
     {
-        p = ht_find(ft, ncc);
-        if (p)
+        if (t->slots[i].node == NULL || HT_DIST(t, i) < dist)
         {
+            break;
+        }
+        if (t->slots[i].hash == h && 
+            memcmp(ft, &t->slots[i].ft, sizeof (four_tuple_t)) == 0 &&
+            (ip6 == NULL || ht_match6(t->slots[i].node->ip6, ip6, dir)))
+        {
+            /** found him, update timestamp */
+            p = t->slots[i].node;
+            p->timestamp = w->now;
             return (p);
         }
-        for (p = ncc->ht[n], j = 0; p->next; p = p->next, j++);
-        /** end of chain, no duplicate, add a new one */
-        p->next = malloc(sizeof (ht_node_t));
-        if (p->next == NULL)
+    }
+
+    p = pool_get(&w->sessions);
+    if (p == NULL)
+    {
+        fprintf(stderr, "ht_insert(): pool_get(): %s\n", strerror(errno));
+        return (NULL);
+    }
+    p->ip6 = NULL;
+    if (ip6)
+    {
+        p->ip6 = pool_get(&w->addrs);
+        if (p->ip6 == NULL)
         {
-            fprintf(stderr, "ht_insert(): malloc(): %s\n", strerror(errno));
+            fprintf(stderr, "ht_insert(): pool_get(): %s\n", strerror(errno));
+            pool_put(&w->sessions, p);
             return (NULL);
         }
-        memcpy(&(p->next->ft), ft, sizeof (four_tuple_t));
-        p->next->timestamp    = time(NULL);
-        p->next->srchptr_list = NULL;
-        p->next->extract_list = NULL;
-        p->next->next         = NULL; 
-        p->next->prev         = p;
-
-        /** update ht stats: chained entry */
-        ncc->stats.ht_ic++; 
-        /** update ht stats: longest chain */
-        ncc->stats.ht_lc = j > ncc->stats.ht_lc ? j : ncc->stats.ht_lc;
+        memcpy(p->ip6->src, ip6 + (dir ? 16 : 0), 16);
+        memcpy(p->ip6->dst, ip6 + (dir ? 0 : 16), 16);
     }
-
-    if (ncc->flags & NFEX_DEBUG)
+    memcpy(&(p->ft), ft, sizeof (four_tuple_t));
+    p->timestamp = w->now;
+
+    /** until a SYN says otherwise, whoever has the lower port serves */
+    sport = ntohs(ft->port_src);
+    dport = ntohs(ft->port_dst);
+    role  = sport < dport ? SRCH_DIR_SERVER : 
+            sport > dport ? SRCH_DIR_CLIENT : SRCH_DIR_BOTH;
+    ht_flow_init(&p->flow[0], role, w);
+    ht_flow_init(&p->flow[1], role == SRCH_DIR_BOTH ? role : 
+        role ^ SRCH_DIR_BOTH, w);
+    tw_schedule(&w->tw, p);
+
+    slot.hash = h;
+    slot.ft   = *ft;
+    slot.node = p;
+    ht_place(t, &slot, i, dist);
+
+    if (w->ncc->flags & NFEX_DEBUG)
     {
         fprintf(stderr, "new session: ");
-        fprintip(stderr, ft->ip_src, ncc);
-        fprintf(stderr, ":%d -> ", ntohs(ft->port_src));
-        fprintip(stderr, ft->ip_dst, ncc);
-        fprintf(stderr, ":%d\n", ntohs(ft->port_dst));
+        fprintsession(stderr, p, dir, w->ncc);
+        fprintf(stderr, "\n");
     }
 
     /** update ht stats: total entries */
-    ncc->stats.ht_entries++;
+    t->entries++;
+    w->stats.ht_inserts++;
     return (p);
 }
 
 
-uint16_t
-ht_hash(four_tuple_t *ft)
+/** IPv6 sessions are tagged, so they never match an IPv4 key */
+uint32_t
+ht_hash(four_tuple_t *ft, int v6)
 {
-   int i;
-   uint8_t *p;
-   uint32_t hash;
-
-   /* Fowler–Noll–Vo hash: http://en.wikipedia.org/wiki/Fowler_Noll_Vo_hash */
-   for (hash = 0, i = 0, p = (uint8_t *)ft; i < 12; p++, i++)
-   {
-      hash *= FNV_PRIME;
-      hash ^= (*p);
-   }
-
-   return (hash % NFEX_HT_SIZE);
+    uint32_t hash;
+
+    /** mix the three words of the four tuple, murmur3 finalizer */
+    hash  = ft->ip_src;
+    hash ^= ft->ip_dst * 0x9e3779b1;
+    hash ^= ((uint32_t)ft->port_src << 16 | ft->port_dst) * 0x85ebca6b;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return ((hash & ~NFEX_HT_V6) | (v6 ? NFEX_HT_V6 : 0));
 }
 
 
+/** either direction's key will do, it's put in order here */
 ht_node_t *
-ht_find(four_tuple_t *ft, ncc_t *ncc)
+ht_find(four_tuple_t *ft, const uint8_t *ip6, nwc_t *w)
 {
-    uint16_t n;
-    ht_node_t *p;
-
-    n = ht_hash(ft);
-    for (p = ncc->ht[n]; p; p = p->next)
+    uint32_t h, i, dist;
+    four_tuple_t k;
+    int dir;
+    ht_t *t;
+
+    t   = &w->ht;
+    k   = *ft;
+    dir = ht_key(&k, ip6);
+    h   = ht_hash(&k, ip6 != NULL);
+    for (i = h & t->mask, dist = 0; ; i = (i + 1) & t->mask, dist++)
     {
-        if (memcmp(ft, &p->ft, sizeof (four_tuple_t)) == 0)
+        if (t->slots[i].node == NULL || HT_DIST(t, i) < dist)
+        {
+            return (NULL);
+        }
+        if (t->slots[i].hash == h && 
+            memcmp(&k, &t->slots[i].ft, sizeof (four_tuple_t)) == 0 &&
+            (ip6 == NULL || ht_match6(t->slots[i].node->ip6, ip6, dir)))
         {
             /** found him, update timestamp */
-            p->timestamp = time(NULL);
-            return (p);
+            t->slots[i].node->timestamp = w->now;
+            return (t->slots[i].node);
         }
     }
-    return (NULL);
+}
+
+
+/** empty slot i, shifting the rest of its cluster back a slot */
+static void
+ht_remove_slot(ht_t *t, uint32_t i)
+{
+    uint32_t j;
+
+    for (j = (i + 1) & t->mask; t->slots[j].node && HT_DIST(t, j) > 0; 
+         i = j, j = (j + 1) & t->mask)
+    {
+        t->slots[i] = t->slots[j];
+    }
+    t->slots[i].node = NULL;
+    t->entries--;
 }
 
 
@@ -131,100 +348,244 @@ void
 ht_dump(ncc_t *ncc)
 {
     time_t now;
-    uint16_t n;
+    uint32_t n;
     ht_node_t *p;
+    nwc_t *w;
+    int i, empty;
 
-    if (ncc->stats.ht_entries == 0)
+    for (i = 0, empty = 1; i < ncc->nworkers; i++)
+    {
+        w = &ncc->workers[i];
+        pthread_mutex_lock(&w->lock);
+        if (w->ht.entries)
+        {
+            empty = 0;
+        }
+        now = w->now;
+        for (n = 0; n < w->ht.size; n++)
+        {
+            if ((p = w->ht.slots[n].node) == NULL)
+            {
+                continue;
+            }
+            fprintsession(stdout, p, 0, ncc);
+            fprintf(stdout, " %lds\n", now - p->timestamp);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    if (empty)
     {
         printf("session table empty\n");
-        return;
     }
+}
+
 
-    now = time(NULL);
+/** remove a session from the table, finding its slot by key */
+static void
+ht_delete(ht_t *t, ht_node_t *p)
+{
+    uint32_t h, i;
 
-    for (n = 0; n < NFEX_HT_SIZE; n++)
+    h = ht_hash(&p->ft, p->ip6 != NULL);
+    for (i = h & t->mask; t->slots[i].node; i = (i + 1) & t->mask)
     {
-        for (p = ncc->ht[n]; p; p = p->next)
+        if (t->slots[i].node == p)
         {
-            fprintip(stdout, p->ft.ip_src, ncc);
-            fprintf(stdout, ":%d -> ", ntohs(p->ft.port_src));
-            fprintip(stdout, p->ft.ip_dst, ncc);
-            fprintf(stdout, ":%d ", ntohs(p->ft.port_dst));
-            fprintf(stdout, "%lds\n", now - p->timestamp);
+            ht_remove_slot(t, i);
+            return;
+        }
+    }
+}
+
 
+/*
+ * tear down a session: whatever either direction was holding out of order
+ * is delivered across the holes, then in-flight extractions get closed out
+ */
+static void
+ht_free_session(ht_node_t *p, nwc_t *w)
+{
+    extract_list_t *e, *nxt;
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        reasm_flush(w, p, &p->flow[i]);
+        for (e = p->flow[i].extract_list; e; e = nxt)
+        {
+            nxt = e->next;
+            extract_close(e, w);
         }
     }
+    if (p->ip6)
+    {
+        pool_put(&w->addrs, p->ip6);
+    }
+    pool_put(&w->sessions, p);
 }
 
 
-void
-ht_shutitdown(ncc_t *ncc)
+/** file a session in the wheel slot for when it would go stale */
+static void
+tw_schedule(tw_t *tw, ht_node_t *p)
 {
-    uint16_t n;
-    ht_node_t *p, *q;
+    time_t delta;
+    ht_node_t **slot;
+
+    p->expires = p->timestamp + SESSION_THRESHOLD;
+    if (p->expires <= tw->now)
+    {
+        /** already due, pick it up on the next tick */
+        p->expires = tw->now + 1;
+    }
+    delta = p->expires - tw->now;
 
-    for (n = 0; n < NFEX_HT_SIZE; n++)
+    if (delta < NFEX_TW_SLOTS)
     {
-        for (p = ncc->ht[n]; p; p = q->next)
+        slot = &tw->slot[0][p->expires & NFEX_TW_MASK];
+    }
+    else
+    {
+        /** don't wrap around onto the slot that's up next */
+        if (delta >= (NFEX_TW_SLOTS - 1) << NFEX_TW_BITS)
         {
-            q = p;
-            free (p);
+            p->expires = tw->now + ((NFEX_TW_SLOTS - 1) << NFEX_TW_BITS) - 1;
         }
-        ncc->ht[n] = NULL;
+        slot = &tw->slot[1][(p->expires >> NFEX_TW_BITS) & NFEX_TW_MASK];
+    }
+
+    p->tw_next = *slot;
+    if (p->tw_next)
+    {
+        p->tw_next->tw_pprev = &p->tw_next;
     }
-    ncc->stats.ht_entries = 0;
+    p->tw_pprev = slot;
+    *slot       = p;
+}
+
+
+static void
+tw_unlink(ht_node_t *p)
+{
+    *p->tw_pprev = p->tw_next;
+    if (p->tw_next)
+    {
+        p->tw_next->tw_pprev = p->tw_pprev;
+    }
+    p->tw_next  = NULL;
+    p->tw_pprev = NULL;
 }
 
 
 void
-ht_expire_session(ncc_t *ncc)
+ht_shutitdown(nwc_t *w)
 {
-    time_t now;
-    uint16_t n;
+    uint32_t n;
+
+    if (w->ht.slots == NULL)
+    {
+        return;
+    }
+    for (n = 0; n < w->ht.size; n++)
+    {
+        if (w->ht.slots[n].node)
+        {
+            ht_free_session(w->ht.slots[n].node, w);
+        }
+    }
+    free(w->ht.slots);
+    w->ht.slots   = NULL;
+    w->ht.entries = 0;
+    memset(&w->tw, 0, sizeof (w->tw));
+}
+
+
+/** go through a list pulled off the wheel: expire or file again */
+static uint32_t
+tw_fire(ht_node_t *list, nwc_t *w)
+{
+    ht_node_t *p;
     uint32_t j;
-    ht_node_t *p, **q;
 
-    if (ncc->stats.ht_entries == 0)
+    for (j = 0; (p = list); )
     {
-        printf("session table empty\n");
+        list = p->tw_next;
+        if (w->tw.now - p->timestamp >= SESSION_THRESHOLD)
+        {
+            ht_delete(&w->ht, p);
+            ht_free_session(p, w);
+            j++;
+        }
+        else
+        {
+            tw_schedule(&w->tw, p);
+        }
+    }
+    return (j);
+}
+
+
+/*
+ * Run the timer wheel forward to the packet clock.  Each second only 
+ * looks at the sessions filed under it: ones that saw traffic since they
+ * were filed get filed again, the rest are expired.  Every 64 seconds the
+ * next coarse slot is spread out over the fine slots.
+ */
+void
+ht_expire_session(nwc_t *w)
+{
+    uint32_t j, k;
+    ht_node_t *p, *list;
+    tw_t *tw;
+
+    tw = &w->tw;
+    if (tw->now == 0 || w->ht.entries == 0)
+    {
+        /** first packet, or nothing to do: just catch up */
+        tw->now = w->now;
         return;
     }
 
-    now = time(NULL);
+    j = 0;
+    if (w->now - tw->now >= NFEX_TW_SLOTS << NFEX_TW_BITS)
+    {
+        /** a gap bigger than the wheel, everyone is due: round them up */
+        for (list = NULL, k = 0; k < NFEX_TW_LEVELS * NFEX_TW_SLOTS; k++)
+        {
+            while ((p = tw->slot[k / NFEX_TW_SLOTS][k % NFEX_TW_SLOTS]))
+            {
+                tw_unlink(p);
+                p->tw_next = list;
+                list       = p;
+            }
+        }
+        tw->now = w->now;
+        j += tw_fire(list, w);
+    }
 
-    for (j = 0, n = 0; n < NFEX_HT_SIZE; n++)
+    while (tw->now < w->now)
     {
-        for (p = ncc->ht[n]; p; p = p->next)
+        tw->now++;
+
+        /** cascade the coarse slot that just came into range */
+        if ((tw->now & NFEX_TW_MASK) == 0)
         {
-            /** if the timestamp is older than SESSION_THRESHOLD, delete */
-            if (now - p->timestamp >= SESSION_THRESHOLD)
+            list = tw->slot[1][(tw->now >> NFEX_TW_BITS) & NFEX_TW_MASK];
+            tw->slot[1][(tw->now >> NFEX_TW_BITS) & NFEX_TW_MASK] = NULL;
+            while ((p = list))
             {
-                if (p->prev == NULL)
-                {
-                    /** first entry in a chain */
-                    free(p);
-                    ncc->ht[n] = NULL;
-		    /** update ht stats: non chained entry */
-                    ncc->stats.ht_nc--;
-                }
-                else
-                {
-                    p->prev->next = p->next;
-                    if (p->next)
-                    {
-                        p->next->prev = p->prev;
-                    }
-                    free(p);
-		    /** update ht stats: chained entry */
-                    ncc->stats.ht_ic--;
-                }
-                j++;
-                /** update ht stats: total entries */
-                ncc->stats.ht_entries--;
+                list = p->tw_next;
+                tw_schedule(tw, p);
             }
         }
+
+        list = tw->slot[0][tw->now & NFEX_TW_MASK];
+        tw->slot[0][tw->now & NFEX_TW_MASK] = NULL;
+        j += tw_fire(list, w);
     }
-    if (j && ncc->flags & NFEX_DEBUG)
+
+    w->stats.ht_expired += j;
+    if (j && w->ncc->flags & NFEX_DEBUG)
     {
         printf("[DEBUG MODE] expired %d sessions from hash table\n", j);
     }
@@ -234,21 +595,33 @@ ht_expire_session(ncc_t *ncc)
 uint32_t
 ht_count_extracts(ncc_t *ncc)
 {
-    uint16_t n, j;
+    uint32_t n, j;
     ht_node_t *p;
+    extract_list_t *e;
+    nwc_t *w;
+    int i, k;
 
-    for (n = 0, j = 0; n < NFEX_HT_SIZE; n++)
+    for (i = 0, j = 0; i < ncc->nworkers; i++)
     {
-        for (p = ncc->ht[n]; p; p = p->next)
+        w = &ncc->workers[i];
+        pthread_mutex_lock(&w->lock);
+        for (n = 0; n < w->ht.size; n++)
         {
-            if (p->extract_list)
+            p = w->ht.slots[n].node;
+            if (p == NULL)
             {
-                if (p->extract_list->fd)
+                continue;
+            }
+            for (k = 0; k < 2; k++)
+            {
+                /** io_uring handles start at 0, so every one counts */
+                for (e = p->flow[k].extract_list; e; e = e->next)
                 {
                     j++;
                 }
             }
         }
+        pthread_mutex_unlock(&w->lock);
     }
     return (j);
 }
@@ -257,20 +630,39 @@ ht_count_extracts(ncc_t *ncc)
 void
 ht_status(ncc_t *ncc)
 {
-    uint16_t n;
+    n_stats_t s;
+    ht_t *t;
+    int i;
+    uint32_t size, entries, longest_probe, grows;
 
-    if (ncc->stats.ht_entries == 0)
+    size = entries = longest_probe = grows = 0;
+    for (i = 0; i < ncc->nworkers; i++)
+    {
+        t        = &ncc->workers[i].ht;
+        size    += t->size;
+        entries += t->entries;
+        grows   += t->grows;
+        if (t->longest_probe > longest_probe)
+        {
+            longest_probe = t->longest_probe;
+        }
+    }
+    if (entries == 0)
     {
         printf("session table empty\n");
         return;
     }
+    stats_sum(ncc, &s);
 
     printf("hash table status\n");
-    printf("table size:\t\t\t%d\n", NFEX_HT_SIZE);
-    printf("table population:\t\t%d\n", ncc->stats.ht_entries);
-    printf("un-chained entries:\t\t%d\n", ncc->stats.ht_nc);
-    printf("chained entries:\t\t%d\n", ncc->stats.ht_ic);
-    printf("longest chain:\t\t\t%d\n", ncc->stats.ht_lc);
+    printf("workers:\t\t\t%d\n", ncc->nworkers);
+    printf("table size:\t\t\t%d\n", size);
+    printf("table population:\t\t%d\n", entries);
+    printf("load factor:\t\t\t%.2f\n", (double)entries / (double)size);
+    printf("longest probe:\t\t\t%d\n", longest_probe);
+    printf("table grows:\t\t\t%d\n", grows);
+    printf("sessions created:\t\t%d\n", s.ht_inserts);
+    printf("sessions expired:\t\t%d\n", s.ht_expired);
 }
 
 /** EOF */
@@ -0,0 +1,408 @@
+/*
+ * index.c - extraction index
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include "nfex.h"
+#include "index.h"
+
+static void *index_thread(void *);
+static void index_flush(index_t *, uint32_t);
+static int index_cmp(const void *, const void *);
+static void index_json_string(FILE *, const char *);
+static char *index_hex(char *, const uint8_t *, int);
+
+/*
+ * Create the index file fname and start the thread that writes it, with a
+ * ring for each of nworkers to queue on.
+ */
+int
+index_init(index_t *ix, int format, const char *fname, char *source,
+int nworkers, char *errbuf)
+{
+    index_hdr_t hdr;
+    int i, n;
+
+    memset(ix, 0, sizeof (index_t));
+    ix->format = format;
+    ix->source = source;
+    ix->pid    = getpid();
+    ix->last   = time(NULL);
+
+    ix->fp = fopen(fname, "w");
+    if (ix->fp == NULL)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "can't open index file: %s",
+            strerror(errno));
+        return (-1);
+    }
+    setvbuf(ix->fp, NULL, _IOFBF, NFEX_INDEX_BUF);
+
+    if (format == INDEX_BINARY)
+    {
+        memset(&hdr, 0, sizeof (hdr));
+        memcpy(hdr.magic, "NFXI", 4);
+        hdr.version = NFEX_INDEX_VERSION;
+        hdr.reclen  = sizeof (index_rec_t);
+        hdr.order   = 0x01020304;
+        hdr.pid     = ix->pid;
+        strncpy(hdr.source, source, sizeof (hdr.source) - 1);
+        fwrite(&hdr, sizeof (hdr), 1, ix->fp);
+        fflush(ix->fp);
+    }
+
+    ix->maxpend = NFEX_INDEX_BATCH;
+    ix->pend    = malloc(ix->maxpend * sizeof (index_rec_t));
+    ix->rings   = calloc(nworkers, sizeof (ring_t));
+    ix->clocks  = calloc(nworkers, sizeof (index_clock_t));
+    if (ix->pend == NULL || ix->rings == NULL || ix->clocks == NULL)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "malloc(): %s", strerror(errno));
+        return (-1);
+    }
+    for (i = 0; i < nworkers; i++, ix->nrings++)
+    {
+        ix->clocks[i].moved = ix->last;
+        if (ring_init(&ix->rings[i], NFEX_INDEX_RING) == -1)
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "malloc(): %s",
+                strerror(errno));
+            return (-1);
+        }
+    }
+
+    n = pthread_create(&ix->thread, NULL, index_thread, ix);
+    if (n)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "pthread_create(): %s",
+            strerror(n));
+        return (-1);
+    }
+    ix->running = 1;
+    return (1);
+}
+
+/** queue a record from worker id, no formatting and no locks */
+void
+index_add(index_t *ix, int id, index_rec_t *rec)
+{
+    ring_t *r;
+
+    r = &ix->rings[id];
+    memcpy(ring_reserve(r, sizeof (index_rec_t)), rec, sizeof (index_rec_t));
+    ring_commit(r);
+}
+
+/*
+ * Worker id is done with everything up to capture time ts: all it's
+ * extracted so far is queued and whatever it queues next is no older.
+ */
+void
+index_clock(index_t *ix, int id, struct timeval *ts)
+{
+    __atomic_store_n(&ix->clocks[id].now,
+        (int64_t)ts->tv_sec * 1000000 + ts->tv_usec, __ATOMIC_RELEASE);
+}
+
+/** write out whatever's queued and close the file, safe to call twice */
+void
+index_shutdown(index_t *ix)
+{
+    int i;
+
+    if (ix->running)
+    {
+        for (i = 0; i < ix->nrings; i++)
+        {
+            __atomic_store_n(&ix->rings[i].done, 1, __ATOMIC_RELEASE);
+        }
+        pthread_join(ix->thread, NULL);
+        ix->running = 0;
+    }
+    for (i = 0; i < ix->nrings; i++)
+    {
+        ring_free(&ix->rings[i]);
+    }
+    free(ix->rings);
+    free(ix->clocks);
+    free(ix->pend);
+    ix->rings  = NULL;
+    ix->clocks = NULL;
+    ix->pend   = NULL;
+    ix->nrings = 0;
+    if (ix->fp)
+    {
+        fclose(ix->fp);
+        ix->fp = NULL;
+    }
+}
+
+/*
+ * The index thread, gathers records from every worker and writes out the
+ * ones no worker can still come up with anything older than.
+ */
+static void *
+index_thread(void *arg)
+{
+    index_t *ix;
+    index_clock_t *c;
+    index_rec_t *rec, *pend;
+    uint64_t pos, next;
+    uint32_t len, got, n, k;
+    int64_t mark, t;
+    time_t now;
+    int i, done;
+
+    ix = (index_t *)arg;
+    for (;;)
+    {
+        /** the producers are done once they say so, look before draining */
+        for (i = 0, done = 1; i < ix->nrings; i++)
+        {
+            done &= __atomic_load_n(&ix->rings[i].done, __ATOMIC_ACQUIRE);
+        }
+
+        now  = time(NULL);
+        mark = INT64_MAX;
+        for (i = 0, got = 0; i < ix->nrings; i++)
+        {
+            /** its clock first: anything queued after this is no older */
+            c = &ix->clocks[i];
+            t = __atomic_load_n(&c->now, __ATOMIC_ACQUIRE);
+            if (t != c->seen)
+            {
+                c->seen  = t;
+                c->moved = now;
+            }
+
+            for (n = 0, pos = next = ix->rings[i].tail; ; pos = next, n++)
+            {
+                if (ix->npend == ix->maxpend)
+                {
+                    pend = realloc(ix->pend,
+                            ix->maxpend * 2 * sizeof (index_rec_t));
+                    if (pend == NULL)
+                    {
+                        /** out of order beats out of memory */
+                        qsort(ix->pend, ix->npend, sizeof (index_rec_t),
+                            index_cmp);
+                        index_flush(ix, ix->npend);
+                    }
+                    else
+                    {
+                        ix->pend     = pend;
+                        ix->maxpend *= 2;
+                    }
+                }
+                rec = ring_peek(&ix->rings[i], &next, &len);
+                if (rec == NULL)
+                {
+                    break;
+                }
+                ix->pend[ix->npend++] = *rec;
+            }
+            ring_release(&ix->rings[i], pos);
+            got += n;
+
+            /** idle workers have nothing coming and don't hold anyone up */
+            if (n || now - c->moved < NFEX_INDEX_SECS)
+            {
+                mark = t < mark ? t : mark;
+            }
+        }
+
+        if (got)
+        {
+            qsort(ix->pend, ix->npend, sizeof (index_rec_t), index_cmp);
+        }
+        for (k = 0; k < ix->npend && (done ||
+             ix->pend[k].ts_sec * 1000000 + ix->pend[k].ts_usec <= mark); k++);
+        if (k && (done || k >= NFEX_INDEX_BATCH ||
+            now - ix->last >= NFEX_INDEX_SECS))
+        {
+            index_flush(ix, k);
+        }
+        if (done && got == 0)
+        {
+            break;
+        }
+        if (got == 0)
+        {
+            usleep(NFEX_INDEX_IDLE_USEC);
+        }
+    }
+    return (NULL);
+}
+
+/** write out the first n gathered up, the rest wait for the next time */
+static void
+index_flush(index_t *ix, uint32_t n)
+{
+    index_rec_t *rec;
+    struct tm time_machine;
+    char timestamp[50], src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    char fname[128], md5[DIGEST_MD5_LEN * 2 + 1];
+    char sha1[DIGEST_SHA1_LEN * 2 + 1];
+    char sha256[DIGEST_SHA256_LEN * 2 + 1];
+    const char *stored;
+    int64_t ts_last;
+    uint32_t i;
+    time_t t;
+    int af;
+
+    if (ix->format == INDEX_BINARY)
+    {
+        fwrite(ix->pend, sizeof (index_rec_t), n, ix->fp);
+    }
+    else
+    {
+        for (i = 0, ts_last = -1; i < n; i++)
+        {
+            rec = &ix->pend[i];
+
+            /** most files come in bunches, don't work the time out again */
+            if (rec->start_sec != ts_last)
+            {
+                t = rec->start_sec;
+                gmtime_r(&t, &time_machine);
+                strftime(timestamp, sizeof (timestamp), "%Y-%m-%dT%H:%M:%S",
+                    &time_machine);
+                ts_last = rec->start_sec;
+            }
+            af = rec->family == 6 ? AF_INET6 : AF_INET;
+            inet_ntop(af, rec->src, src, sizeof (src));
+            inet_ntop(af, rec->dst, dst, sizeof (dst));
+            index_hex(md5, rec->md5, rec->digests & DIGEST_MD5 ?
+                DIGEST_MD5_LEN : 0);
+            index_hex(sha1, rec->sha1, rec->digests & DIGEST_SHA1 ?
+                DIGEST_SHA1_LEN : 0);
+            index_hex(sha256, rec->sha256, rec->digests & DIGEST_SHA256 ?
+                DIGEST_SHA256_LEN : 0);
+            if (rec->store)
+            {
+                snprintf(fname, sizeof (fname), "%s.%s", sha256, rec->ext);
+                stored = rec->store == INDEX_STORE_DUP ? "dup" : "new";
+            }
+            else
+            {
+                snprintf(fname, sizeof (fname), "%d-%06u.%s", (int)ix->pid,
+                    rec->filenum, rec->ext);
+                stored = "-";
+            }
+
+            if (ix->format == INDEX_JSON)
+            {
+                fprintf(ix->fp, "{\"source\":");
+                index_json_string(ix->fp, ix->source);
+                fprintf(ix->fp, ",\"time\":\"%s.%06uZ\",\"src\":\"%s\","
+                    "\"sport\":%u,\"dst\":\"%s\",\"dport\":%u,\"file\":",
+                    timestamp, rec->start_usec, src, rec->sport, dst,
+                    rec->dport);
+                index_json_string(ix->fp, fname);
+                fprintf(ix->fp, ",\"size\":%llu",
+                    (unsigned long long)rec->size);
+                if (rec->digests & DIGEST_MD5)
+                {
+                    fprintf(ix->fp, ",\"md5\":\"%s\"", md5);
+                }
+                if (rec->digests & DIGEST_SHA1)
+                {
+                    fprintf(ix->fp, ",\"sha1\":\"%s\"", sha1);
+                }
+                if (rec->digests & DIGEST_SHA256)
+                {
+                    fprintf(ix->fp, ",\"sha256\":\"%s\"", sha256);
+                }
+                if (rec->store)
+                {
+                    fprintf(ix->fp, ",\"stored\":\"%s\"", stored);
+                }
+                fprintf(ix->fp, "}\n");
+            }
+            else
+            {
+                /** address.port like tcpdump, what we didn't keep is - */
+                fprintf(ix->fp, "%s, %s.%ldZ, %s.%d, %s.%d, %s, %llu, "
+                    "%s, %s, %s, %s\n", ix->source, timestamp,
+                    (long)rec->start_usec, src, rec->sport, dst, rec->dport,
+                    fname, (unsigned long long)rec->size, md5, sha1, sha256,
+                    stored);
+            }
+        }
+    }
+    fflush(ix->fp);
+    memmove(ix->pend, ix->pend + n, (ix->npend - n) * sizeof (index_rec_t));
+    ix->records += n;
+    ix->npend   -= n;
+    ix->last     = time(NULL);
+}
+
+static int
+index_cmp(const void *a, const void *b)
+{
+    const index_rec_t *x, *y;
+
+    x = a;
+    y = b;
+    if (x->ts_sec != y->ts_sec)
+    {
+        return (x->ts_sec < y->ts_sec ? -1 : 1);
+    }
+    if (x->ts_usec != y->ts_usec)
+    {
+        return (x->ts_usec < y->ts_usec ? -1 : 1);
+    }
+    /** same instant, file numbers go in the order they were handed out */
+    return (x->filenum < y->filenum ? -1 : x->filenum > y->filenum);
+}
+
+/** len bytes as hex, or "-" for none */
+static char *
+index_hex(char *out, const uint8_t *p, int len)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    if (len == 0)
+    {
+        strcpy(out, "-");
+        return (out);
+    }
+    for (i = 0; i < len; i++)
+    {
+        out[i * 2]     = hex[p[i] >> 4];
+        out[i * 2 + 1] = hex[p[i] & 0x0f];
+    }
+    out[i * 2] = '\0';
+    return (out);
+}
+
+/** a quoted JSON string, escaped as need be */
+static void
+index_json_string(FILE *fp, const char *s)
+{
+    putc('"', fp);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            putc('\\', fp);
+            putc(*s, fp);
+        }
+        else if ((unsigned char)*s < 0x20)
+        {
+            fprintf(fp, "\\u%04x", (unsigned char)*s);
+        }
+        else
+        {
+            putc(*s, fp);
+        }
+    }
+    putc('"', fp);
+}
+
+/** EOF */
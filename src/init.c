@@ -9,19 +9,19 @@
  
 #include "nfex.h"
 
-extern FILE *yyin;
-
 ncc_t *
 control_context_init(char *output_dir, char *yyinfname, char *device, 
-char *capfname, char *geoip_data, char *bpf, u_int16_t flags, char *errbuf)
+char *capfname, char *geoip_data, char *bpf, u_int16_t flags, int sync_policy,
+int sync_interval, int nworkers, int ring_mb, int fanout, int batch, 
+int index_format, int digests, char *errbuf)
 {
-    int n;
+    int n, i;
     ncc_t *ncc;
+    const char *sha;
     struct rlimit rl;
     struct termios term;
     bpf_u_int32 net, mask;
     struct stat stat_info;
-    struct bpf_program filter_program;
 
     /** gather all the memory we need for a control context */  
     ncc = malloc(sizeof (ncc_t));
@@ -35,16 +35,19 @@ char *capfname, char *geoip_data, char *bpf, u_int16_t flags, char *errbuf)
     memset(ncc, 0, sizeof (ncc_t));
     ncc->flags    = flags;
     ncc->device   = device;
+    ncc->nworkers = nworkers;
+    ncc->ring_mb  = ring_mb;
+    ncc->fanout   = fanout;
+    ncc->batch    = batch;
+    ncc->digests  = digests;
+    sha = digest_setup();
+    ncc->ebpf.map_fd  = -1;
+    ncc->ebpf.prog_fd = -1;
+    ncc->pcap_fd  = -1;
+    frag_init(&ncc->frag, NFEX_FRAG_MAX / (nworkers + 1));
     strcpy(ncc->capfname, capfname);
     strcpy(ncc->output_dir, output_dir);
 
-    /** initialize hash table */
-    for (n = 0; n < NFEX_HT_SIZE; n++)
-    {
-        /** not needed!@ */
-        ncc->ht[n] = NULL;
-    }
-
     /** setup the output directory prefix stuff */
     if (ncc->output_dir[0])
     {
@@ -67,19 +70,20 @@ char *capfname, char *geoip_data, char *bpf, u_int16_t flags, char *errbuf)
         strcpy(ncc->yyinfname, yyinfname);
     }
 
-    yyin = fopen(ncc->yyinfname, "r");
-    if (yyin == NULL)
+    /** parse and compile it, or map the cached machine if it's unchanged */
+    snprintf(ncc->mcachefname, sizeof (ncc->mcachefname), "%s%s", 
+        ncc->yyinfname, NFEX_MCACHE_SUFFIX);
+    ncc->sc = config_load(ncc, 0);
+    if (ncc->sc == NULL)
     {
-        fprintf(stderr, "can't open config file %s: %s\n", ncc->yyinfname,
-            strerror(errno));
         goto err;
     }
-    printf("loading configuration file...\n");
-    yyparse((void *)ncc);
 
     /** if a pcap file was specified, we go that route */
     if (ncc->capfname[0])
     {
+        /** capture rings only make sense for live capture */
+        ncc->flags &= ~(NFEX_TPACKET | NFEX_EBPF);
         ncc->p = pcap_open_offline(capfname, errbuf);
         if (ncc->p == NULL)
         {
@@ -130,31 +134,111 @@ char *capfname, char *geoip_data, char *bpf, u_int16_t flags, char *errbuf)
             mask = 0;
         }
     
-        /** open the session in promiscuous mode */
-        ncc->p = pcap_open_live(ncc->device, BUFSIZ, 1, 0, errbuf);
-        if (ncc->p == NULL)
+        if (ncc->flags & NFEX_TPACKET)
         {
-            fprintf(stderr, "can't open device %s: %s\n", ncc->device, errbuf);
-            goto err;
+            /** 
+             * the workers open their own rings, pcap is only needed to 
+             * compile the filter that gets attached to them
+             */
+            if (ncc->ring_mb == 0)
+            {
+                ncc->ring_mb = NFEX_TP_RING_MB;
+            }
+            if (ncc->nworkers > 1 && ncc->fanout == -1)
+            {
+                ncc->fanout = getpid() & 0xffff;
+            }
+            /** the ring gets whatever header the device has, if any */
+            n = tpacket_datalink(ncc->device, errbuf);
+            if (n == -1)
+            {
+                fprintf(stderr, "%s\n", errbuf);
+                goto err;
+            }
+            ncc->p = pcap_open_dead(n, NFEX_TP_SNAPLEN);
+            if (ncc->p == NULL)
+            {
+                fprintf(stderr, "can't open pcap handle for filter\n");
+                goto err;
+            }
+        }
+        else
+        {
+            /** open the session in promiscuous mode */
+            ncc->p = pcap_create(ncc->device, errbuf);
+            if (ncc->p == NULL)
+            {
+                fprintf(stderr, "can't open device %s: %s\n", ncc->device,
+                    errbuf);
+                goto err;
+            }
+            pcap_set_snaplen(ncc->p, NFEX_SNAPLEN);
+            pcap_set_promisc(ncc->p, 1);
+            pcap_set_timeout(ncc->p, 0);
+            if (ncc->ring_mb)
+            {
+                pcap_set_buffer_size(ncc->p, ncc->ring_mb << 20);
+            }
+            if (pcap_activate(ncc->p) < 0)
+            {
+                fprintf(stderr, "can't open device %s: %s\n", ncc->device,
+                    pcap_geterr(ncc->p));
+                goto err;
+            }
+            ncc->pcap_fd = pcap_fileno(ncc->p);
         }
-        ncc->pcap_fd = pcap_fileno(ncc->p);
+    }
+
+    /** everything after this is link layer agnostic */
+    ncc->link = link_select(pcap_datalink(ncc->p));
+    if (ncc->link == NULL)
+    {
+        fprintf(stderr, "unsupported datalink %d\n", pcap_datalink(ncc->p));
+        goto err;
+    }
+    if ((ncc->flags & NFEX_EBPF) && ncc->link->dlt != DLT_EN10MB)
+    {
+        fprintf(stderr, "kernel bypass filter only works on Ethernet\n");
+        goto err;
+    }
+
+    if (bpf[0] == 0)
+    {
+        bpf = ncc->link->filter;
     }
 
     /** compile and apply the filter */
-    if (pcap_compile(ncc->p, &filter_program, bpf, 0, net) == -1)
+    if (pcap_compile(ncc->p, &(ncc->filter), bpf, 0, net) == -1)
     {
         fprintf(stderr, "can't parse filter %s: %s\n", bpf,
             pcap_geterr(ncc->p));
         goto err;
     }
 
-    if (pcap_setfilter(ncc->p, &filter_program) == -1)
+    if ((ncc->flags & NFEX_TPACKET) == 0 && 
+        pcap_setfilter(ncc->p, &(ncc->filter)) == -1)
     {
         fprintf(stderr, "can't install filter %s: %s\n", bpf,
             pcap_geterr(ncc->p));
        goto err;
     }
 
+    /** the kernel filter replaces the pcap one, which we then run ourselves */
+    if (ncc->flags & NFEX_EBPF)
+    {
+        if (ebpf_init(&ncc->ebpf, errbuf) == -1)
+        {
+            fprintf(stderr, "can't load kernel bypass filter: %s\n", errbuf);
+            goto err;
+        }
+        if ((ncc->flags & NFEX_TPACKET) == 0 &&
+            ebpf_attach(&ncc->ebpf, ncc->pcap_fd, errbuf) == -1)
+        {
+            fprintf(stderr, "can't attach kernel bypass filter: %s\n", errbuf);
+            goto err;
+        }
+    }
+
    /**
      * We want to change the behavior of stdin to not echo characters
      * typed and more importantly we want each character to be handed
@@ -189,6 +273,9 @@ char *capfname, char *geoip_data, char *bpf, u_int16_t flags, char *errbuf)
         }
     }
 
+    /** kill -HUP picks up an edited config file without a restart */
+    signal(SIGHUP, config_reload_signal);
+
     /** set start time */
     if (gettimeofday(&(ncc->stats.ts_start), NULL) == -1)
     {
@@ -199,16 +286,53 @@ char *capfname, char *geoip_data, char *bpf, u_int16_t flags, char *errbuf)
         /** nonfatal */
     }
 
-    /** open the index file */
-    snprintf(ncc->indexfname, FILENAME_BUFFER_SIZE, "%s%d-index.txt",
-        ncc->output_dir == NULL ? "" : ncc->output_dir, getpid());
+    /** open the index file, it's written from a thread of its own */
+    snprintf(ncc->indexfname, sizeof (ncc->indexfname), "%s%d-index.%s",
+        ncc->output_dir == NULL ? "" : ncc->output_dir, getpid(),
+        index_format == INDEX_JSON ? "json" :
+        index_format == INDEX_BINARY ? "bin" : "txt");
+    if (index_init(&ncc->index, index_format, ncc->indexfname,
+        ncc->device ? "live-capture" : ncc->capfname, ncc->nworkers,
+        errbuf) == -1)
+    {
+        fprintf(stderr, "%s\n", errbuf);
+        goto err;
+    }
 
-    ncc->indexfp = fopen(ncc->indexfname, "w");
-    if (ncc->indexfp == NULL)
+    /** the store names files by their SHA-256, see what it has already */
+    if (ncc->flags & NFEX_STORE)
     {
-        fprintf(stderr, "can't open index file: %s\n", strerror(errno));
+        ncc->digests |= DIGEST_SHA256;
+        if (store_init(&ncc->store, ncc->output_dir, errbuf) == -1)
+        {
+            fprintf(stderr, "%s\n", errbuf);
+            goto err;
+        }
+    }
+
+    /** sessions are sharded across the workers by flow */
+    if (workers_init(ncc, sync_policy, sync_interval, errbuf) == -1)
+    {
+        fprintf(stderr, "can't start workers: %s\n", errbuf);
         goto err;
     }
+    if ((ncc->flags & NFEX_TPACKET) && ncc->nworkers == 1)
+    {
+        /** the one and only ring is ours to select on */
+        ncc->pcap_fd = ncc->workers[0].tp.fd;
+    }
+    if ((ncc->flags & NFEX_TPACKET) && (ncc->flags & NFEX_EBPF))
+    {
+        for (i = 0; i < ncc->nworkers; i++)
+        {
+            if (ebpf_attach(&ncc->ebpf, ncc->workers[i].tp.fd, errbuf) == -1)
+            {
+                fprintf(stderr, "can't attach kernel bypass filter: %s\n",
+                    errbuf);
+                goto err;
+            }
+        }
+    }
 
 #if (HAVE_GEOIP)
     /** power up the MaxMind Geo IP targeting stuff */
@@ -239,8 +363,51 @@ char *capfname, char *geoip_data, char *bpf, u_int16_t flags, char *errbuf)
         printf("pcap file:\t%s\n", ncc->capfname);
         printf("pcap filesize:\t%zu bytes\n", ncc->capfsize); 
     }
+    if (ncc->flags & NFEX_TPACKET)
+    {
+        printf("capture:\tTPACKET_V3, %d x %dMB ring", ncc->nworkers, 
+            ncc->ring_mb);
+        if (ncc->fanout != -1)
+        {
+            printf(", fanout group %d", ncc->fanout);
+        }
+        printf("\n");
+    }
+    printf("datalink:\t%s\n", ncc->link->name);
     printf("pcap filter:\t%s\n", bpf);
-    printf("index file:\t%s\n", ncc->indexfname);
+    if (ncc->flags & NFEX_EBPF)
+    {
+        printf("kernel bypass:\ton, %d flows\n", NFEX_EBPF_MAP_SIZE);
+    }
+    printf("index file:\t%s (%s)\n", ncc->indexfname,
+        index_format == INDEX_JSON ? "JSON lines" :
+        index_format == INDEX_BINARY ? "binary" : "CSV");
+    printf("digests:\t%s%s%s%s(%s)\n",
+        ncc->digests & DIGEST_MD5 ? "md5 " : "",
+        ncc->digests & DIGEST_SHA1 ? "sha1 " : "",
+        ncc->digests & DIGEST_SHA256 ? "sha256 " : "",
+        ncc->digests ? "" : "none ", sha);
+    if (ncc->flags & NFEX_STORE)
+    {
+        printf("file store:\t%s, %u files\n",
+            ncc->output_dir[0] ? ncc->output_dir : ".", ncc->store.count);
+    }
+    printf("workers:\t%d\n", ncc->nworkers);
+    printf("batch:\t\t%d packets\n", ncc->batch);
+    printf("file output:\t%s\n", ncc->workers[0].writer.uring ?
+        "io_uring" : "writer threads");
+    switch (sync_policy)
+    {
+        case WQ_SYNC_NONE:
+            printf("file sync:\tnone\n");
+            break;
+        case WQ_SYNC_CLOSE:
+            printf("file sync:\ton close\n");
+            break;
+        case WQ_SYNC_PERIODIC:
+            printf("file sync:\tevery %ds\n", ncc->workers[0].writer.sync_interval);
+            break;
+    }
 #if (HAVE_GEOIP)
     printf("geoIP database:\t%s\n", ncc->geoip_data);
 #endif
@@ -292,7 +459,18 @@ control_context_destroy(ncc_t *ncc)
         GeoIP_delete(ncc->gi);
     }
 #endif /** HAVE_GEOIP */
-    ht_shutitdown(ncc);
+    /** close out sessions, then let the writers finish up */
+    workers_destroy(ncc);
+    config_destroy(ncc);
+    ebpf_close(&ncc->ebpf);
+    frag_destroy(&ncc->frag);
+    if (ncc->filter.bf_insns)
+    {
+        pcap_freecode(&(ncc->filter));
+    }
+    /** after the workers, closing out sessions can still index files */
+    index_shutdown(&ncc->index);
+    store_destroy(&ncc->store);
 
     /** log_close(ncc); */
 
@@ -0,0 +1,196 @@
+/*
+ * link.c - link layer decoders
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include "nfex.h"
+#include <libnet.h>
+
+#define LINK_ETHERTYPE_VLAN      0x8100
+#define LINK_ETHERTYPE_QINQ      0x88a8
+#define LINK_ETHERTYPE_QINQ_OLD  0x9100
+#define LINK_ETHERTYPE_MPLS      0x8847
+#define LINK_ETHERTYPE_MPLS_MC   0x8848
+
+static int link_ether(const uint8_t *, uint32_t, uint16_t *);
+static int link_sll(const uint8_t *, uint32_t, uint16_t *);
+static int link_sll2(const uint8_t *, uint32_t, uint16_t *);
+static int link_null(const uint8_t *, uint32_t, uint16_t *);
+static int link_raw(const uint8_t *, uint32_t, uint16_t *);
+
+/** every datalink we take, picked once when the capture is opened */
+static link_t links[] =
+{
+    { DLT_EN10MB,     "Ethernet",         NFEX_PCAP_FILTER_VLAN, link_ether },
+    { DLT_LINUX_SLL,  "Linux cooked",     NFEX_PCAP_FILTER,      link_sll   },
+    { DLT_LINUX_SLL2, "Linux cooked v2",  NFEX_PCAP_FILTER,      link_sll2  },
+    { DLT_RAW,        "raw IP",           NFEX_PCAP_FILTER,      link_raw   },
+    { DLT_IPV4,       "raw IPv4",         NFEX_PCAP_FILTER,      link_raw   },
+    { DLT_IPV6,       "raw IPv6",         NFEX_PCAP_FILTER,      link_raw   },
+    { DLT_NULL,       "BSD loopback",     NFEX_PCAP_FILTER,      link_null  },
+    { DLT_LOOP,       "OpenBSD loopback", NFEX_PCAP_FILTER,      link_null  },
+    { -1,             NULL,               NULL,                  NULL       }
+};
+
+link_t *
+link_select(int dlt)
+{
+    link_t *l;
+
+    for (l = links; l->decode; l++)
+    {
+        if (l->dlt == dlt)
+        {
+            return (l);
+        }
+    }
+    return (NULL);
+}
+
+/** no type to go on, the IP version says which it is */
+static inline int
+link_ip_version(const uint8_t *pkt, uint32_t len, uint32_t off,
+uint16_t *proto)
+{
+    if (off >= len)
+    {
+        return (NFEX_LINK_ERR);
+    }
+    switch (pkt[off] >> 4)
+    {
+        case 4:
+            *proto = ETHERTYPE_IP;
+            break;
+        case 6:
+            *proto = ETHERTYPE_IPV6;
+            break;
+        default:
+            *proto = 0;
+            break;
+    }
+    return (off);
+}
+
+/** down an MPLS label stack to whatever is under the bottom label */
+static int
+link_mpls(const uint8_t *pkt, uint32_t len, uint32_t off, uint16_t *proto)
+{
+    int n;
+
+    for (n = 0; n < NFEX_LINK_TAGS_MAX; n++)
+    {
+        if (off + 4 > len)
+        {
+            return (NFEX_LINK_ERR);
+        }
+        off += 4;
+        if (pkt[off - 2] & 0x01)
+        {
+            /** bottom of stack, no control word or pseudowires here */
+            return (link_ip_version(pkt, len, off, proto));
+        }
+    }
+    *proto = 0;
+    return (off);
+}
+
+/*
+ * Past any VLAN tags (802.1Q, QinQ, the old 0x9100) to IP or an MPLS
+ * stack.  type is the ethertype that was at off - 2.
+ */
+static int
+link_tags(const uint8_t *pkt, uint32_t len, uint32_t off, uint16_t type,
+uint16_t *proto)
+{
+    int n;
+
+    for (n = 0; n < NFEX_LINK_TAGS_MAX; n++)
+    {
+        switch (type)
+        {
+            case ETHERTYPE_IP:
+            case ETHERTYPE_IPV6:
+                *proto = type;
+                return (off);
+            case LINK_ETHERTYPE_VLAN:
+            case LINK_ETHERTYPE_QINQ:
+            case LINK_ETHERTYPE_QINQ_OLD:
+                if (off + 4 > len)
+                {
+                    return (NFEX_LINK_ERR);
+                }
+                type = ntohs(*(uint16_t *)(pkt + off + 2));
+                off += 4;
+                break;
+            case LINK_ETHERTYPE_MPLS:
+            case LINK_ETHERTYPE_MPLS_MC:
+                return (link_mpls(pkt, len, off, proto));
+            default:
+                *proto = 0;
+                return (off);
+        }
+    }
+    *proto = 0;
+    return (off);
+}
+
+static int
+link_ether(const uint8_t *pkt, uint32_t len, uint16_t *proto)
+{
+    uint16_t type;
+
+    if (len < LIBNET_ETH_H)
+    {
+        return (NFEX_LINK_ERR);
+    }
+    type = ntohs(*(uint16_t *)(pkt + 12));
+
+    /** untagged IP is nearly everything, don't go looking for tags */
+    if (type == ETHERTYPE_IP || type == ETHERTYPE_IPV6)
+    {
+        *proto = type;
+        return (LIBNET_ETH_H);
+    }
+    return (link_tags(pkt, len, LIBNET_ETH_H, type, proto));
+}
+
+/** 16 byte cooked header, protocol last */
+static int
+link_sll(const uint8_t *pkt, uint32_t len, uint16_t *proto)
+{
+    if (len < 16)
+    {
+        return (NFEX_LINK_ERR);
+    }
+    return (link_tags(pkt, len, 16, ntohs(*(uint16_t *)(pkt + 14)), proto));
+}
+
+/** 20 byte cooked header, protocol first */
+static int
+link_sll2(const uint8_t *pkt, uint32_t len, uint16_t *proto)
+{
+    if (len < 20)
+    {
+        return (NFEX_LINK_ERR);
+    }
+    return (link_tags(pkt, len, 20, ntohs(*(uint16_t *)pkt), proto));
+}
+
+/** 4 byte address family, in whatever order the writer used */
+static int
+link_null(const uint8_t *pkt, uint32_t len, uint16_t *proto)
+{
+    return (link_ip_version(pkt, len, 4, proto));
+}
+
+static int
+link_raw(const uint8_t *pkt, uint32_t len, uint16_t *proto)
+{
+    return (link_ip_version(pkt, len, 0, proto));
+}
+
+/** EOF */
@@ -20,6 +20,8 @@ main(int argc, char *argv[])
     ncc_t *ncc;
     char *device, *p;
     u_int16_t flags;
+    int sync_policy, sync_interval, nworkers, ring_mb, fanout, batch;
+    int index_format, digests;
     char capfname[128];
     char yyinfname[128];
 #if (HAVE_GEOIP)
@@ -36,6 +38,14 @@ main(int argc, char *argv[])
 
     flags = 0;
     device = NULL;
+    sync_policy   = WQ_SYNC_CLOSE;
+    sync_interval = NFEX_WQ_SYNC_SECS;
+    nworkers      = 1;
+    ring_mb       = 0;
+    fanout        = -1;
+    batch         = NFEX_BATCH;
+    index_format  = INDEX_CSV;
+    digests       = DIGEST_ALL;
     memset(bpf,        0, sizeof (bpf));
     memset(capfname,   0, sizeof (capfname));
     memset(yyinfname,  0, sizeof (yyinfname));
@@ -43,13 +53,39 @@ main(int argc, char *argv[])
 #if (HAVE_GEOIP)
     memset(geoip_data, 0, sizeof (geoip_data));
 #endif /** HAVE_GEOIP */
-    while ((c = getopt(argc, argv, "c:Dd:G:gf:o:hVv")) != EOF)
+    while ((c = getopt(argc, argv, "B:b:c:CDEF:d:G:gf:H:I:o:S:TUhVvw:")) != EOF)
     {
         switch (c)
         {
+            case 'B':
+                batch = atoi(optarg);
+                if (batch < 1 || batch > NFEX_BATCH_MAX)
+                {
+                    fprintf(stderr, "batch must be between 1 and %d\n",
+                        NFEX_BATCH_MAX);
+                    return (EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                ring_mb = atoi(optarg);
+                if (ring_mb < 1)
+                {
+                    usage(argv[0]);
+                }
+                break;
             case 'f':
                 strncpy(capfname, optarg, 127);
                 break;
+            case 'F':
+                fanout = atoi(optarg);
+                if (fanout < 0 || fanout > 0xffff)
+                {
+                    fprintf(stderr, "fanout group must be between 0 and %d\n",
+                        0xffff);
+                    return (EXIT_FAILURE);
+                }
+                flags |= NFEX_TPACKET;
+                break;
             case 'D':
                 flags |= NFEX_DEBUG;
                 break;
@@ -79,12 +115,91 @@ main(int argc, char *argv[])
                     strncpy(output_dir, optarg, 127); 
                 }
                 break;
+            case 'S':
+                if (strcmp(optarg, "none") == 0)
+                {
+                    sync_policy = WQ_SYNC_NONE;
+                }
+                else if (strcmp(optarg, "close") == 0)
+                {
+                    sync_policy = WQ_SYNC_CLOSE;
+                }
+                else if ((sync_interval = atoi(optarg)) > 0)
+                {
+                    sync_policy = WQ_SYNC_PERIODIC;
+                }
+                else
+                {
+                    usage(argv[0]);
+                }
+                break;
+            case 'I':
+                if (strcmp(optarg, "csv") == 0)
+                {
+                    index_format = INDEX_CSV;
+                }
+                else if (strcmp(optarg, "json") == 0)
+                {
+                    index_format = INDEX_JSON;
+                }
+                else if (strcmp(optarg, "binary") == 0)
+                {
+                    index_format = INDEX_BINARY;
+                }
+                else
+                {
+                    usage(argv[0]);
+                }
+                break;
+            case 'H':
+                digests = 0;
+                for (p = strtok(optarg, ","); p; p = strtok(NULL, ","))
+                {
+                    if (strcmp(p, "md5") == 0)
+                    {
+                        digests |= DIGEST_MD5;
+                    }
+                    else if (strcmp(p, "sha1") == 0)
+                    {
+                        digests |= DIGEST_SHA1;
+                    }
+                    else if (strcmp(p, "sha256") == 0)
+                    {
+                        digests |= DIGEST_SHA256;
+                    }
+                    else if (strcmp(p, "none") != 0)
+                    {
+                        usage(argv[0]);
+                    }
+                }
+                break;
+            case 'C':
+                flags |= NFEX_STORE;
+                break;
+            case 'T':
+                flags |= NFEX_TPACKET;
+                break;
+            case 'E':
+                flags |= NFEX_EBPF;
+                break;
+            case 'U':
+                flags |= NFEX_NO_URING;
+                break;
             case 'h':
                 usage(argv[0]);
                 break;
             case 'v':
                 flags |= NFEX_VERBOSE;
                 break;
+            case 'w':
+                nworkers = atoi(optarg);
+                if (nworkers < 1 || nworkers > NFEX_MAX_WORKERS)
+                {
+                    fprintf(stderr, "workers must be between 1 and %d\n",
+                        NFEX_MAX_WORKERS);
+                    return (EXIT_FAILURE);
+                }
+                break;
             case 'V':
                 printf("%s v%s\n", PACKAGE, VERSION);
                 return (EXIT_SUCCESS);
@@ -102,10 +217,12 @@ main(int argc, char *argv[])
     printf("nfex - realtime network file extraction engine\n");
 #if (HAVE_GEOIP)
     ncc = control_context_init(output_dir, yyinfname, device, capfname, 
-            geoip_data, bpf, flags, errbuf);
+            geoip_data, bpf, flags, sync_policy, sync_interval, nworkers, 
+            ring_mb, fanout, batch, index_format, digests, errbuf);
 #else
     ncc = control_context_init(output_dir, yyinfname, device, capfname, 
-            NULL, bpf, flags, errbuf);
+            NULL, bpf, flags, sync_policy, sync_interval, nworkers, ring_mb, 
+            fanout, batch, index_format, digests, errbuf);
 #endif /** HAVE_GEOIP */
 
     if (ncc == NULL)
@@ -118,6 +235,8 @@ main(int argc, char *argv[])
 
     the_game(ncc);
 
+    /** let the workers finish what's queued so the numbers add up */
+    workers_stop(ncc);
     stats(ncc, NFEX_STATS_CLOSEOUT);
     control_context_destroy(ncc);
     printf("program completed, normal exit\n");
@@ -137,10 +256,24 @@ usage(char *progname)
            "  -g              toggle geoIP mode on\n"
 #endif /** HAVE_GEOIP */
            "  -o <DIRECTORY>  dump files here instead of cwd\n"
+           "  -I <format>     index file format: csv (default), json or binary\n"
+           "  -C              name files by their SHA-256, keep one copy of each\n"
+           "  -H <list>       digests to index: md5,sha1,sha256 (default) or\n"
+           "                  none\n"
+           "  -S <policy>     sync extracted files: none, close (default) or\n"
+           "                  every <n> seconds\n"
+           "  -w <n>          spread sessions across n worker threads\n"
+           "  -B <n>          packets per processing batch (1-%d)\n"
+           "  -T              capture from TPACKET_V3 rings (Linux)\n"
+           "  -b <MB>         capture buffer size, per ring with -T\n"
+           "  -F <group>      join PACKET_FANOUT group (implies -T)\n"
+           "  -E              drop bypassed flows in the kernel (Linux eBPF)\n"
+           "  -U              write files with a writer thread, not io_uring\n"
            "  -V              display the version number\n"
            "  -v              toggle verbose mode on\n"
            "  -h              this\n"
-           "  expression is a bpf filter ala tcpdump / pcap\n", progname);
+           "  expression is a bpf filter ala tcpdump / pcap\n", progname,
+           NFEX_BATCH_MAX);
     exit(1);    
 }
 
@@ -0,0 +1,331 @@
+/*
+ * mcache.c - compiled search machine cache
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include "nfex.h"
+#include "mcache.h"
+#include "util.h"
+#include <sys/mman.h>
+
+#define MCACHE_ROUND(n) \
+    (((n) + NFEX_MCACHE_ALIGN - 1) & ~((uint64_t)NFEX_MCACHE_ALIGN - 1))
+
+static int mcache_write(int, uint64_t *, void *, size_t);
+static int mcache_check(mcache_hdr_t *, uint8_t *);
+
+/** FNV-1a over the config file, which is left rewound for the parser */
+uint64_t
+mcache_key(FILE *fp)
+{
+    uint64_t h;
+    uint8_t buf[4096];
+    size_t n, i;
+
+    h = 14695981039346656037ULL;
+    while ((n = fread(buf, 1, sizeof (buf), fp)) > 0)
+    {
+        for (i = 0; i < n; i++)
+        {
+            h = (h ^ buf[i]) * 1099511628211ULL;
+        }
+    }
+    rewind(fp);
+    return (h);
+}
+
+/*
+ * Map a cached machine if there's one for this config.  Anything that
+ * doesn't look exactly right gets a NULL and the machine is built the
+ * slow way (and the cache rewritten).
+ */
+srch_machine_t *
+mcache_load(char *fname, uint64_t key, u_long *stream_depth,
+u_long *bypass_depth)
+{
+    int fd;
+    struct stat st;
+    mcache_hdr_t *h;
+    srch_machine_t *sm;
+    uint8_t *map;
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1)
+    {
+        return (NULL);
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof (mcache_hdr_t))
+    {
+        close(fd);
+        return (NULL);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return (NULL);
+    }
+
+    h = (mcache_hdr_t *)map;
+    if (memcmp(h->magic, NFEX_MCACHE_MAGIC, sizeof (h->magic)) ||
+        h->version     != NFEX_MCACHE_VERSION ||
+        h->hdr_size    != sizeof (mcache_hdr_t) ||
+        h->sparse_size != sizeof (srch_sparse_t) ||
+        h->match_size  != sizeof (srch_match_t) ||
+        h->key         != key ||
+        h->size        != (uint64_t)st.st_size ||
+        h->nstates == 0 || h->ndense == 0 || h->ndense > h->nstates ||
+        h->nclasses == 0 || h->nclasses > 256 || h->shift > 8 ||
+        h->trans  + ((uint64_t)h->ndense << h->shift) * sizeof (uint32_t) >
+            h->size ||
+        h->sparse + (uint64_t)(h->nstates - h->ndense) *
+            sizeof (srch_sparse_t) > h->size ||
+        h->mfirst + (uint64_t)h->nstates * sizeof (uint32_t) > h->size ||
+        h->mcount + (uint64_t)h->nstates * sizeof (uint32_t) > h->size ||
+        h->match  + (uint64_t)h->nmatches * sizeof (srch_match_t) > h->size ||
+        mcache_check(h, map) == -1)
+    {
+        munmap(map, st.st_size);
+        return (NULL);
+    }
+
+    sm = ecalloc(1, sizeof (srch_machine_t));
+    sm->nstates  = h->nstates;
+    sm->nmatches = h->nmatches;
+    sm->nclasses = h->nclasses;
+    sm->shift    = h->shift;
+    sm->ndense   = h->ndense;
+    memcpy(sm->class, h->class, sizeof (sm->class));
+    memcpy(sm->lead, h->lead, sizeof (sm->lead));
+    sm->trans    = (uint32_t *)(map + h->trans);
+    sm->sparse   = (srch_sparse_t *)(map + h->sparse);
+    sm->mfirst   = (uint32_t *)(map + h->mfirst);
+    sm->mcount   = (uint32_t *)(map + h->mcount);
+    sm->match    = (srch_match_t *)(map + h->match);
+    sm->size     = sizeof (srch_machine_t) + 
+                   ((size_t)h->ndense << h->shift) * sizeof (uint32_t) +
+                   (h->nstates - h->ndense) * sizeof (srch_sparse_t) +
+                   h->nstates * 2 * sizeof (uint32_t) + 
+                   h->nmatches * sizeof (srch_match_t);
+    sm->map      = map;
+    sm->maplen   = st.st_size;
+
+    /** the prefilter is picked for this CPU, not the one that built it */
+    search_prefilter_init(sm);
+
+    *stream_depth = h->stream_depth;
+    *bypass_depth = h->bypass_depth;
+    return (sm);
+}
+
+/*
+ * The header adds up, now make sure the tables do: every transition goes
+ * to a state that's there, sparse states hold no more exceptions than
+ * they can and their bases lead back to a dense state, and every state's
+ * matches are in the match table.  One look at each entry.
+ */
+static int
+mcache_check(mcache_hdr_t *h, uint8_t *map)
+{
+    uint32_t *trans, *mfirst, *mcount, s, t, i, nsparse;
+    srch_sparse_t *sparse, *sp;
+    uint8_t *mark;
+    size_t n;
+    int ok;
+
+    trans   = (uint32_t *)(map + h->trans);
+    sparse  = (srch_sparse_t *)(map + h->sparse);
+    mfirst  = (uint32_t *)(map + h->mfirst);
+    mcount  = (uint32_t *)(map + h->mcount);
+    nsparse = h->nstates - h->ndense;
+
+    if (h->nclasses > (1U << h->shift))
+    {
+        return (-1);
+    }
+    for (i = 0; i < 256; i++)
+    {
+        if (h->class[i] >= h->nclasses)
+        {
+            return (-1);
+        }
+    }
+    for (n = 0; n < ((size_t)h->ndense << h->shift); n++)
+    {
+        if ((trans[n] & SRCH_STATE_MASK) >= h->nstates)
+        {
+            return (-1);
+        }
+    }
+    for (s = 0; s < h->nstates; s++)
+    {
+        if ((uint64_t)mfirst[s] + mcount[s] > h->nmatches)
+        {
+            return (-1);
+        }
+    }
+    for (s = 0; s < nsparse; s++)
+    {
+        sp = &sparse[s];
+        if (sp->n > SRCH_SPARSE_MAX || sp->base >= h->nstates)
+        {
+            return (-1);
+        }
+        for (i = 0; i < sp->n; i++)
+        {
+            if ((sp->next[i] & SRCH_STATE_MASK) >= h->nstates)
+            {
+                return (-1);
+            }
+        }
+    }
+
+    /*
+     * search_next() follows bases until it hits a dense state, a loop
+     * would never get there.  1 is on the chain we're following, 2 is
+     * known to get there.
+     */
+    mark = ecalloc(nsparse + 1, sizeof (uint8_t));
+    for (ok = 1, s = 0; ok && s < nsparse; s++)
+    {
+        for (t = s + h->ndense; t >= h->ndense && mark[t - h->ndense] == 0;
+             t = sparse[t - h->ndense].base)
+        {
+            mark[t - h->ndense] = 1;
+        }
+        if (t >= h->ndense && mark[t - h->ndense] == 1)
+        {
+            ok = 0;
+        }
+        for (t = s + h->ndense; t >= h->ndense && mark[t - h->ndense] == 1;
+             t = sparse[t - h->ndense].base)
+        {
+            mark[t - h->ndense] = 2;
+        }
+    }
+    free(mark);
+    return (ok ? 1 : -1);
+}
+
+/*
+ * Write the machine out for next time.  It goes to a temporary file that
+ * is renamed into place, so a reader only ever sees a whole cache.
+ */
+int
+mcache_save(srch_machine_t *sm, char *fname, uint64_t key,
+u_long stream_depth, u_long bypass_depth)
+{
+    int fd;
+    uint64_t off;
+    mcache_hdr_t h;
+    char tmp[FILENAME_BUFFER_SIZE];
+
+    memset(&h, 0, sizeof (h));
+    memcpy(h.magic, NFEX_MCACHE_MAGIC, sizeof (h.magic));
+    h.version      = NFEX_MCACHE_VERSION;
+    h.hdr_size     = sizeof (mcache_hdr_t);
+    h.sparse_size  = sizeof (srch_sparse_t);
+    h.match_size   = sizeof (srch_match_t);
+    h.nstates      = sm->nstates;
+    h.nmatches     = sm->nmatches;
+    h.nclasses     = sm->nclasses;
+    h.shift        = sm->shift;
+    h.ndense       = sm->ndense;
+    h.key          = key;
+    h.stream_depth = stream_depth;
+    h.bypass_depth = bypass_depth;
+    memcpy(h.class, sm->class, sizeof (h.class));
+    memcpy(h.lead, sm->lead, sizeof (h.lead));
+
+    /** lay the tables out */
+    off      = MCACHE_ROUND(sizeof (h));
+    h.trans  = off;
+    off      = MCACHE_ROUND(off +
+                   ((uint64_t)sm->ndense << sm->shift) * sizeof (uint32_t));
+    h.sparse = off;
+    off      = MCACHE_ROUND(off +
+                   (uint64_t)(sm->nstates - sm->ndense) *
+                   sizeof (srch_sparse_t));
+    h.mfirst = off;
+    off      = MCACHE_ROUND(off + (uint64_t)sm->nstates * sizeof (uint32_t));
+    h.mcount = off;
+    off      = MCACHE_ROUND(off + (uint64_t)sm->nstates * sizeof (uint32_t));
+    h.match  = off;
+    h.size   = off + (uint64_t)sm->nmatches * sizeof (srch_match_t);
+
+    snprintf(tmp, sizeof (tmp), "%s.%d", fname, getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        return (-1);
+    }
+    off = 0;
+    if (mcache_write(fd, &off, &h, sizeof (h)) == -1 ||
+        mcache_write(fd, &off, NULL, h.trans - off) == -1 ||
+        mcache_write(fd, &off, sm->trans,
+            ((size_t)sm->ndense << sm->shift) * sizeof (uint32_t)) == -1 ||
+        mcache_write(fd, &off, NULL, h.sparse - off) == -1 ||
+        mcache_write(fd, &off, sm->sparse,
+            (sm->nstates - sm->ndense) * sizeof (srch_sparse_t)) == -1 ||
+        mcache_write(fd, &off, NULL, h.mfirst - off) == -1 ||
+        mcache_write(fd, &off, sm->mfirst,
+            sm->nstates * sizeof (uint32_t)) == -1 ||
+        mcache_write(fd, &off, NULL, h.mcount - off) == -1 ||
+        mcache_write(fd, &off, sm->mcount,
+            sm->nstates * sizeof (uint32_t)) == -1 ||
+        mcache_write(fd, &off, NULL, h.match - off) == -1 ||
+        mcache_write(fd, &off, sm->match,
+            sm->nmatches * sizeof (srch_match_t)) == -1 ||
+        fsync(fd) == -1)
+    {
+        close(fd);
+        unlink(tmp);
+        return (-1);
+    }
+    close(fd);
+    if (rename(tmp, fname) == -1)
+    {
+        unlink(tmp);
+        return (-1);
+    }
+    return (1);
+}
+
+/** write it all or fail, a NULL buf writes zeroes for padding */
+static int
+mcache_write(int fd, uint64_t *off, void *buf, size_t len)
+{
+    ssize_t n;
+    uint8_t zero[NFEX_MCACHE_ALIGN];
+
+    if (buf == NULL)
+    {
+        memset(zero, 0, sizeof (zero));
+    }
+    while (len)
+    {
+        n = write(fd, buf ? buf : zero,
+                buf ? len : MIN(len, sizeof (zero)));
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return (-1);
+        }
+        len  -= n;
+        *off += n;
+        if (buf)
+        {
+            buf = (uint8_t *)buf + n;
+        }
+    }
+    return (1);
+}
+
+/** EOF */
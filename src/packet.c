@@ -12,75 +12,648 @@
 #include "config.h"
 #include <libnet.h>
 
+/** per stage counters, in TSC cycles where there is one, else ns */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BATCH_CYCLES() __rdtsc()
+#else
+#define BATCH_CYCLES() batch_clock()
+static uint64_t
+batch_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+#endif
+
+/** fold an IPv6 address down to a word, for keys and sharding */
+static inline uint32_t
+packet_fold6(const uint8_t *addr)
+{
+    uint32_t a[4];
+
+    memcpy(a, addr, sizeof (a));
+    return (a[0] ^ a[1] ^ a[2] ^ a[3]);
+}
+
+/*
+ * Walk an IPv6 extension header chain to TCP.  Returns the offset of the
+ * TCP header from the start of the IPv6 header, 0 for anything that isn't
+ * TCP (fragments included, unless they're atomic) and -1 if the chain is
+ * cut short by the capture.
+ */
+static int
+packet_ip6(const uint8_t *ip6, uint32_t len)
+{
+    uint32_t off, n;
+    uint8_t nxt;
+
+    if (len < LIBNET_IPV6_H)
+    {
+        return (-1);
+    }
+    nxt = ip6[6];
+    off = LIBNET_IPV6_H;
+    for (n = 0; n < NFEX_IP6_EXT_MAX; n++)
+    {
+        if (nxt == IPPROTO_TCP)
+        {
+            return (off);
+        }
+        if (off + 8 > len)
+        {
+            return (-1);
+        }
+        switch (nxt)
+        {
+            case IPPROTO_HOPOPTS:
+            case IPPROTO_ROUTING:
+            case IPPROTO_DSTOPTS:
+                nxt  = ip6[off];
+                off += (ip6[off + 1] + 1) << 3;
+                break;
+            case IPPROTO_AH:
+                nxt  = ip6[off];
+                off += (ip6[off + 1] + 2) << 2;
+                break;
+            case IPPROTO_FRAGMENT:
+                /** offset and more fragments both clear: the whole thing */
+                if (ip6[off + 2] || (ip6[off + 3] & 0xf9))
+                {
+                    return (0);
+                }
+                nxt  = ip6[off];
+                off += 8;
+                break;
+            default:
+                return (0);
+        }
+    }
+    return (0);
+}
+
+/*
+ * Pick the worker for a packet from its addresses and ports.  It has to be
+ * symmetric so both directions of a connection end up in the same place.
+ * -1 for a TCP/IPv4 fragment, which has to be put back together first.
+ */
+static int
+packet_shard(ncc_t *ncc, const struct pcap_pkthdr *header, 
+const u_char *packet)
+{
+    uint32_t h, len, plen;
+    int l2, off;
+    uint16_t proto;
+    const uint8_t *l3;
+    struct libnet_ipv4_hdr *ip;
+    struct libnet_tcp_hdr  *tcp;
+
+    l2 = ncc->link->decode(packet, header->caplen, &proto);
+    if (l2 < 0 || proto == 0)
+    {
+        return (0);
+    }
+    l3  = packet + l2;
+    len = header->caplen - l2;
+    tcp = NULL;
+    if (proto == ETHERTYPE_IPV6)
+    {
+        if (len < LIBNET_IPV6_H)
+        {
+            return (0);
+        }
+        /** only as far as the IP length, never into link layer padding */
+        plen = ntohs(*(uint16_t *)(l3 + 4));
+        if (plen && LIBNET_IPV6_H + plen < len)
+        {
+            len = LIBNET_IPV6_H + plen;
+        }
+        h   = packet_fold6(l3 + 8) ^ packet_fold6(l3 + 24);
+        off = packet_ip6(l3, len);
+        if (off > 0 && len >= off + 4)
+        {
+            tcp = (struct libnet_tcp_hdr *)(l3 + off);
+        }
+    }
+    else
+    {
+        if (len < LIBNET_IPV4_H)
+        {
+            return (0);
+        }
+        ip = (struct libnet_ipv4_hdr *)l3;
+        h  = ip->ip_src.s_addr ^ ip->ip_dst.s_addr;
+        if (ip->ip_p == IPPROTO_TCP && (ip->ip_off & htons(IP_MF | IP_OFFMASK))
+            && ip->ip_hl >= 5 && len >= (ip->ip_hl << 2))
+        {
+            return (-1);
+        }
+        if (ip->ip_p == IPPROTO_TCP && len >= (ip->ip_hl << 2) + 4)
+        {
+            tcp = (struct libnet_tcp_hdr *)(l3 + (ip->ip_hl << 2));
+        }
+    }
+    if (tcp)
+    {
+        h ^= tcp->th_sport ^ tcp->th_dport;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return (h % ncc->nworkers);
+}
+
+/*
+ * A fragment on the capture side.  Only the first one has the ports to
+ * shard on, so the datagram is put back together here, the way the kernel
+ * does for a fanout group, and goes to its worker behind the last
+ * fragment's link header like any other packet.
+ */
+static void
+packet_defrag(ncc_t *ncc, const struct pcap_pkthdr *header,
+const u_char *packet)
+{
+    struct pcap_pkthdr h;
+    uint8_t *dgram;
+    uint32_t len;
+    uint16_t proto;
+    int l2, n;
+
+    l2    = ncc->link->decode(packet, header->caplen, &proto);
+    dgram = frag_add(&ncc->frag, packet + l2, header->caplen - l2, 
+                header->ts.tv_sec, l2, &len, &ncc->stats);
+    if (dgram == NULL)
+    {
+        return;
+    }
+    dgram -= l2;
+    memcpy(dgram, packet, l2);
+    h        = *header;
+    h.caplen = l2 + len;
+    h.len    = l2 + len;
+    n = packet_shard(ncc, &h, dgram);
+    worker_enqueue(&ncc->workers[n > 0 ? n : 0], &h, dgram);
+    frag_release(&ncc->frag);
+}
+
+/** pcap callback: capture side, hand the packet to whoever owns its flow */
 void
 process_packet(u_char *user, const struct pcap_pkthdr *header, 
 const u_char *packet)
 {
     ncc_t *ncc;
-    uint8_t *payload;
-    four_tuple_t ft;
-    int32_t payload_size;
-    srch_results_t *results;
+    int n;
+
+    ncc = (ncc_t *)user;
+
+    /** with the kernel bypass filter in place the pcap filter is on us */
+    if ((ncc->flags & NFEX_EBPF) && 
+        pcap_offline_filter(&ncc->filter, header, packet) == 0)
+    {
+        return;
+    }
+
+    ncc->stats.total_packets++;
+    ncc->stats.total_bytes += (header->len + sizeof (struct pcap_pkthdr));
+
+    if (ncc->nworkers == 1)
+    {
+        /** no threads, do it all right here */
+        worker_batch_add(&ncc->workers[0], header, packet);
+    }
+    else
+    {
+        n = packet_shard(ncc, header, packet);
+        if (n == -1)
+        {
+            packet_defrag(ncc, header, packet);
+            return;
+        }
+        worker_enqueue(&ncc->workers[n], header, packet);
+    }
+}
+
+/** whoever handed us packets is about to take them back */
+void
+process_batch_end(u_char *user)
+{
+    ncc_t *ncc;
+
+    ncc = (ncc_t *)user;
+    if (ncc->nworkers == 1)
+    {
+        worker_batch_flush(&ncc->workers[0]);
+    }
+}
+
+/*
+ * Queue a packet on the worker's batch, running the batch when it's full.
+ * The packet has to stay put until the batch is flushed; if the worker
+ * has a copy buffer (only when libpcap owns the packet) it's copied.
+ */
+void
+worker_batch_add(nwc_t *w, const struct pcap_pkthdr *header, 
+const u_char *packet)
+{
+    nbatch_t *b;
+    npkt_t *p;
+
+    b = &w->batch;
+    if (b->copy)
+    {
+        if (b->copied + header->caplen > NFEX_BATCH_COPY)
+        {
+            worker_batch_flush(w);
+        }
+        memcpy(b->copy + b->copied, packet, header->caplen);
+        packet     = b->copy + b->copied;
+        b->copied += header->caplen;
+    }
+
+    p         = &b->pkt[b->n++];
+    p->h      = *header;
+    p->packet = packet;
+    if (b->n >= w->ncc->batch)
+    {
+        worker_batch_flush(w);
+    }
+}
+
+/** stage 1: decode, key and hash, prefetch the session slot */
+static int
+batch_parse(nwc_t *w, nbatch_t *b, time_t *now)
+{
+    int i, n, l2, off;
+    npkt_t *p;
+    const uint8_t *l3;
     struct libnet_ipv4_hdr *ip;
     struct libnet_tcp_hdr  *tcp;
-    uint16_t ip_hl, tcp_hl, header_cruft;
+    link_decode_t decode;
+    uint32_t len, end, plen;
+    uint16_t proto, ip_hl, header_cruft;
 
-    ncc = (ncc_t *)user;
+    decode = w->ncc->link->decode;
+    for (i = 0, n = 0; i < b->n; i++)
+    {
+        p  = &b->pkt[i];
+        l2 = decode(p->packet, p->h.caplen, &proto);
+        if (l2 < 0)
+        {
+            w->stats.packet_errors++;
+            continue;
+        }
+        if (proto == 0)
+        {
+            /** ARP, LLDP and friends */
+            continue;
+        }
+        l3  = p->packet + l2;
+        len = p->h.caplen - l2;
+
+        if (proto == ETHERTYPE_IPV6)
+        {
+            if (len < LIBNET_IPV6_H)
+            {
+                w->stats.packet_errors++;
+                continue;
+            }
+
+            /** the link layer may have padded it, believe the IP length */
+            plen = ntohs(*(uint16_t *)(l3 + 4));
+            end  = LIBNET_IPV6_H + plen;
+            if (plen == 0 || end > len)
+            {
+                end = len;
+            }
+
+            /** and don't take any padding for extension headers */
+            off = packet_ip6(l3, end);
+            if (off == 0)
+            {
+                continue;
+            }
+            if (off < 0 || end < off + LIBNET_TCP_H)
+            {
+                w->stats.packet_errors++;
+                continue;
+            }
+
+            p->ip6         = l3 + 8;
+            p->ft.ip_src   = packet_fold6(l3 + 8);
+            p->ft.ip_dst   = packet_fold6(l3 + 24);
+        }
+        else
+        {
+            if (len < LIBNET_IPV4_H)
+            {
+                w->stats.packet_errors++;
+                continue;
+            }
+            ip     = (struct libnet_ipv4_hdr *)l3;
+            ip_hl  = ip->ip_hl << 2;
+            if (ip->ip_p != IPPROTO_TCP)
+            {
+                continue;
+            }
+            if (ip_hl < LIBNET_IPV4_H || len < ip_hl)
+            {
+                w->stats.packet_errors++;
+                continue;
+            }
+            if (ip->ip_off & htons(IP_MF | IP_OFFMASK))
+            {
+                /** held until the rest shows up, then it's one packet */
+                l3 = frag_add(&w->frag, l3, len, p->h.ts.tv_sec, 0, &len,
+                        &w->stats);
+                if (l3 == NULL)
+                {
+                    continue;
+                }
+                ip    = (struct libnet_ipv4_hdr *)l3;
+                ip_hl = ip->ip_hl << 2;
+            }
+
+            /** options are stepped over, link layer padding is left off */
+            end = ntohs(ip->ip_len);
+            if (end == 0 || end > len)
+            {
+                /** offloaded on the way out, or cut short by the snaplen */
+                end = len;
+            }
+            if (end < ip_hl + LIBNET_TCP_H)
+            {
+                w->stats.packet_errors++;
+                continue;
+            }
+            off = ip_hl;
+
+            p->ip6         = NULL;
+            p->ft.ip_src   = ip->ip_src.s_addr;
+            p->ft.ip_dst   = ip->ip_dst.s_addr;
+        }
+        tcp          = (struct libnet_tcp_hdr *)(l3 + off);
+        header_cruft = off + (tcp->th_off << 2);
+
+        /** session aging runs on the first packet's time, see below */
+        if (*now == 0)
+        {
+            *now = p->h.ts.tv_sec;
+        }
+
+        /** only what was captured is there to look at */
+        p->payload_size = (int32_t)end - header_cruft;
+        if (p->payload_size <= 0 && (tcp->th_flags & TH_SYN) == 0)
+        {
+            /** not an error per se, just no payload */
+            continue;
+        }
+        p->payload  = (uint8_t *)(l3 + header_cruft);
+        p->seq      = ntohl(tcp->th_seq);
+        p->th_flags = tcp->th_flags;
+
+        /** four tuple information aka "a session", either way round */
+        p->ft.port_src = tcp->th_sport;
+        p->ft.port_dst = tcp->th_dport;
+        p->dir         = ht_key(&p->ft, p->ip6);
+        p->hash        = ht_hash(&p->ft, p->ip6 != NULL);
+        __builtin_prefetch(&w->ht.slots[p->hash & w->ht.mask]);
+
+        /** keep the ones worth looking at, in order */
+        if (n != i)
+        {
+            b->pkt[n] = *p;
+        }
+        n++;
+    }
+    return (n);
+}
+
+/** stage 2: find or create every session, prefetch what stage 3 touches */
+static void
+batch_lookup(nwc_t *w, nbatch_t *b, int n)
+{
+    int i;
+    npkt_t *p;
+
+    for (i = 0; i < n; i++)
+    {
+        p = &b->pkt[i];
+        w->now = p->h.ts.tv_sec;
+        p->session = ht_insert(&p->ft, p->hash, p->ip6, p->dir, w);
+        if (p->session == NULL)
+        {
+            w->stats.packet_errors++;
+            continue;
+        }
+        __builtin_prefetch(&p->session->flow[p->dir]);
+        __builtin_prefetch(p->payload);
+    }
+}
+
+/** stage 3: reassembly, and through it search and extract, in order */
+static void
+batch_stream(nwc_t *w, nbatch_t *b, int n)
+{
+    int i, c;
+    npkt_t *p;
+    ht_flow_t *flow;
+    uint32_t seq;
+
+    for (i = 0; i < n; i++)
+    {
+        p = &b->pkt[i];
+        if (p->session == NULL)
+        {
+            continue;
+        }
+        w->now     = p->h.ts.tv_sec;
+        w->session = p->session;
+        flow       = &p->session->flow[p->dir];
+
+        /** copy over timestamp */
+        w->stats.ts_last.tv_sec  = p->h.ts.tv_sec;
+        w->stats.ts_last.tv_usec = p->h.ts.tv_usec;
 
-    ip     = (struct libnet_ipv4_hdr *)(packet + LIBNET_ETH_H);
-    ip_hl  = ip->ip_hl << 2;
+        /** put the stream back in order before anyone looks at it */
+        seq = p->seq;
+        if (p->th_flags & TH_SYN)
+        {
+            /** no more guessing who's who, the SYN came from the client */
+            c = (p->th_flags & TH_ACK) ? !p->dir : p->dir;
+            w->session->flow[c].role  = SRCH_DIR_CLIENT;
+            w->session->flow[!c].role = SRCH_DIR_SERVER;
+            if (reasm_syn(w, flow, seq))
+            {
+                /** a new connection, and it gets looked at from the top */
+                flow->flags     &= ~SESSION_BYPASS;
+                flow->depth      = 0;
+                flow->srch_state = SRCH_STATE_START;
+            }
+            seq++;
+        }
+        else if (flow->flags & SESSION_BYPASS)
+        {
+            /** deep enough into this one that nothing we want can show up */
+            w->stats.bypass_packets++;
+            w->stats.bypass_bytes += p->payload_size;
+            continue;
+        }
+        if (p->payload_size > 0)
+        {
+            reasm_segment(w, w->session, flow, seq, p->payload, 
+                p->payload_size);
+        }
+    }
+}
+
+/*
+ * Run everything queued on the batch through the three stages.  Sessions
+ * are only expired up front, on the first packet's clock, so none of the
+ * ones looked up in stage 2 can go away before stage 3 is done with them;
+ * the rest of the batch's time catches up on the next one.
+ */
+void
+worker_batch_flush(nwc_t *w)
+{
+    nbatch_t *b;
+    time_t now;
+    uint64_t t0, t1, t2, t3;
+    int n;
 
-    /** this is a trival fix to handle IP options */
-    if (ip_hl != 20) 
+    b = &w->batch;
+    if (b->n == 0)
     {
-        ncc->stats.packet_errors++;
+        /** nothing new, but the writer may have finished something */
+        writer_flush(&w->writer);
         return;
     }
 
-    switch (ip->ip_p)
+    now = 0;
+    t0  = BATCH_CYCLES();
+    n   = batch_parse(w, b, &now);
+
+    /*
+     * all session and extraction aging runs on capture time, so offline
+     * replays behave the same as they did live and we never ask the kernel
+     * what time it is
+     */
+    if (now > w->tw.now)
     {
-        case IPPROTO_TCP:
-            tcp    = (struct libnet_tcp_hdr *)(packet + LIBNET_ETH_H + ip_hl);
-            tcp_hl = tcp->th_off << 2;
-            header_cruft = LIBNET_ETH_H + ip_hl + tcp_hl;
-            break;
-        default:
-            return;          
+        w->now = now;
+        ht_expire_session(w);
     }
 
-    ncc->stats.total_packets++;
-    ncc->stats.total_bytes += (header->len + sizeof (struct pcap_pkthdr));
+    t1 = BATCH_CYCLES();
+    batch_lookup(w, b, n);
+    t2 = BATCH_CYCLES();
+    batch_stream(w, b, n);
+    t3 = BATCH_CYCLES();
+
+    w->stats.batches++;
+    w->stats.batch_packets += b->n;
+    w->stats.cycles_parse  += t1 - t0;
+    w->stats.cycles_lookup += t2 - t1;
+    w->stats.cycles_stream += t3 - t2;
+    b->n      = 0;
+    b->copied = 0;
+
+    /** all it finished is indexed, nothing older is coming from us */
+    index_clock(&w->ncc->index, w->id, &w->stats.ts_last);
+
+    /** datagrams put back together for this batch are done with too */
+    frag_release(&w->frag);
+
+    /** and whatever it extracted goes off to the kernel in one go */
+    writer_flush(&w->writer);
+}
+
+/*
+ * Stop looking at one direction of a session.  With the kernel filter on,
+ * tell it too, and the rest of that direction never makes it up to us 
+ * (IPv4 only, the filter passes everything else).
+ */
+static void
+stream_bypass(nwc_t *w, ht_node_t *session, ht_flow_t *flow)
+{
+    four_tuple_t *ft;
 
-    payload_size = header->len - header_cruft;
-    if (payload_size <= 0)
+    flow->flags |= SESSION_BYPASS;
+    w->stats.bypass_sessions++;
+    reasm_free(w, flow);
+    if ((w->ncc->flags & NFEX_EBPF) && session->ip6 == NULL)
     {
-        /** not an error per se, just no payload */
+        ft = &session->ft;
+        if (flow == &session->flow[0])
+        {
+            ebpf_bypass(&w->ncc->ebpf, ft->ip_src, ft->ip_dst,
+                ft->port_src, ft->port_dst);
+        }
+        else
+        {
+            ebpf_bypass(&w->ncc->ebpf, ft->ip_dst, ft->ip_src,
+                ft->port_dst, ft->port_src);
+        }
+    }
+}
+
+/** in order stream data: sift it for our yumyums and extract */
+void
+stream_deliver(nwc_t *w, ht_node_t *session, ht_flow_t *flow, 
+const uint8_t *data, uint32_t size)
+{
+    srch_results_t *results;
+    nsc_t *sc;
+
+    if (flow->flags & SESSION_BYPASS)
+    {
+        /** went past stream depth earlier in this batch */
         return;
     }
 
-    payload = (uint8_t *)(packet + header_cruft);
+    /** nothing we want goes this way (direction() in the config file) */
+    sc = w->sc;
+    if ((flow->role & sc->dirs) == 0)
+    {
+        return;
+    }
 
-    /** copy over timestamp */
-    ncc->stats.ts_last.tv_sec  = header->ts.tv_sec;
-    ncc->stats.ts_last.tv_usec = header->ts.tv_usec;
+    /** a state from the machine before a reload means nothing to this one */
+    if (flow->srch_epoch != sc->epoch)
+    {
+        flow->srch_state = SRCH_STATE_START;
+        flow->srch_epoch = sc->epoch;
+    }
 
-    /** four tuple information aka "a session" */
-    ft.ip_src   = ip->ip_src.s_addr;
-    ft.ip_dst   = ip->ip_dst.s_addr;
-    ft.port_src = tcp->th_sport;
-    ft.port_dst = tcp->th_dport;
+    /** a TLS record up front: it's all ciphertext from here on */
+    if (flow->depth == 0 && size >= 3 && data[0] == 0x16 && 
+        data[1] == 0x03 && data[2] <= 0x04 &&
+        (sc->bypass_depth || (w->ncc->flags & NFEX_EBPF)))
+    {
+        stream_bypass(w, session, flow);
+        return;
+    }
 
-    /** attempt to add this session to the session table */
-    ncc->session = ht_insert(&ft, ncc);
+    /** pass payload to search interface */
+    results = search(sc->sm, &w->results, 
+        &(flow->srch_state), (uint8_t *)data, size);
 
-    /** pass payload to search interface to sift for our yumyums */
-    results = search(ncc->srch_machine, &(ncc->session->srchptr_list), payload, 
-        payload_size);
+    extract(flow, results, session, data, size, w);
 
-    extract(&(ncc->session->extract_list), results, ncc->session, payload, 
-        payload_size, ncc);
+    /** results are done with, all of them at once */
+    arena_reset(&w->results);
 
-    free_results_list(&results);
+    /** past stream depth with nothing being extracted, we're done here */
+    flow->depth += size;
+    if (sc->bypass_depth && flow->depth >= sc->bypass_depth &&
+        flow->extract_list == NULL)
+    {
+        stream_bypass(w, session, flow);
+    }
 }
 
 /** EOF */
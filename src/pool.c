@@ -0,0 +1,173 @@
+/*
+ * pool.c - fixed size object pools and a bump arena
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+void
+pool_init(pool_t *p, size_t size, uint32_t per_slab)
+{
+    memset(p, 0, sizeof (pool_t));
+    if (size < sizeof (void *))
+    {
+        size = sizeof (void *);
+    }
+    p->size     = POOL_ROUND(size);
+    p->per_slab = per_slab;
+}
+
+/** next object off the free list, carving up a new slab if it's empty */
+void *
+pool_get(pool_t *p)
+{
+    uint32_t i;
+    uint8_t *obj;
+    pool_slab_t *s;
+
+    if (p->free == NULL)
+    {
+        s = malloc(POOL_ROUND(sizeof (pool_slab_t)) + p->size * p->per_slab);
+        if (s == NULL)
+        {
+            return (NULL);
+        }
+        s->next  = p->slabs;
+        p->slabs = s;
+        p->nslabs++;
+
+        obj = (uint8_t *)s + POOL_ROUND(sizeof (pool_slab_t));
+        for (i = 0; i < p->per_slab; i++, obj += p->size)
+        {
+            *(void **)obj = p->free;
+            p->free = obj;
+        }
+    }
+
+    obj     = p->free;
+    p->free = *(void **)obj;
+    p->in_use++;
+    if (p->in_use > p->peak)
+    {
+        p->peak = p->in_use;
+    }
+    return (obj);
+}
+
+void
+pool_put(pool_t *p, void *obj)
+{
+    *(void **)obj = p->free;
+    p->free = obj;
+    p->in_use--;
+}
+
+/** hand every slab back, anything still out is gone too */
+void
+pool_destroy(pool_t *p)
+{
+    pool_slab_t *s;
+
+    while ((s = p->slabs))
+    {
+        p->slabs = s->next;
+        free(s);
+    }
+    p->free   = NULL;
+    p->nslabs = 0;
+    p->in_use = 0;
+}
+
+void
+arena_init(arena_t *a)
+{
+    memset(a, 0, sizeof (arena_t));
+}
+
+/** bump allocate, moving on to (or adding) another block when this is full */
+void *
+arena_get(arena_t *a, size_t size)
+{
+    size_t bsize;
+    arena_block_t *b, *last;
+
+    size = POOL_ROUND(size);
+    last = NULL;
+    for (b = a->cur; b; b = b->next)
+    {
+        if (b->used + size <= b->size)
+        {
+            break;
+        }
+        last = b;
+        if (b->next)
+        {
+            /** blocks past cur are left over from before the reset */
+            b->next->used = 0;
+        }
+    }
+    if (b == NULL)
+    {
+        bsize = size > NFEX_ARENA_BLOCK ? size : NFEX_ARENA_BLOCK;
+        b = malloc(POOL_ROUND(sizeof (arena_block_t)) + bsize);
+        if (b == NULL)
+        {
+            return (NULL);
+        }
+        b->next = NULL;
+        b->size = bsize;
+        b->used = 0;
+        if (last)
+        {
+            last->next = b;
+        }
+        else
+        {
+            a->head = b;
+        }
+        a->size += bsize;
+    }
+
+    a->cur   = b;
+    a->used += size;
+    if (a->used > a->peak)
+    {
+        a->peak = a->used;
+    }
+    b->used += size;
+    return ((uint8_t *)b + POOL_ROUND(sizeof (arena_block_t)) + b->used -
+        size);
+}
+
+/** everything handed out since the last reset is dead */
+void
+arena_reset(arena_t *a)
+{
+    a->cur  = a->head;
+    a->used = 0;
+    if (a->head)
+    {
+        a->head->used = 0;
+    }
+}
+
+void
+arena_destroy(arena_t *a)
+{
+    arena_block_t *b;
+
+    while ((b = a->head))
+    {
+        a->head = b->next;
+        free(b);
+    }
+    memset(a, 0, sizeof (arena_t));
+}
+
+/** EOF */
@@ -0,0 +1,200 @@
+/*
+ * reasm.c - TCP stream reassembly
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include "nfex.h"
+#include "reasm.h"
+
+static void reasm_drain(nwc_t *, ht_node_t *, ht_flow_t *);
+static void reasm_skip(nwc_t *, ht_node_t *, ht_flow_t *);
+static void reasm_free_seg(nwc_t *, reasm_t *, reasm_seg_t *);
+
+/*
+ * a SYN: the stream starts at seq + 1, whatever we thought before.
+ * Returns 1 if that's a new stream, 0 for a retransmitted SYN.
+ */
+int
+reasm_syn(nwc_t *w, ht_flow_t *flow, uint32_t seq)
+{
+    reasm_t *r;
+
+    r = &flow->stream;
+    if (r->state == REASM_SYNCED && r->isn == seq)
+    {
+        /** retransmitted SYN */
+        return (0);
+    }
+    reasm_free(w, flow);
+    r->state    = REASM_SYNCED;
+    r->isn      = seq;
+    r->next_seq = seq + 1;
+    return (1);
+}
+
+/*
+ * Take a segment of one direction's stream data.  Anything we've already
+ * delivered is dropped, in order data goes straight to the search machine
+ * along with whatever was queued up behind it, and anything past a hole
+ * is copied and held until the hole fills or we run out of room to wait.
+ */
+void
+reasm_segment(nwc_t *w, ht_node_t *session, ht_flow_t *flow, uint32_t seq,
+const uint8_t *data, uint32_t len)
+{
+    reasm_t *r;
+    uint32_t end;
+    reasm_seg_t *s, **pp;
+
+    r = &flow->stream;
+    if (len == 0)
+    {
+        return;
+    }
+    if (r->state == REASM_NONE)
+    {
+        /** picked up mid-stream, go from here */
+        r->state    = REASM_SYNCED;
+        r->next_seq = seq;
+    }
+
+    end = seq + len;
+    if (SEQ_LEQ(end, r->next_seq))
+    {
+        /** retransmission of data we've already seen */
+        w->stats.reasm_dups++;
+        return;
+    }
+    if (SEQ_LT(seq, r->next_seq))
+    {
+        /** overlaps what we've seen, keep the new part */
+        data += r->next_seq - seq;
+        len  -= r->next_seq - seq;
+        seq   = r->next_seq;
+    }
+
+    if (seq == r->next_seq)
+    {
+        stream_deliver(w, session, flow, data, len);
+        r->next_seq = end;
+        if (r->segs)
+        {
+            reasm_drain(w, session, flow);
+        }
+        return;
+    }
+
+    /** past a hole, find its place in line */
+    for (pp = &r->segs; *pp && SEQ_LEQ((*pp)->seq, seq); pp = &(*pp)->next)
+    {
+        if (SEQ_LEQ(end, (*pp)->seq + (*pp)->len))
+        {
+            /** already holding all of it */
+            w->stats.reasm_dups++;
+            return;
+        }
+    }
+
+    s = malloc(sizeof (reasm_seg_t) + len);
+    if (s == NULL)
+    {
+        /** can't wait for the hole, so don't */
+        w->stats.reasm_gaps++;
+        r->next_seq = seq;
+        reasm_segment(w, session, flow, seq, data, len);
+        return;
+    }
+    s->seq  = seq;
+    s->len  = len;
+    memcpy(s->data, data, len);
+    s->next = *pp;
+    *pp     = s;
+
+    r->queued      += len;
+    w->reasm.bytes += len;
+    if (w->reasm.bytes > w->reasm.peak)
+    {
+        w->reasm.peak = w->reasm.bytes;
+    }
+    w->stats.reasm_ooo++;
+
+    /** over budget: stop waiting on the hole and take what we have */
+    while (r->segs &&
+        (r->queued > NFEX_REASM_FLOW_MAX || w->reasm.bytes > w->reasm.max))
+    {
+        reasm_skip(w, session, flow);
+    }
+}
+
+/** deliver everything the last segment made contiguous */
+static void
+reasm_drain(nwc_t *w, ht_node_t *session, ht_flow_t *flow)
+{
+    reasm_t *r;
+    reasm_seg_t *s;
+    uint32_t skip;
+
+    r = &flow->stream;
+    while ((s = r->segs) && SEQ_LEQ(s->seq, r->next_seq))
+    {
+        r->segs = s->next;
+        if (SEQ_GT(s->seq + s->len, r->next_seq))
+        {
+            skip = r->next_seq - s->seq;
+            stream_deliver(w, session, flow, s->data + skip, s->len - skip);
+            r->next_seq = s->seq + s->len;
+        }
+        reasm_free_seg(w, r, s);
+    }
+}
+
+/** give up on the hole in front of the queue, jump the stream over it */
+static void
+reasm_skip(nwc_t *w, ht_node_t *session, ht_flow_t *flow)
+{
+    reasm_t *r;
+
+    r = &flow->stream;
+    w->stats.reasm_gaps++;
+    r->next_seq = r->segs->seq;
+    reasm_drain(w, session, flow);
+}
+
+/** session's going away, hand over what it was still holding */
+void
+reasm_flush(nwc_t *w, ht_node_t *session, ht_flow_t *flow)
+{
+    while (flow->stream.segs)
+    {
+        reasm_skip(w, session, flow);
+    }
+}
+
+/** throw away anything queued without delivering it */
+void
+reasm_free(nwc_t *w, ht_flow_t *flow)
+{
+    reasm_t *r;
+    reasm_seg_t *s;
+
+    r = &flow->stream;
+    while ((s = r->segs))
+    {
+        r->segs = s->next;
+        reasm_free_seg(w, r, s);
+    }
+}
+
+static void
+reasm_free_seg(nwc_t *w, reasm_t *r, reasm_seg_t *s)
+{
+    r->queued      -= s->len;
+    w->reasm.bytes -= s->len;
+    free(s);
+}
+
+/** EOF */
@@ -0,0 +1,151 @@
+/*
+ * ring.c - lock-free single producer, single consumer byte ring
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include "nfex.h"
+#include "ring.h"
+#include <sched.h>
+
+/** round n up to the record alignment */
+#define RING_ROUND(n) (((uint64_t)(n) + NFEX_RING_ALIGN - 1) &               \
+                        ~((uint64_t)NFEX_RING_ALIGN - 1))
+
+int
+ring_init(ring_t *r, uint64_t size)
+{
+    memset(r, 0, sizeof (ring_t));
+
+    /** has to be a power of two so offsets wrap cleanly */
+    if (size & (size - 1))
+    {
+        return (-1);
+    }
+    r->buf = malloc(size);
+    if (r->buf == NULL)
+    {
+        return (-1);
+    }
+    r->size = size;
+    return (1);
+}
+
+void
+ring_free(ring_t *r)
+{
+    free(r->buf);
+    r->buf = NULL;
+}
+
+/*
+ * Get space for a record of len bytes, waiting for the consumer if we have
+ * to.  Nothing is visible to the consumer until ring_commit().  len must be
+ * well under half the ring.
+ */
+void *
+ring_reserve(ring_t *r, uint32_t len)
+{
+    ring_record_t *rec;
+    uint64_t need, pos;
+
+    need = sizeof (ring_record_t) + RING_ROUND(len);
+    pos  = r->head & (r->size - 1);
+
+    /** won't fit before the end, burn the remainder with a wrap record */
+    if (pos + need > r->size)
+    {
+        need += r->size - pos;
+    }
+
+    /** bounded: if the consumer is behind we have to wait for it */
+    if (r->head + need - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->size)
+    {
+        r->stalls++;
+        do
+        {
+            sched_yield();
+        } while (r->head + need - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)
+                 > r->size);
+    }
+
+    if (pos + sizeof (ring_record_t) + RING_ROUND(len) > r->size)
+    {
+        rec      = (ring_record_t *)(r->buf + pos);
+        rec->len = NFEX_RING_WRAP;
+        r->reserved = r->head + r->size - pos;
+        pos      = 0;
+    }
+    else
+    {
+        r->reserved = r->head;
+    }
+
+    rec      = (ring_record_t *)(r->buf + pos);
+    rec->len = len;
+    return (rec + 1);
+}
+
+/** publish the record from the last ring_reserve() */
+void
+ring_commit(ring_t *r)
+{
+    ring_record_t *rec;
+
+    rec = (ring_record_t *)(r->buf + (r->reserved & (r->size - 1)));
+    __atomic_store_n(&r->head,
+        r->reserved + sizeof (ring_record_t) + RING_ROUND(rec->len),
+        __ATOMIC_RELEASE);
+}
+
+/*
+ * Consumer side: return the record at *pos (start with *pos = tail) and
+ * move *pos past it, or NULL if the producer hasn't gotten that far.
+ * Records stay put until ring_release() so several can be looked at
+ * before giving the space back.
+ */
+void *
+ring_peek(ring_t *r, uint64_t *pos, uint32_t *len)
+{
+    ring_record_t *rec;
+    uint64_t head;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (*pos == head)
+    {
+        return (NULL);
+    }
+    rec = (ring_record_t *)(r->buf + (*pos & (r->size - 1)));
+    if (rec->len == NFEX_RING_WRAP)
+    {
+        *pos += r->size - (*pos & (r->size - 1));
+        if (*pos == head)
+        {
+            return (NULL);
+        }
+        rec = (ring_record_t *)(r->buf + (*pos & (r->size - 1)));
+    }
+    *len  = rec->len;
+    *pos += sizeof (ring_record_t) + RING_ROUND(rec->len);
+    return (rec + 1);
+}
+
+/** consumer: everything before pos can be reused by the producer */
+void
+ring_release(ring_t *r, uint64_t pos)
+{
+    __atomic_store_n(&r->tail, pos, __ATOMIC_RELEASE);
+}
+
+/** bytes queued and not yet released */
+uint64_t
+ring_backlog(ring_t *r)
+{
+    return (__atomic_load_n(&r->head, __ATOMIC_RELAXED) -
+            __atomic_load_n(&r->tail, __ATOMIC_RELAXED));
+}
+
+/** EOF */
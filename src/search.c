@@ -33,6 +33,10 @@
 #include "util.h"
 #include "search.h"
 #include "conf.h"
+#include <sys/mman.h>
+#if (NFEX_SIMD)
+#include <immintrin.h>
+#endif /** NFEX_SIMD */
 
 static size_t currlen;
 
@@ -145,7 +149,7 @@ unsigned long maxlen, spectype_t type)
         p                     = new_srch_node(COMPLETE);
         p->spectype           = type;
         p->data.fileid.id     = id;
-        p->data.fileid.ext    = ext;
+        snprintf(p->data.fileid.ext, SRCH_EXT_MAX, "%s", ext);
         p->data.fileid.maxlen = maxlen;
         node->data.table[c]   = p;
         q                     = p;
@@ -179,7 +183,7 @@ add_wildcard(srch_node_t *node, int remaining, int id, char *ext, unsigned long
         p                     = new_srch_node(COMPLETE);
         p->spectype           = type;
         p->data.fileid.id     = id;
-        p->data.fileid.ext    = ext;
+        snprintf(p->data.fileid.ext, SRCH_EXT_MAX, "%s", ext);
         p->data.fileid.maxlen = maxlen;
         for (i = 0; i < 256; i++)
         {
@@ -206,275 +210,790 @@ add_wildcard(srch_node_t *node, int remaining, int id, char *ext, unsigned long
     }
 }
 
-/*
- * the overall search interface.  You call this bad boy and give it a
- * pointer to your data buffer (i.e. a packet)
- */
-srch_results_t *
-search(srch_node_t *tree, srchptr_list_t **srchptr_list, uint8_t *buf, 
-size_t len)
+/** give every node in the parse tree a number, collecting them in nodes */
+static void
+number_srch_nodes(srch_node_t *node, srch_node_t ***nodes, uint32_t *nnodes, 
+uint32_t *size)
 {
-    srch_results_t *p;
     int i;
-    
-    /** called once for every byte of data in the payload */
-    for (p = NULL, i = 0; i < len; i++)
+
+    /** wildcards share nodes, so we may have been here already */
+    if (node->n)
     {
-        /** can this be optimized, can we run on blocks of data? */
-        update_search(tree, srchptr_list, &p, buf[i], i); 
+        return;
+    }
+    if (*nnodes == *size)
+    {
+        *size  = *size ? *size * 2 : 256;
+        *nodes = realloc(*nodes, *size * sizeof (srch_node_t *));
+        if (*nodes == NULL)
+        {
+            error("can't allocate memory for search nodes\n");
+        }
     }
+    (*nodes)[*nnodes] = node;
+    node->n = ++(*nnodes);
 
-    return (p);
+    if (node->nodetype == TABLE)
+    {
+        for (i = 0; i < 256; i++)
+        {
+            if (node->data.table[i])
+            {
+                number_srch_nodes(node->data.table[i], nodes, nnodes, size);
+            }
+        }
+    }
 }
 
-static void
-add_srchptr(srchptr_list_t **srchptr_list, srch_node_t *node)
+/*
+ * Split the 256 byte values into classes that every TABLE node treats the
+ * same, refining one node at a time: bytes stay together only as long as
+ * each node sends them to the same place.  Fills in class and one
+ * representative byte per class, returns the number of classes.
+ */
+static uint32_t
+search_classes(srch_node_t **nodes, uint32_t nnodes, uint8_t *class,
+uint8_t *rep)
 {
-    srchptr_list_t *p, *q;
-
-    p = ecalloc(1, sizeof (srchptr_list_t));
-
-    /** make this guy the front of the list */
-    p->next = *srchptr_list;
-
-    if (p->next)
+    srch_node_t *to[256];
+    int16_t head[256], link[256];
+    uint8_t next[256];
+    uint32_t n, j;
+    int c, k;
+
+    memset(class, 0, 256);
+    for (n = 1, j = 0; j < nnodes; j++)
     {
-        /** fix pointer linkage */
-        p->next->prev = p;
+        if (nodes[j]->nodetype != TABLE)
+        {
+            continue;
+        }
+        /** new classes hang off the old class they came from */
+        memset(head, 0xff, sizeof (head));
+        for (n = 0, c = 0; c < 256; c++)
+        {
+            for (k = head[class[c]]; k != -1; k = link[k])
+            {
+                if (to[k] == nodes[j]->data.table[c])
+                {
+                    break;
+                }
+            }
+            if (k == -1)
+            {
+                k              = n++;
+                to[k]          = nodes[j]->data.table[c];
+                link[k]        = head[class[c]];
+                head[class[c]] = k;
+            }
+            next[c] = k;
+        }
+        memcpy(class, next, 256);
     }
-    p->node       = node;
-    *srchptr_list = p;
 
-    //for (q = p->next; q && q != p; q = q->next) ;
+    /** classes are numbered in order of their lowest byte */
+    for (k = -1, c = 0; c < 256; c++)
+    {
+        if (class[c] > k)
+        {
+            k = class[c];
+            rep[k] = c;
+        }
+    }
+    return (n);
 }
 
-static void
-remv_srchptr(srchptr_list_t **srchptr_list, srchptr_list_t *p)
+/*
+ * look a sorted node set up in the set -> state table, returns the bucket
+ * it's in, or the empty one it would go in
+ */
+static uint32_t
+search_find(uint32_t *set, uint32_t k, uint32_t *set_pool, uint32_t *off,
+uint32_t *len, uint32_t *bucket, uint32_t nbuckets)
 {
-    if (p->prev)
-    {
-        p->prev->next = p->next;
-    }
+    uint32_t h, j, n;
 
-    if (p->next)
+    /** FNV over the set */
+    for (h = 2166136261U, j = 0; j < k; j++)
     {
-        p->next->prev = p->prev;
+        h = (h ^ set[j]) * 16777619U;
     }
-
-    if (*srchptr_list == p)
+    for (h &= nbuckets - 1; bucket[h]; h = (h + 1) & (nbuckets - 1))
     {
-        *srchptr_list = p->next;
+        n = bucket[h] - 1;
+        if (len[n] == k && 
+            memcmp(&set_pool[off[n]], set, k * sizeof (uint32_t)) == 0)
+        {
+            break;
+        }
     }
-
-    free(p);
+    return (h);
 }
 
 /*
- * I sincerely apologize for this function.  This is called once for every 
- * byte of data so I don't want to waste cycles with layers and layers of 
- * function calls. The end result is a long, complex and unmaintainable 
- * function that is quick
- *
- * The inner demon of the search mechanism.  This updates all state machine 
- * pointers with the current character and fixes the search results list 
- * appropriately
- *
- * FIXME: perhaps make this inline for speed
+ * Determinize the parse tree into a search machine.  The old approach 
+ * was to keep a list of "search threads" per session, one for every 
+ * partial match in flight.  Here every distinct set of partial matches 
+ * (plus whatever completed on the way in) becomes one state, built by 
+ * subset construction, and the parse tree is freed when we're done. 
+ * Matching semantics are identical to the thread walk, wildcards included.
  */
-static void
-update_search(srch_node_t *tree, srchptr_list_t **srchptr_list, 
-srch_results_t **results, uint8_t c, int offset)
+srch_machine_t *
+search_build(srch_node_t **srch_tree)
 {
-    srch_node_t *node;
-    srchptr_list_t *ptr;
-    srchptr_list_t *nxt;
+    srch_machine_t *sm;
+    srch_node_t **nodes, *node;
+    uint32_t nnodes, size, *tmp, *bucket, *off, *len, *set_pool;
+    uint32_t nbuckets, pool_len, pool_size, states_size, s, k, j, h, n;
+    uint32_t *trans, *base, nc, c, d, diff, best;
+    uint8_t rep[256];
+
+    sm = ecalloc(1, sizeof (srch_machine_t));
+
+    nodes  = NULL;
+    nnodes = size = 0;
+    if (*srch_tree)
+    {
+        number_srch_nodes(*srch_tree, &nodes, &nnodes, &size);
+    }
 
-    if (*srchptr_list)
-    {   
-        /** start by updating existing threads */
-        for (ptr = *srchptr_list; ptr; ptr = nxt)
+    /** we only need to follow one byte from each class */
+    sm->nclasses = nc = search_classes(nodes, nnodes, sm->class, rep);
+
+    /** scratch space for building one state, at most every node */
+    tmp = emalloc((nnodes + 1) * sizeof (uint32_t));
+
+    /** state n is described by the sorted node set at set_pool[off[n]] */
+    states_size = 256;
+    off         = emalloc(states_size * sizeof (uint32_t));
+    len         = emalloc(states_size * sizeof (uint32_t));
+    trans       = emalloc(states_size * nc * sizeof (uint32_t));
+    pool_size   = 1024;
+    pool_len    = 0;
+    set_pool    = emalloc(pool_size * sizeof (uint32_t));
+
+    /** open addressed set -> state lookup, 0 is empty, else state + 1 */
+    nbuckets    = 1024;
+    bucket      = ecalloc(nbuckets, sizeof (uint32_t));
+
+    /** the start state is the empty set, the root is implicit everywhere */
+    off[0]      = 0;
+    len[0]      = 0;
+    sm->nstates = 1;
+    h           = 2166136261U;
+    bucket[h & (nbuckets - 1)] = 1;
+
+    for (s = 0; s < sm->nstates; s++)
+    {
+        for (c = 0; c < nc; c++)
         {
-            nxt = ptr->next;
-            if (ptr->node->data.table[c])
+            /** advance every partial match in this state, then the root */
+            for (k = 0, j = 0; j <= len[s]; j++)
+            {
+                node = j < len[s] ? nodes[set_pool[off[s] + j] - 1] : 
+                       *srch_tree;
+                if (node && node->nodetype == TABLE && 
+                    node->data.table[rep[c]])
+                {
+                    tmp[k++] = node->data.table[rep[c]]->n;
+                }
+            }
+
+            /** sort (tiny sets, insertion sort is fine) and drop dups */
+            for (j = 1; j < k; j++)
+            {
+                for (n = tmp[j], h = j; h > 0 && tmp[h - 1] > n; h--)
+                {
+                    tmp[h] = tmp[h - 1];
+                }
+                tmp[h] = n;
+            }
+            for (n = 0, j = 0; j < k; j++)
+            {
+                if (n == 0 || tmp[n - 1] != tmp[j])
+                {
+                    tmp[n++] = tmp[j];
+                }
+            }
+            k = n;
+
+            /** look for an existing state */
+            h = search_find(tmp, k, set_pool, off, len, bucket, nbuckets);
+            if (bucket[h])
+            {
+                trans[s * nc + c] = bucket[h] - 1;
+                continue;
+            }
+
+            /** new state */
+            n = sm->nstates++;
+            if (n >= SRCH_MAX_STATES)
+            {
+                error("search machine too large, simplify the config\n");
+            }
+            if (sm->nstates > states_size)
+            {
+                states_size *= 2;
+                off       = realloc(off, states_size * sizeof (uint32_t));
+                len       = realloc(len, states_size * sizeof (uint32_t));
+                trans     = realloc(trans, 
+                                states_size * nc * sizeof (uint32_t));
+                if (off == NULL || len == NULL || trans == NULL)
+                {
+                    error("can't allocate memory for search machine\n");
+                }
+            }
+            while (pool_len + k > pool_size)
+            {
+                pool_size *= 2;
+                set_pool = realloc(set_pool, pool_size * sizeof (uint32_t));
+                if (set_pool == NULL)
+                {
+                    error("can't allocate memory for search machine\n");
+                }
+            }
+            memcpy(&set_pool[pool_len], tmp, k * sizeof (uint32_t));
+            off[n]    = pool_len;
+            len[n]    = k;
+            pool_len += k;
+            bucket[h] = n + 1;
+            trans[s * nc + c] = n;
+
+            /** keep the lookup table at most half full */
+            if (sm->nstates * 2 > nbuckets)
             {
-                srch_node_t *node = ptr->node->data.table[c];
-                switch (node->nodetype)
+                free(bucket);
+                nbuckets *= 2;
+                bucket    = ecalloc(nbuckets, sizeof (uint32_t));
+                for (n = 0; n < sm->nstates; n++)
                 {
-                    case TABLE:
-                        ptr->node = node;
-                        break;
-                    case COMPLETE:
-                        add_result(results, &node->data.fileid, node->spectype,
-                            offset);
-                        remv_srchptr(srchptr_list, ptr);
-                        break;
-                    default:
-                        error("Unknown node type");
-                        break;
+                    for (h = 2166136261U, j = 0; j < len[n]; j++)
+                    {
+                        h = (h ^ set_pool[off[n] + j]) * 16777619U;
+                    }
+                    for (h &= nbuckets - 1; bucket[h]; 
+                         h = (h + 1) & (nbuckets - 1));
+                    bucket[h] = n + 1;
                 }
             }
+        }
+    }
+
+    /*
+     * Find each state a base: the state for its set less one node goes
+     * everywhere it does except where that node goes somewhere, so if
+     * one of those (or the start state) differs on only a few classes
+     * the state can be stored as just the differences.
+     */
+    base = emalloc(sm->nstates * sizeof (uint32_t));
+    base[0] = SRCH_DENSE;
+    for (s = 1; s < sm->nstates; s++)
+    {
+        for (best = SRCH_SPARSE_MAX + 1, d = 0; d <= len[s]; d++)
+        {
+            if (d == len[s])
+            {
+                n = SRCH_STATE_START;
+            }
             else
             {
-                remv_srchptr(srchptr_list, ptr);
+                memcpy(tmp, &set_pool[off[s]], d * sizeof (uint32_t));
+                memcpy(tmp + d, &set_pool[off[s] + d + 1], 
+                    (len[s] - d - 1) * sizeof (uint32_t));
+                h = search_find(tmp, len[s] - 1, set_pool, off, len, bucket,
+                        nbuckets);
+                if (bucket[h] == 0)
+                {
+                    continue;
+                }
+                n = bucket[h] - 1;
+            }
+            for (diff = 0, c = 0; c < nc && diff < best; c++)
+            {
+                if (trans[s * nc + c] != trans[n * nc + c])
+                {
+                    diff++;
+                }
+            }
+            if (diff < best)
+            {
+                best    = diff;
+                base[s] = n;
             }
         }
+        if (best > SRCH_SPARSE_MAX)
+        {
+            base[s] = SRCH_DENSE;
+        }
     }
 
-    /** now see if we want to start a new thread (i.e. a new potential match) */
-    if (tree->data.table[c])
+    /** every COMPLETE node in a state's set is a match emitted on entry */
+    sm->mfirst = ecalloc(sm->nstates, sizeof (uint32_t));
+    sm->mcount = ecalloc(sm->nstates, sizeof (uint32_t));
+    for (s = 0; s < sm->nstates; s++)
     {
-        node = tree->data.table[c];
-        switch (node->nodetype)
+        for (j = 0; j < len[s]; j++)
         {
-            case TABLE:
-                /** this should be 99.99% of them */
-                add_srchptr(srchptr_list, node);
-                break;
-            case COMPLETE:
-                /** In the unlikely event of a one byte header */
-                add_result(results, &node->data.fileid, node->spectype, offset);
-                break;
-            default:
-                error("Unknown node type");
-                break;     
+            if (nodes[set_pool[off[s] + j] - 1]->nodetype == COMPLETE)
+            {
+                sm->nmatches++;
+            }
         }
     }
+    sm->match = ecalloc(sm->nmatches ? sm->nmatches : 1, 
+                    sizeof (srch_match_t));
+    for (k = 0, s = 0; s < sm->nstates; s++)
+    {
+        sm->mfirst[s] = k;
+        for (j = 0; j < len[s]; j++)
+        {
+            node = nodes[set_pool[off[s] + j] - 1];
+            if (node->nodetype == COMPLETE)
+            {
+                sm->match[k].fileid   = node->data.fileid;
+                sm->match[k].spectype = node->spectype;
+                k++;
+            }
+        }
+        sm->mcount[s] = k - sm->mfirst[s];
+    }
+
+    /** the start state's row says which bytes can begin a match */
+    for (c = 0; c < 256; c++)
+    {
+        sm->lead[c] = trans[sm->class[c]] != SRCH_STATE_START;
+    }
+    search_pack(sm, trans, base);
+    search_prefilter_init(sm);
+
+    /** the parse tree is no longer needed */
+    for (j = 0; j < nnodes; j++)
+    {
+        free(nodes[j]);
+    }
+    *srch_tree = NULL;
+
+    free(nodes);
+    free(tmp);
+    free(off);
+    free(len);
+    free(set_pool);
+    free(bucket);
+    free(trans);
+    free(base);
+
+    return (sm);
 }
 
+/*
+ * Lay out the final machine: states renumbered so the dense ones come
+ * first, those get rows padded out to a power of 2 columns and the rest
+ * get their exceptions listed.  Transitions into states that emit matches
+ * are flagged so search() can skip looking them up.
+ */
 static void
-update_search2(srch_node_t *tree, srchptr_list_t **srchptr_list, 
-srch_results_t **results, uint8_t c, int offset)
+search_pack(srch_machine_t *sm, uint32_t *trans, uint32_t *base)
 {
-    if (*srchptr_list)
-    {   /** start by updating existing threads */
-        srchptr_list_t *ptr;
-        srchptr_list_t *nxt = NULL, *prv = NULL;
-                
-        for (ptr = *srchptr_list; ptr; prv = ptr, nxt = ptr->next, ptr = nxt)
-        {
-            if (ptr->node->data.table[c])
+    uint32_t s, c, t, nc, *num, *mfirst, *mcount;
+    srch_sparse_t *sp;
+
+    nc  = sm->nclasses;
+    num = emalloc(sm->nstates * sizeof (uint32_t));
+
+    for (sm->shift = 0; (1U << sm->shift) < nc; sm->shift++);
+
+    /*
+     * States are numbered breadth first, so the low ones are the shallow
+     * ones where traffic spends nearly all its time outside the start
+     * state.  They get full rows too, for as long as those fit the budget.
+     */
+    for (t = 0, s = 0; s < sm->nstates; s++)
+    {
+        if (base[s] == SRCH_DENSE)
+        {
+            t++;
+        }
+    }
+    for (s = 0; s < sm->nstates && 
+         ((size_t)(t + 1) << sm->shift) * sizeof (uint32_t) <= SRCH_DENSE_MAX;
+         s++)
+    {
+        if (base[s] != SRCH_DENSE)
+        {
+            base[s] = SRCH_DENSE;
+            t++;
+        }
+    }
+    for (sm->ndense = 0, s = 0; s < sm->nstates; s++)
+    {
+        if (base[s] == SRCH_DENSE)
+        {
+            num[s] = sm->ndense++;
+        }
+    }
+    for (t = sm->ndense, s = 0; s < sm->nstates; s++)
+    {
+        if (base[s] != SRCH_DENSE)
+        {
+            num[s] = t++;
+        }
+    }
+
+    sm->trans  = ecalloc((size_t)sm->ndense << sm->shift, sizeof (uint32_t));
+    sm->sparse = ecalloc(sm->nstates - sm->ndense + 1, 
+                     sizeof (srch_sparse_t));
+    mfirst     = emalloc(sm->nstates * sizeof (uint32_t));
+    mcount     = emalloc(sm->nstates * sizeof (uint32_t));
+
+    for (s = 0; s < sm->nstates; s++)
+    {
+        mfirst[num[s]] = sm->mfirst[s];
+        mcount[num[s]] = sm->mcount[s];
+        if (base[s] == SRCH_DENSE)
+        {
+            for (c = 0; c < nc; c++)
             {
-                srch_node_t *node = ptr->node->data.table[c];
-                switch (node->nodetype)
-                {
-                    case TABLE:
-                        ptr->node = node;
-                        break;
-                    case COMPLETE:
-                        add_result(results, &node->data.fileid, node->spectype,
-                            offset);
-                    
-                        /* remove thread from list */
-                        if (prv)
-                        {
-                            prv->next = nxt;
-                        }
-                        else
-                        {
-                            *srchptr_list = nxt;
-                        }
-                        if (nxt)
-                        {
-                            nxt->prev = prv;
-                        }
-                        free(ptr);
-                        break;
-                    default:
-                        error("Unknown node type");
-                        break;
-                }
+                t = trans[s * nc + c];
+                sm->trans[((size_t)num[s] << sm->shift) | c] = num[t] | 
+                    (sm->mcount[t] ? SRCH_STATE_MATCH : 0);
             }
-            else
-            { /*remove thread from list */
-                if (prv)
-                {
-                    prv->next = nxt;
-                }
-                else
-                {
-                    *srchptr_list = nxt;
-                }
-                if (nxt)
-                {
-                    nxt->prev = prv;
-                }
-                free(ptr);
+            continue;
+        }
+        sp       = &sm->sparse[num[s] - sm->ndense];
+        sp->base = num[base[s]];
+        for (c = 0; c < nc; c++)
+        {
+            t = trans[s * nc + c];
+            if (t != trans[base[s] * nc + c])
+            {
+                sp->class        |= (uint64_t)c << (sp->n * 8);
+                sp->next[sp->n++] = num[t] | 
+                    (sm->mcount[t] ? SRCH_STATE_MATCH : 0);
             }
         }
     }
 
-    /* now see if we want to start a new thread (i.e. a new potential match) */
-    if (tree->data.table[c])
+    free(sm->mfirst);
+    free(sm->mcount);
+    sm->mfirst = mfirst;
+    sm->mcount = mcount;
+    free(num);
+
+    sm->size = sizeof (srch_machine_t) + 
+               ((size_t)sm->ndense << sm->shift) * sizeof (uint32_t) +
+               (sm->nstates - sm->ndense) * sizeof (srch_sparse_t) +
+               sm->nstates * 2 * sizeof (uint32_t) + 
+               sm->nmatches * sizeof (srch_match_t);
+}
+
+/** where all the memory went, for the debug minded */
+void
+search_dump(srch_machine_t *sm, FILE *fp)
+{
+    fprintf(fp, "[DEBUG] search machine: %u states (%u dense, %u sparse), "
+        "%u byte classes\n", sm->nstates, sm->ndense, 
+        sm->nstates - sm->ndense, sm->nclasses);
+    fprintf(fp, "[DEBUG] dense rows: %zu bytes (%u columns), sparse states: "
+        "%zu bytes\n", ((size_t)sm->ndense << sm->shift) * sizeof (uint32_t), 
+        1U << sm->shift, (sm->nstates - sm->ndense) * sizeof (srch_sparse_t));
+    fprintf(fp, "[DEBUG] match index: %zu bytes, match table: %zu bytes "
+        "(%u matches)\n", sm->nstates * 2 * sizeof (uint32_t), 
+        sm->nmatches * sizeof (srch_match_t), sm->nmatches);
+    fprintf(fp, "[DEBUG] total: %zu bytes, %zu as a flat table\n", sm->size, 
+        (size_t)sm->nstates * 256 * sizeof (uint32_t));
+}
+
+void
+search_free(srch_machine_t *sm)
+{
+    if (sm == NULL)
+    {
+        return;
+    }
+    if (sm->map)
     {
-        srch_node_t *node = tree->data.table[c];
-        srchptr_list_t *ptr;
+        /** the tables all live in the mapping */
+        munmap(sm->map, sm->maplen);
+        free(sm);
+        return;
+    }
+    free(sm->trans);
+    free(sm->sparse);
+    free(sm->mfirst);
+    free(sm->mcount);
+    free(sm->match);
+    free(sm);
+}
 
-        switch (node->nodetype)
+/*
+ * Give every HEADER a stream depth and a direction: its own from the
+ * config file if it has one, the global one otherwise.  Returns how deep
+ * we ever have to look for any of them, past that a session can stop
+ * being searched once it's not extracting anything.  0 means forever.
+ */
+u_long
+search_depth(srch_machine_t *sm, srch_depth_t *rules, u_long global,
+uint8_t dir)
+{
+    uint32_t k;
+    u_long max;
+    int forever, depth_set, dir_set;
+    srch_depth_t *d;
+
+    for (max = 0, forever = 0, k = 0; k < sm->nmatches; k++)
+    {
+        sm->match[k].fileid.depth = global;
+        sm->match[k].fileid.dir   = dir;
+        for (depth_set = dir_set = 0, d = rules; d; d = d->next)
         {
-        case TABLE:            /* this should be 99.99% of them */
-            if (*srchptr_list == NULL)
+            if (strcmp(d->ext, sm->match[k].fileid.ext))
             {
-                *srchptr_list = ecalloc(1, sizeof **srchptr_list);
-                (*srchptr_list)->next = NULL;
-                (*srchptr_list)->prev = NULL;
-                ptr = *srchptr_list;
+                continue;
             }
-            else
+            if (d->dir && !dir_set)
             {
-                for (ptr = *srchptr_list; ptr->next; ptr = ptr->next);
-                ptr->next = emalloc(sizeof *ptr->next);
-                ptr->next->prev = ptr;
-                ptr = ptr->next;
-                ptr->next = NULL;
+                sm->match[k].fileid.dir = d->dir;
+                dir_set = 1;
             }
-            ptr->node = node;
-            break;
-        case COMPLETE:       /* In the unlikely event of a one byte header */
-            add_result(results, &node->data.fileid, node->spectype, offset);
-            break;
-        default:
-            error("Unknown node type");
-            break;     
+            else if (d->dir == 0 && !depth_set)
+            {
+                sm->match[k].fileid.depth = d->depth;
+                depth_set = 1;
+            }
+        }
+        if (sm->match[k].spectype != HEADER)
+        {
+            continue;
+        }
+        if (sm->match[k].fileid.depth == 0)
+        {
+            forever = 1;
         }
+        max = MAX(max, sm->match[k].fileid.depth);
     }
+    return (forever ? 0 : max);
 }
 
-/* Add a result to a results list, allocating as needed */
-static void 
-add_result(srch_results_t **results, fileid_t *fileid, spectype_t spectype, 
-int offset)
+/** which directions of a connection any HEADER can be found in */
+uint8_t
+search_dirs(srch_machine_t *sm)
 {
-    srch_results_t **ptr, *prev = NULL;
-
-    /* find the last element in the list, for setting prev */
-    for (ptr = results; *ptr && (*ptr)->next; ptr = &(*ptr)->next);
+    uint32_t k;
+    uint8_t dirs;
 
-    if (*ptr)
+    for (dirs = 0, k = 0; k < sm->nmatches; k++)
     {
-        prev = *ptr;
-        ptr = &(*ptr)->next;
+        if (sm->match[k].spectype == HEADER)
+        {
+            dirs |= sm->match[k].fileid.dir;
+        }
     }
-        
-    *ptr = emalloc(sizeof **ptr);
-    (*ptr)->next = NULL;
-    (*ptr)->prev = NULL;
-    (*ptr)->fileid = fileid;
-    (*ptr)->spectype = spectype;
-    (*ptr)->offset.start = offset - (fileid->len - 1);
-    (*ptr)->offset.end = offset;
+    return (dirs);
 }
 
+/*
+ * Most payload bytes can't start a match.  While a session sits in the 
+ * start state we hop straight to the next byte that leaves it, 16 or 32 
+ * bytes at a time when the set of such bytes is small enough to compare 
+ * against directly.
+ */
 void
-free_results_list(srch_results_t **results)
+search_prefilter_init(srch_machine_t *sm)
+{
+    int c;
+
+    for (sm->nfirst = 0, c = 0; c < 256; c++)
+    {
+        if (sm->lead[c])
+        {
+            if (sm->nfirst < SRCH_PREFILTER_MAX)
+            {
+                sm->first[sm->nfirst] = c;
+            }
+            sm->nfirst++;
+        }
+    }
+
+    sm->skip      = skip_scalar;
+    sm->skip_name = "scalar";
+#if (NFEX_SIMD)
+    if (sm->nfirst > 0 && sm->nfirst <= SRCH_PREFILTER_MAX)
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            sm->skip      = skip_avx2;
+            sm->skip_name = "avx2";
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+            sm->skip      = skip_sse2;
+            sm->skip_name = "sse2";
+        }
+    }
+#endif /** NFEX_SIMD */
+}
+
+/** return the offset of the next byte in buf that leaves the start state */
+static size_t
+skip_scalar(srch_machine_t *sm, uint8_t *buf, size_t i, size_t len)
+{
+    while (i < len && sm->lead[buf[i]] == 0)
+    {
+        i++;
+    }
+    return (i);
+}
+
+#if (NFEX_SIMD)
+__attribute__((target("sse2")))
+static size_t
+skip_sse2(srch_machine_t *sm, uint8_t *buf, size_t i, size_t len)
+{
+    __m128i v, hit;
+    uint32_t j;
+    int mask;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        v   = _mm_loadu_si128((__m128i *)(buf + i));
+        hit = _mm_setzero_si128();
+        for (j = 0; j < sm->nfirst; j++)
+        {
+            hit = _mm_or_si128(hit, 
+                    _mm_cmpeq_epi8(v, _mm_set1_epi8(sm->first[j])));
+        }
+        mask = _mm_movemask_epi8(hit);
+        if (mask)
+        {
+            return (i + __builtin_ctz(mask));
+        }
+    }
+    /** less than a vector left */
+    return (skip_scalar(sm, buf, i, len));
+}
+
+__attribute__((target("avx2")))
+static size_t
+skip_avx2(srch_machine_t *sm, uint8_t *buf, size_t i, size_t len)
+{
+    __m256i v, hit;
+    uint32_t j, mask;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        v   = _mm256_loadu_si256((__m256i *)(buf + i));
+        hit = _mm256_setzero_si256();
+        for (j = 0; j < sm->nfirst; j++)
+        {
+            hit = _mm256_or_si256(hit, 
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(sm->first[j])));
+        }
+        mask = (uint32_t)_mm256_movemask_epi8(hit);
+        if (mask)
+        {
+            return (i + __builtin_ctz(mask));
+        }
+    }
+    /** less than a vector left */
+    return (skip_sse2(sm, buf, i, len));
+}
+#endif /** NFEX_SIMD */
+
+/*
+ * one step through the machine: a sparse state that doesn't mention this
+ * byte sends us to its base, which sooner or later is a dense one.  The
+ * exceptions are checked all at once, a byte of the word for each, and
+ * the lowest zero byte of v is the first one that matches.
+ */
+static inline uint32_t
+search_next(srch_machine_t *sm, uint32_t s, uint8_t c)
 {
-    srch_results_t *rptr, *nxt;
+    srch_sparse_t *sp;
+    uint64_t v, z;
+    uint32_t class;
 
-    for (rptr = *results; rptr; rptr = nxt)
+    class = sm->class[c];
+    while (s >= sm->ndense)
     {
-        nxt = rptr->next;
-        free(rptr);
+        sp = &sm->sparse[s - sm->ndense];
+        v  = sp->class ^ (class * 0x0101010101010101ULL);
+        z  = (v - 0x0101010101010101ULL) & ~v & 0x8080808080808080ULL;
+        z &= (1ULL << (sp->n * 8)) - 1;
+        if (z)
+        {
+            return (sp->next[__builtin_ctzll(z) >> 3]);
+        }
+        s = sp->base;
+    }
+    return (sm->trans[((size_t)s << sm->shift) | class]);
+}
+
+/*
+ * the overall search interface.  You call this bad boy and give it a
+ * pointer to your data buffer (i.e. a packet) and the session's current
+ * state, which is updated on the way out.  Results come out of the arena
+ * and are good until the caller resets it.
+ */
+srch_results_t *
+search(srch_machine_t *sm, arena_t *arena, uint32_t *state, uint8_t *buf, 
+size_t len)
+{
+    srch_results_t *p;
+    uint32_t s, k;
+    size_t i;
+
+    /** one table lookup for every byte of data in the payload */
+    for (p = NULL, s = *state, i = 0; i < len; i++)
+    {
+        if ((s & SRCH_STATE_MASK) == SRCH_STATE_START)
+        {
+            /** nothing in flight, skip to the next candidate */
+            i = sm->skip(sm, buf, i, len);
+            if (i == len)
+            {
+                break;
+            }
+        }
+        s = search_next(sm, s & SRCH_STATE_MASK, buf[i]);
+        if (s & SRCH_STATE_MATCH)
+        {
+            for (k = sm->mfirst[s & SRCH_STATE_MASK]; 
+                 k < sm->mfirst[s & SRCH_STATE_MASK] + 
+                     sm->mcount[s & SRCH_STATE_MASK]; k++)
+            {
+                add_result(arena, &p, &sm->match[k].fileid, sm->match[k].spectype, i);
+            }
+        }
+    }
+    *state = s & SRCH_STATE_MASK;
+
+    return (p);
+}
+
+/* Add a result to a results list, allocating out of the arena */
+static void 
+add_result(arena_t *arena, srch_results_t **results, fileid_t *fileid, 
+spectype_t spectype, int offset)
+{
+    srch_results_t **ptr, *r;
+
+    /* find the end of the list */
+    for (ptr = results; *ptr; ptr = &(*ptr)->next);
+
+    r = arena_get(arena, sizeof (srch_results_t));
+    if (r == NULL)
+    {
+        return;
     }
-    *results = NULL;
+    r->next = NULL;
+    r->prev = NULL;
+    r->fileid = fileid;
+    r->spectype = spectype;
+    r->offset.start = offset - (fileid->len - 1);
+    r->offset.end = offset;
+    *ptr = r;
 }
 
 /* EOF */
@@ -0,0 +1,304 @@
+/*
+ * store.c - content addressed extraction store
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include "nfex.h"
+#include "store.h"
+#include <dirent.h>
+
+static store_obj_t *store_slot(store_obj_t *, uint32_t, const uint8_t *,
+const char *);
+static int store_insert(store_t *, const uint8_t *, const char *, uint8_t);
+static int store_grow(store_t *);
+static void store_remove(store_t *, store_obj_t *);
+static int store_parse(uint8_t *, const char **, const char *);
+static int store_unhex(uint8_t *, const char *);
+
+/*
+ * Set up the table and fill it in from whatever objects are already in
+ * dir ("" for the current directory).
+ */
+int
+store_init(store_t *st, const char *dir, char *errbuf)
+{
+    struct dirent *de;
+    uint8_t sha256[DIGEST_SHA256_LEN];
+    const char *ext;
+    DIR *d;
+
+    memset(st, 0, sizeof (store_t));
+    pthread_mutex_init(&st->lock, NULL);
+    st->size  = NFEX_STORE_SLOTS;
+    st->slots = calloc(st->size, sizeof (store_obj_t));
+    if (st->slots == NULL)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "calloc(): %s", strerror(errno));
+        return (-1);
+    }
+
+    d = opendir(dir[0] ? dir : ".");
+    if (d == NULL)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "can't read store %s: %s",
+            dir[0] ? dir : ".", strerror(errno));
+        return (-1);
+    }
+    while ((de = readdir(d)))
+    {
+        if (store_parse(sha256, &ext, de->d_name) == 1)
+        {
+            store_insert(st, sha256, ext, STORE_HAVE);
+        }
+    }
+    closedir(d);
+    return (1);
+}
+
+/*
+ * Note an object, returns 1 if it's to be written and linked in and 0 if
+ * we already have it.  One that's new to us is pending until store_done()
+ * hears how its link went, and until then any copy is written out too.
+ * Once the table's full everything's new and the link sorts it out.
+ */
+int
+store_add(store_t *st, const uint8_t *sha256, const char *ext)
+{
+    store_obj_t *o;
+    int n;
+
+    pthread_mutex_lock(&st->lock);
+    o = store_slot(st->slots, st->size, sha256, ext);
+    if (o->ext[0])
+    {
+        n = o->state == STORE_PENDING;
+    }
+    else
+    {
+        store_insert(st, sha256, ext, STORE_PENDING);
+        n = 1;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return (n);
+}
+
+/*
+ * The writer is done with the object at path: ok if it's linked in (by us
+ * or already there), otherwise it's forgotten and the next copy has a go.
+ * st may be NULL and path "", when there's nobody or nothing to tell.
+ */
+void
+store_done(store_t *st, const char *path, int ok)
+{
+    uint8_t sha256[DIGEST_SHA256_LEN];
+    store_obj_t *o;
+    const char *ext, *name;
+
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    if (st == NULL || store_parse(sha256, &ext, name) == -1)
+    {
+        return;
+    }
+    pthread_mutex_lock(&st->lock);
+    o = store_slot(st->slots, st->size, sha256, ext);
+    if (o->ext[0] == '\0')
+    {
+        /** a copy failed after this one got it in, or we were full */
+        if (ok)
+        {
+            store_insert(st, sha256, ext, STORE_HAVE);
+        }
+    }
+    else if (ok)
+    {
+        o->state = STORE_HAVE;
+    }
+    else if (o->state == STORE_PENDING)
+    {
+        store_remove(st, o);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+/** where the object lives: dir/sha256.ext */
+char *
+store_name(char *buf, size_t len, const char *dir, const uint8_t *sha256,
+const char *ext)
+{
+    static const char hex[] = "0123456789abcdef";
+    char s[DIGEST_SHA256_LEN * 2 + 1];
+    int i;
+
+    for (i = 0; i < DIGEST_SHA256_LEN; i++)
+    {
+        s[i * 2]     = hex[sha256[i] >> 4];
+        s[i * 2 + 1] = hex[sha256[i] & 0x0f];
+    }
+    s[i * 2] = '\0';
+    snprintf(buf, len, "%s%s.%s", dir, s, ext);
+    return (buf);
+}
+
+void
+store_destroy(store_t *st)
+{
+    if (st->slots)
+    {
+        free(st->slots);
+        st->slots = NULL;
+        pthread_mutex_destroy(&st->lock);
+    }
+}
+
+/** the slot that holds sha256.ext, or the empty one it would go in */
+static store_obj_t *
+store_slot(store_obj_t *slots, uint32_t size, const uint8_t *sha256,
+const char *ext)
+{
+    store_obj_t *o;
+    uint32_t i;
+
+    /** the digest is as good a hash as there is */
+    memcpy(&i, sha256, sizeof (i));
+    for (;; i++)
+    {
+        o = &slots[i & (size - 1)];
+        if (o->ext[0] == '\0' ||
+            (memcmp(o->sha256, sha256, DIGEST_SHA256_LEN) == 0 &&
+            strncmp(o->ext, ext, SRCH_EXT_MAX - 1) == 0))
+        {
+            return (o);
+        }
+    }
+}
+
+/** put in sha256.ext, which isn't there, -1 once there's no more room */
+static int
+store_insert(store_t *st, const uint8_t *sha256, const char *ext,
+uint8_t state)
+{
+    store_obj_t *o;
+
+    if ((st->count + 1) * 2 > st->size && store_grow(st) == -1)
+    {
+        return (-1);
+    }
+    o = store_slot(st->slots, st->size, sha256, ext);
+    memcpy(o->sha256, sha256, DIGEST_SHA256_LEN);
+    strncpy(o->ext, ext, SRCH_EXT_MAX - 1);
+    o->state = state;
+    st->count++;
+    return (1);
+}
+
+/** twice the slots, -1 if we're at the cap or out of memory */
+static int
+store_grow(store_t *st)
+{
+    store_obj_t *slots;
+    uint32_t i;
+
+    if (st->size >= NFEX_STORE_MAX)
+    {
+        return (-1);
+    }
+    slots = calloc(st->size * 2, sizeof (store_obj_t));
+    if (slots == NULL)
+    {
+        return (-1);
+    }
+    for (i = 0; i < st->size; i++)
+    {
+        if (st->slots[i].ext[0])
+        {
+            *store_slot(slots, st->size * 2, st->slots[i].sha256,
+                st->slots[i].ext) = st->slots[i];
+        }
+    }
+    free(st->slots);
+    st->slots = slots;
+    st->size *= 2;
+    return (1);
+}
+
+/*
+ * Empty out slot o.  Anything further along the run that would no longer
+ * be found from its home slot moves back into the hole.
+ */
+static void
+store_remove(store_t *st, store_obj_t *o)
+{
+    uint32_t i, j, home, mask;
+
+    mask = st->size - 1;
+    for (i = j = o - st->slots; ; )
+    {
+        st->slots[i].ext[0] = '\0';
+        for (;;)
+        {
+            j = (j + 1) & mask;
+            if (st->slots[j].ext[0] == '\0')
+            {
+                st->count--;
+                return;
+            }
+            memcpy(&home, st->slots[j].sha256, sizeof (home));
+            home &= mask;
+
+            /** the hole's between its home and here, it moves up */
+            if ((i < j && (home <= i || home > j)) ||
+                (i > j && home <= i && home > j))
+            {
+                break;
+            }
+        }
+        st->slots[i] = st->slots[j];
+        i = j;
+    }
+}
+
+/** sha256.ext and nothing else, temporaries are never objects */
+static int
+store_parse(uint8_t *sha256, const char **ext, const char *name)
+{
+    *ext = name + DIGEST_SHA256_LEN * 2;
+    if (strlen(name) <= DIGEST_SHA256_LEN * 2 + 1 || **ext != '.' ||
+        strlen(*ext + 1) >= SRCH_EXT_MAX || strchr(*ext + 1, '.') ||
+        store_unhex(sha256, name) == -1)
+    {
+        return (-1);
+    }
+    (*ext)++;
+    return (1);
+}
+
+/** 64 lowercase hex digits back to a digest */
+static int
+store_unhex(uint8_t *sha256, const char *s)
+{
+    int i, hi, lo;
+    const char *h;
+
+    for (i = 0; i < DIGEST_SHA256_LEN * 2; i++)
+    {
+        if (!((s[i] >= '0' && s[i] <= '9') || (s[i] >= 'a' && s[i] <= 'f')))
+        {
+            return (-1);
+        }
+    }
+    for (i = 0; i < DIGEST_SHA256_LEN; i++)
+    {
+        h  = s + i * 2;
+        hi = h[0] <= '9' ? h[0] - '0' : h[0] - 'a' + 10;
+        lo = h[1] <= '9' ? h[1] - '0' : h[1] - 'a' + 10;
+        sha256[i] = hi << 4 | lo;
+    }
+    return (1);
+}
+
+/** EOF */
@@ -0,0 +1,340 @@
+/*
+ * tpacket.c - Linux AF_PACKET TPACKET_V3 capture ring
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include "nfex.h"
+#include "tpacket.h"
+
+#if (HAVE_TPACKET3)
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <sys/ioctl.h>
+#include <linux/filter.h>
+
+/*
+ * Open a TPACKET_V3 ring of ring_mb megabytes on device.  If fanout is not
+ * -1 the socket joins that fanout group and the kernel splits traffic
+ * between the members by flow hash, so several of these (in one process
+ * or several) can share an interface.
+ */
+int
+tpacket_open(tpacket_t *tp, char *device, int ring_mb, int fanout,
+struct bpf_program *filter, char *errbuf)
+{
+    int v;
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    struct packet_mreq mr;
+    struct sock_fprog prog;
+
+    memset(tp, 0, sizeof (tpacket_t));
+    tp->fanout = fanout;
+
+    /** no protocol yet, so nothing arrives until we're set up and bound */
+    tp->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (tp->fd == -1)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "socket(): %s", strerror(errno));
+        return (-1);
+    }
+
+    v = TPACKET_V3;
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_VERSION, &v, sizeof (v)) == -1)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "PACKET_VERSION: %s",
+            strerror(errno));
+        goto err;
+    }
+
+    tp->block_size = NFEX_TP_BLOCK_SIZE;
+    tp->nblocks    = ((uint64_t)ring_mb << 20) / tp->block_size;
+    if (tp->nblocks < 2)
+    {
+        tp->nblocks = 2;
+    }
+    memset(&req, 0, sizeof (req));
+    req.tp_block_size       = tp->block_size;
+    req.tp_block_nr         = tp->nblocks;
+    req.tp_frame_size       = NFEX_TP_FRAME_SIZE;
+    req.tp_frame_nr         = (tp->block_size / NFEX_TP_FRAME_SIZE) *
+                              tp->nblocks;
+    req.tp_retire_blk_tov   = NFEX_TP_BLOCK_TOV;
+    req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_RX_RING, &req,
+        sizeof (req)) == -1)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "PACKET_RX_RING: %s",
+            strerror(errno));
+        goto err;
+    }
+
+    tp->map_len = (size_t)tp->block_size * tp->nblocks;
+    tp->map = mmap(NULL, tp->map_len, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, tp->fd, 0);
+    if (tp->map == MAP_FAILED)
+    {
+        tp->map = NULL;
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "mmap(): %s", strerror(errno));
+        goto err;
+    }
+
+    /** the pcap filter program runs in the kernel as a socket filter */
+    if (filter && filter->bf_len)
+    {
+        prog.len    = filter->bf_len;
+        prog.filter = (struct sock_filter *)filter->bf_insns;
+        if (setsockopt(tp->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+            sizeof (prog)) == -1)
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "SO_ATTACH_FILTER: %s",
+                strerror(errno));
+            goto err;
+        }
+    }
+
+    memset(&sll, 0, sizeof (sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex  = if_nametoindex(device);
+    if (sll.sll_ifindex == 0)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "no such device %s", device);
+        goto err;
+    }
+    if (bind(tp->fd, (struct sockaddr *)&sll, sizeof (sll)) == -1)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "bind(): %s", strerror(errno));
+        goto err;
+    }
+
+    /** promiscuous for as long as the socket is open */
+    memset(&mr, 0, sizeof (mr));
+    mr.mr_ifindex = sll.sll_ifindex;
+    mr.mr_type    = PACKET_MR_PROMISC;
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr,
+        sizeof (mr)) == -1)
+    {
+        /** nonfatal */
+        fprintf(stderr, "can't set %s promiscuous: %s\n", device,
+            strerror(errno));
+    }
+
+    if (fanout != -1)
+    {
+        /** symmetric flow hash, both directions go to the same member */
+        v = (fanout & 0xffff) |
+            ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+        if (setsockopt(tp->fd, SOL_PACKET, PACKET_FANOUT, &v,
+            sizeof (v)) == -1)
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "PACKET_FANOUT: %s",
+                strerror(errno));
+            goto err;
+        }
+    }
+    return (1);
+
+err:
+    tpacket_close(tp);
+    return (-1);
+}
+
+/*
+ * Hand every packet in the blocks the kernel has given us to callback,
+ * straight out of the ring, then done (if there is one) before each block
+ * goes back.  Returns the number of packets.
+ */
+/*
+ * What the ring on device will hand us, as a DLT.  A SOCK_RAW socket gets
+ * the device's own header, which is Ethernet or, for the layer 3 devices
+ * (tun, ppp, ip tunnels), nothing at all; anything else we refuse.
+ */
+int
+tpacket_datalink(char *device, char *errbuf)
+{
+    struct ifreq ifr;
+    int fd, n;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "socket(): %s", strerror(errno));
+        return (-1);
+    }
+    memset(&ifr, 0, sizeof (ifr));
+    strncpy(ifr.ifr_name, device, sizeof (ifr.ifr_name) - 1);
+    n = ioctl(fd, SIOCGIFHWADDR, &ifr);
+    close(fd);
+    if (n == -1)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "SIOCGIFHWADDR %s: %s", device,
+            strerror(errno));
+        return (-1);
+    }
+
+    switch (ifr.ifr_hwaddr.sa_family)
+    {
+        case ARPHRD_ETHER:
+        case ARPHRD_LOOPBACK:
+            return (DLT_EN10MB);
+        case ARPHRD_NONE:
+        case ARPHRD_PPP:
+        case ARPHRD_TUNNEL:
+        case ARPHRD_TUNNEL6:
+        case ARPHRD_SIT:
+#ifdef ARPHRD_RAWIP
+        case ARPHRD_RAWIP:
+#endif
+            return (DLT_RAW);
+        default:
+            snprintf(errbuf, PCAP_ERRBUF_SIZE,
+                "%s: hardware type %d isn't supported with -T", device,
+                ifr.ifr_hwaddr.sa_family);
+            return (-1);
+    }
+}
+
+int
+tpacket_dispatch(tpacket_t *tp, pcap_handler callback, void (*done)(u_char *),
+u_char *user)
+{
+    uint32_t i, j, n;
+    struct pcap_pkthdr h;
+    struct tpacket3_hdr *ph;
+    struct tpacket_block_desc *bd;
+
+    for (j = 0, n = 0; j < tp->nblocks; j++)
+    {
+        bd = (struct tpacket_block_desc *)(tp->map +
+            (size_t)tp->cur * tp->block_size);
+        if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+            TP_STATUS_USER) == 0)
+        {
+            break;
+        }
+
+        ph = (struct tpacket3_hdr *)((uint8_t *)bd +
+            bd->hdr.bh1.offset_to_first_pkt);
+        for (i = 0; i < bd->hdr.bh1.num_pkts; i++)
+        {
+            h.ts.tv_sec  = ph->tp_sec;
+            h.ts.tv_usec = ph->tp_nsec / 1000;
+            h.caplen     = ph->tp_snaplen;
+            h.len        = ph->tp_len;
+            callback(user, &h, (u_char *)ph + ph->tp_mac);
+            ph = (struct tpacket3_hdr *)((uint8_t *)ph + ph->tp_next_offset);
+        }
+        n += bd->hdr.bh1.num_pkts;
+
+        /** the packets are only ours until the block goes back */
+        if (done)
+        {
+            done(user);
+        }
+
+        /** give the block back */
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+            __ATOMIC_RELEASE);
+        tp->cur = (tp->cur + 1) % tp->nblocks;
+    }
+    return (n);
+}
+
+/** wait up to timeout ms for a block to be handed to us */
+int
+tpacket_wait(tpacket_t *tp, int timeout)
+{
+    struct pollfd pfd;
+
+    pfd.fd      = tp->fd;
+    pfd.events  = POLLIN|POLLERR;
+    pfd.revents = 0;
+    return (poll(&pfd, 1, timeout));
+}
+
+/** pull the kernel's counters (they reset when read) into ours */
+void
+tpacket_stats(tpacket_t *tp)
+{
+    struct tpacket_stats_v3 st;
+    socklen_t len;
+
+    len = sizeof (st);
+    if (tp->fd != -1 &&
+        getsockopt(tp->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+    {
+        tp->packets += st.tp_packets;
+        tp->drops   += st.tp_drops;
+        tp->freezes += st.tp_freeze_q_cnt;
+    }
+}
+
+void
+tpacket_close(tpacket_t *tp)
+{
+    if (tp->map)
+    {
+        munmap(tp->map, tp->map_len);
+        tp->map = NULL;
+    }
+    if (tp->fd != -1)
+    {
+        close(tp->fd);
+    }
+    tp->fd = -1;
+}
+
+#else /* !HAVE_TPACKET3 */
+
+int
+tpacket_open(tpacket_t *tp, char *device, int ring_mb, int fanout,
+struct bpf_program *filter, char *errbuf)
+{
+    memset(tp, 0, sizeof (tpacket_t));
+    tp->fd = -1;
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "TPACKET_V3 not supported here");
+    return (-1);
+}
+
+int
+tpacket_datalink(char *device, char *errbuf)
+{
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "TPACKET_V3 not supported here");
+    return (-1);
+}
+
+int
+tpacket_dispatch(tpacket_t *tp, pcap_handler callback, void (*done)(u_char *),
+u_char *user)
+{
+    return (0);
+}
+
+int
+tpacket_wait(tpacket_t *tp, int timeout)
+{
+    return (-1);
+}
+
+void
+tpacket_stats(tpacket_t *tp)
+{
+}
+
+void
+tpacket_close(tpacket_t *tp)
+{
+}
+
+#endif /* HAVE_TPACKET3 */
+
+/** EOF */
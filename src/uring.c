@@ -0,0 +1,875 @@
+/*
+ * uring.c - io_uring extraction output
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include "nfex.h"
+#include "writer.h"
+#include "uring.h"
+
+#if (HAVE_IO_URING)
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+/** what a completion was for, packed into its user_data */
+#define URING_OP_OPEN      1
+#define URING_OP_WRITE     2
+#define URING_OP_SYNC      3
+#define URING_OP_CLOSE     4
+#define URING_OP_LINK      5
+#define URING_OP_UNLINK    6
+#define URING_NO_CHUNK     0xffff
+#define URING_UD(op, f, c, l)                                                \
+    ((uint64_t)(op) << 60 | (uint64_t)(l) << 40 | (uint64_t)(c) << 24 | (f))
+#define URING_UD_OP(d)     ((d) >> 60)
+#define URING_UD_LEN(d)    (((d) >> 40) & 0xfffff)
+#define URING_UD_CHUNK(d)  (((d) >> 24) & 0xffff)
+#define URING_UD_FILE(d)   ((d) & 0xffffff)
+
+#define URING_BUF(u, c, o) ((u)->buf + (size_t)(c) * NFEX_URING_CHUNK + (o))
+
+static void uring_complete(writer_t *, uint64_t, int32_t);
+static void uring_close_maybe(writer_t *, int);
+static void uring_unlink(writer_t *, int);
+static void uring_free_file(uring_t *, int);
+static void uring_destroy(uring_t *);
+
+static int
+uring_setup(uint32_t entries, struct io_uring_params *p)
+{
+    return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+uring_enter(int fd, uint32_t submit, uint32_t min, uint32_t flags)
+{
+    return (syscall(__NR_io_uring_enter, fd, submit, min, flags, NULL, 0));
+}
+
+static int
+uring_register(int fd, uint32_t op, void *arg, uint32_t n)
+{
+    return (syscall(__NR_io_uring_register, fd, op, arg, n));
+}
+
+/*
+ * Set up a ring for w, or say why we can't and leave w alone so the
+ * caller can fall back on the writer thread.  openat and close straight
+ * into fixed file slots need 5.15, the feature bits only go as far as
+ * telling us we're on 5.17 or later, so that's what we ask for.
+ */
+int
+uring_init(writer_t *w, char *errbuf)
+{
+    static const uint8_t ops[] = { IORING_OP_OPENAT, IORING_OP_WRITE,
+        IORING_OP_WRITE_FIXED, IORING_OP_FSYNC, IORING_OP_CLOSE,
+        IORING_OP_LINKAT, IORING_OP_UNLINKAT };
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    struct rlimit rl;
+    struct iovec iov;
+    uring_t *u;
+    int32_t *fds;
+    uint32_t i;
+
+    u = calloc(1, sizeof (uring_t));
+    if (u == NULL)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "calloc(): %s", strerror(errno));
+        return (-1);
+    }
+    u->sq_map = u->cq_map = u->sqes = u->buf = MAP_FAILED;
+
+    memset(&p, 0, sizeof (p));
+    u->fd = uring_setup(NFEX_URING_ENTRIES, &p);
+    if (u->fd == -1)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "io_uring_setup(): %s",
+            strerror(errno));
+        goto err;
+    }
+    if ((p.features & IORING_FEAT_CQE_SKIP) == 0)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "io_uring too old for fixed files");
+        goto err;
+    }
+    probe = calloc(1, sizeof (*probe) + 256 * sizeof (probe->ops[0]));
+    if (probe == NULL ||
+        uring_register(u->fd, IORING_REGISTER_PROBE, probe, 256) == -1)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "io_uring probe: %s",
+            strerror(errno));
+        free(probe);
+        goto err;
+    }
+    for (i = 0; i < sizeof (ops); i++)
+    {
+        if (ops[i] > probe->last_op ||
+            (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "io_uring op %d unsupported",
+                ops[i]);
+            free(probe);
+            goto err;
+        }
+    }
+    free(probe);
+
+    /** map the queues */
+    u->sq_maplen   = p.sq_off.array + p.sq_entries * sizeof (uint32_t);
+    u->cq_maplen   = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    u->sqes_maplen = p.sq_entries * sizeof (struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        u->sq_maplen = u->cq_maplen = MAX(u->sq_maplen, u->cq_maplen);
+    }
+    u->sq_map = mmap(NULL, u->sq_maplen, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "mmap(): %s", strerror(errno));
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        u->cq_map = u->sq_map;
+    }
+    else
+    {
+        u->cq_map = mmap(NULL, u->cq_maplen, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED)
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "mmap(): %s", strerror(errno));
+            goto err;
+        }
+    }
+    u->sqes = mmap(NULL, u->sqes_maplen, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "mmap(): %s", strerror(errno));
+        goto err;
+    }
+    u->sq_head    = (uint32_t *)((uint8_t *)u->sq_map + p.sq_off.head);
+    u->sq_tail    = (uint32_t *)((uint8_t *)u->sq_map + p.sq_off.tail);
+    u->sq_mask    = *(uint32_t *)((uint8_t *)u->sq_map + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->cq_head    = (uint32_t *)((uint8_t *)u->cq_map + p.cq_off.head);
+    u->cq_tail    = (uint32_t *)((uint8_t *)u->cq_map + p.cq_off.tail);
+    u->cq_mask    = *(uint32_t *)((uint8_t *)u->cq_map + p.cq_off.ring_mask);
+    u->cqes       = (uint8_t *)u->cq_map + p.cq_off.cqes;
+
+    /** entries go in ring order, the index array never changes */
+    for (i = 0; i < p.sq_entries; i++)
+    {
+        ((uint32_t *)((uint8_t *)u->sq_map + p.sq_off.array))[i] = i;
+    }
+
+    /** a table of empty fixed file slots, no bigger than we may open */
+    u->nfiles = NFEX_URING_FILES;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        rl.rlim_cur < u->nfiles)
+    {
+        u->nfiles = rl.rlim_cur;
+    }
+    fds = malloc(u->nfiles * sizeof (int32_t));
+    u->files = calloc(u->nfiles, sizeof (uring_file_t));
+    if (fds == NULL || u->files == NULL)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "calloc(): %s", strerror(errno));
+        free(fds);
+        goto err;
+    }
+    for (i = 0; i < u->nfiles; i++)
+    {
+        fds[i] = -1;
+        u->files[i].next_free = i + 1 < u->nfiles ? (int32_t)i + 1 : -1;
+    }
+    u->free_file = 0;
+    if (uring_register(u->fd, IORING_REGISTER_FILES, fds, u->nfiles) == -1)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "io_uring file table: %s",
+            strerror(errno));
+        free(fds);
+        goto err;
+    }
+    free(fds);
+
+    /** the data buffer, registered if the memlock limit lets us */
+    u->buf = mmap(NULL, (size_t)NFEX_URING_CHUNKS * NFEX_URING_CHUNK,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buf == MAP_FAILED)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "mmap(): %s", strerror(errno));
+        goto err;
+    }
+    iov.iov_base = u->buf;
+    iov.iov_len  = (size_t)NFEX_URING_CHUNKS * NFEX_URING_CHUNK;
+    u->fixed = uring_register(u->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+
+    /** chunk 0 is the one we start filling, the rest are free */
+    for (i = NFEX_URING_CHUNKS - 1; i > 0; i--)
+    {
+        u->free_chunks[u->nfree_chunks++] = i;
+    }
+    u->cur     = 0;
+    u->refs[0] = 1;
+
+    pool_init(&u->pends, sizeof (uring_pend_t), NFEX_POOL_SLAB);
+    u->last_sync = time(NULL);
+    w->uring = u;
+    return (1);
+err:
+    uring_destroy(u);
+    return (-1);
+}
+
+/** hand the kernel whatever's queued, min completions to wait for */
+static void
+uring_submit(writer_t *w, uint32_t min)
+{
+    uring_t *u;
+    int n;
+
+    u = w->uring;
+    if (u->queued == 0 && (min == 0 || u->inflight == 0))
+    {
+        return;
+    }
+    n = uring_enter(u->fd, u->queued, min, min ? IORING_ENTER_GETEVENTS : 0);
+    if (n == -1)
+    {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            fprintf(stderr, "io_uring_enter(): %s\n", strerror(errno));
+        }
+        return;
+    }
+    u->queued -= n;
+}
+
+/** run every completion that's come in */
+static void
+uring_reap(writer_t *w)
+{
+    struct io_uring_cqe *cqe;
+    uring_t *u;
+    uint64_t ud;
+    uint32_t head;
+    int32_t res;
+
+    u = w->uring;
+    while ((head = *u->cq_head) !=
+        __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        /** let go of the entry first, completing can get us back here */
+        cqe = &((struct io_uring_cqe *)u->cqes)[head & u->cq_mask];
+        ud  = cqe->user_data;
+        res = cqe->res;
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+        uring_complete(w, ud, res);
+    }
+}
+
+/** out of something only the kernel can give back, wait on it */
+static void
+uring_wait(writer_t *w)
+{
+    w->uring->stalls++;
+    uring_submit(w, 1);
+    uring_reap(w);
+}
+
+/** the next submission queue entry, zeroed */
+static struct io_uring_sqe *
+uring_sqe(writer_t *w)
+{
+    struct io_uring_sqe *sqe;
+    uring_t *u;
+    uint32_t tail;
+
+    u = w->uring;
+
+    /** don't get more in flight than the completion queue holds */
+    while (u->inflight >= 2 * u->sq_entries)
+    {
+        uring_wait(w);
+    }
+    tail = *u->sq_tail;
+    while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+        u->sq_entries)
+    {
+        uring_submit(w, 0);
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+            u->sq_entries)
+        {
+            uring_wait(w);
+        }
+    }
+    sqe = &((struct io_uring_sqe *)u->sqes)[tail & u->sq_mask];
+    memset(sqe, 0, sizeof (*sqe));
+    return (sqe);
+}
+
+/** the entry from uring_sqe() is filled in, queue it */
+static void
+uring_push(uring_t *u, uring_file_t *f)
+{
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    u->inflight++;
+    f->inflight++;
+}
+
+/** an op is done with its chunk */
+static void
+uring_unref(uring_t *u, uint32_t chunk)
+{
+    if (chunk != URING_NO_CHUNK && --u->refs[chunk] == 0)
+    {
+        u->free_chunks[u->nfree_chunks++] = chunk;
+    }
+}
+
+/*
+ * Room for len (<= NFEX_URING_CHUNK) bytes in the buffer.  Chunks are
+ * filled front to back, the one being filled holds a reference of its
+ * own; with none free we wait for the kernel to finish with one.
+ */
+static uint8_t *
+uring_buf(writer_t *w, uint32_t len, uint32_t *chunk, uint32_t *boff)
+{
+    uring_t *u;
+
+    u = w->uring;
+    if (u->cur_off + len > NFEX_URING_CHUNK)
+    {
+        while (u->nfree_chunks == 0)
+        {
+            uring_wait(w);
+        }
+        uring_unref(u, u->cur);
+        u->cur          = u->free_chunks[--u->nfree_chunks];
+        u->cur_off      = 0;
+        u->refs[u->cur] = 1;
+    }
+    *chunk = u->cur;
+    *boff  = u->cur_off;
+    u->refs[u->cur]++;
+    u->cur_off += (len + 7) & ~7;
+    return (URING_BUF(u, *chunk, *boff));
+}
+
+static void
+uring_write_sqe(writer_t *w, int n, uint32_t chunk, uint32_t boff,
+uint32_t len, uint64_t foff)
+{
+    struct io_uring_sqe *sqe;
+    uring_t *u;
+
+    u   = w->uring;
+    sqe = uring_sqe(w);
+    sqe->opcode    = u->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->flags     = IOSQE_FIXED_FILE;
+    sqe->fd        = n;
+    sqe->addr      = (uintptr_t)URING_BUF(u, chunk, boff);
+    sqe->len       = len;
+    sqe->off       = foff;
+    sqe->buf_index = 0;
+    sqe->user_data = URING_UD(URING_OP_WRITE, n, chunk, len);
+    uring_push(u, &u->files[n]);
+}
+
+/*
+ * Queue an open of path into a free slot and return the slot, -1 if
+ * they're all taken.  Whether it worked we only find out later; if it
+ * didn't, it's reported then and writes to the slot go nowhere.
+ */
+int
+uring_open(writer_t *w, const char *path)
+{
+    struct io_uring_sqe *sqe;
+    uring_file_t *f;
+    uring_t *u;
+    uint32_t len, chunk, boff;
+    uint8_t *name;
+    int n;
+
+    u = w->uring;
+    if (u->free_file == -1)
+    {
+        /** maybe some closes have finished */
+        uring_flush(w);
+        if (u->free_file == -1)
+        {
+            errno = EMFILE;
+            return (-1);
+        }
+    }
+    len = strlen(path) + 1;
+    if (len > NFEX_URING_CHUNK)
+    {
+        errno = ENAMETOOLONG;
+        return (-1);
+    }
+
+    /** the kernel reads the name when it gets around to it, keep a copy */
+    name = uring_buf(w, len, &chunk, &boff);
+    memcpy(name, path, len);
+
+    n            = u->free_file;
+    f            = &u->files[n];
+    u->free_file = f->next_free;
+    memset(f, 0, sizeof (uring_file_t));
+    f->state     = URING_OPENING;
+    f->pend_tail = &f->pend;
+
+    sqe = uring_sqe(w);
+    sqe->opcode     = IORING_OP_OPENAT;
+    sqe->fd         = AT_FDCWD;
+    sqe->addr       = (uintptr_t)name;
+    sqe->len        = S_IRWXU | S_IRWXG | S_IRWXO;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL;
+    sqe->file_index = n + 1;
+    sqe->user_data  = URING_UD(URING_OP_OPEN, n, chunk, boff);
+    uring_push(u, f);
+    return (n);
+}
+
+/** copy data and queue it to be appended to slot n */
+void
+uring_write(writer_t *w, int n, const uint8_t *data, size_t len)
+{
+    uring_file_t *f;
+    uring_pend_t *p;
+    uring_t *u;
+    uint32_t c, chunk, boff;
+
+    u = w->uring;
+    f = &u->files[n];
+    for (; len; data += c, len -= c)
+    {
+        c = len < NFEX_URING_CHUNK ? len : NFEX_URING_CHUNK;
+        if (f->state == URING_FAILED)
+        {
+            return;
+        }
+        memcpy(uring_buf(w, c, &chunk, &boff), data, c);
+
+        /** waiting on the buffer runs completions, the open may be one */
+        if (f->state == URING_FAILED)
+        {
+            uring_unref(u, chunk);
+            return;
+        }
+        if (f->state == URING_OPENING)
+        {
+            p = pool_get(&u->pends);
+            if (p == NULL)
+            {
+                uring_unref(u, chunk);
+                __atomic_add_fetch(&w->write_errors, 1, __ATOMIC_RELAXED);
+                f->failed = 1;
+                return;
+            }
+            p->next      = NULL;
+            p->chunk     = chunk;
+            p->boff      = boff;
+            p->len       = c;
+            p->foff      = f->off;
+            *f->pend_tail = p;
+            f->pend_tail  = &p->next;
+        }
+        else
+        {
+            uring_write_sqe(w, n, chunk, boff, c, f->off);
+        }
+        u->backlog += c;
+        f->off     += c;
+        f->dirty    = 1;
+    }
+}
+
+/** all done with slot n, it's closed once everything queued is written */
+void
+uring_close(writer_t *w, int n)
+{
+    w->uring->files[n].closing = 1;
+    uring_close_maybe(w, n);
+}
+
+/*
+ * Close slot n once everything queued is written, then link the file in
+ * as path; tmp (what it was opened as) goes once that's done, if path was
+ * already there, or straight away with no path or if a write failed.  The
+ * store hears how it went.
+ */
+void
+uring_commit(writer_t *w, int n, const char *tmp, const char *path)
+{
+    uring_file_t *f;
+    uint32_t tlen, plen, chunk, boff;
+    uint8_t *names;
+
+    f    = &w->uring->files[n];
+    path = path ? path : "";
+    tlen = strlen(tmp) + 1;
+    plen = strlen(path) + 1;
+    if (tlen + plen <= NFEX_URING_CHUNK)
+    {
+        /** the kernel reads them when it gets around to it, keep a copy */
+        names = uring_buf(w, tlen + plen, &chunk, &boff);
+        memcpy(names, tmp, tlen);
+        memcpy(names + tlen, path, plen);
+        f->commit     = 1;
+        f->name_chunk = chunk;
+        f->name_off   = boff;
+    }
+    uring_close(w, n);
+}
+
+static void
+uring_close_maybe(writer_t *w, int n)
+{
+    struct io_uring_sqe *sqe;
+    uring_file_t *f;
+    uring_t *u;
+    char *tmp;
+
+    u = w->uring;
+    f = &u->files[n];
+    if (f->closing == 0 || f->inflight)
+    {
+        return;
+    }
+    if (f->state == URING_FAILED)
+    {
+        /** nothing ever made it into the slot */
+        if (f->commit)
+        {
+            tmp = (char *)URING_BUF(u, f->name_chunk, f->name_off);
+            store_done(w->store, tmp + strlen(tmp) + 1, 0);
+            uring_unref(u, f->name_chunk);
+        }
+        uring_free_file(u, n);
+        return;
+    }
+    if (f->state != URING_OPEN)
+    {
+        return;
+    }
+    f->state = URING_CLOSING;
+    if (w->sync_policy != WQ_SYNC_NONE && f->dirty)
+    {
+        sqe = uring_sqe(w);
+        sqe->opcode      = IORING_OP_FSYNC;
+        sqe->flags       = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        sqe->fd          = n;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data   = URING_UD(URING_OP_SYNC, n, URING_NO_CHUNK, 0);
+        uring_push(u, f);
+    }
+    sqe = uring_sqe(w);
+    sqe->opcode     = IORING_OP_CLOSE;
+    sqe->flags      = f->commit ? IOSQE_IO_HARDLINK : 0;
+    sqe->file_index = n + 1;
+    sqe->user_data  = URING_UD(URING_OP_CLOSE, n, URING_NO_CHUNK, 0);
+    uring_push(u, f);
+    if (f->commit)
+    {
+        /** every write is done, the link only waits on the close to order */
+        tmp = (char *)URING_BUF(u, f->name_chunk, f->name_off);
+        if (tmp[strlen(tmp) + 1] == '\0' || f->failed)
+        {
+            store_done(w->store, tmp + strlen(tmp) + 1, 0);
+            uring_unlink(w, n);
+            return;
+        }
+        sqe = uring_sqe(w);
+        sqe->opcode         = IORING_OP_LINKAT;
+        sqe->fd             = AT_FDCWD;
+        sqe->addr           = (uintptr_t)tmp;
+        sqe->len            = AT_FDCWD;
+        sqe->addr2          = (uintptr_t)(tmp + strlen(tmp) + 1);
+        sqe->hardlink_flags = 0;
+        sqe->user_data      = URING_UD(URING_OP_LINK, n, f->name_chunk,
+                                  f->name_off);
+        uring_push(u, f);
+    }
+}
+
+/** the file's in place (or was already), its temporary name goes */
+static void
+uring_unlink(writer_t *w, int n)
+{
+    struct io_uring_sqe *sqe;
+    uring_file_t *f;
+    uring_t *u;
+
+    u   = w->uring;
+    f   = &u->files[n];
+    sqe = uring_sqe(w);
+    sqe->opcode       = IORING_OP_UNLINKAT;
+    sqe->fd           = AT_FDCWD;
+    sqe->addr         = (uintptr_t)URING_BUF(u, f->name_chunk, f->name_off);
+    sqe->unlink_flags = 0;
+    sqe->user_data    = URING_UD(URING_OP_UNLINK, n, f->name_chunk,
+                            f->name_off);
+    uring_push(u, f);
+}
+
+static void
+uring_free_file(uring_t *u, int n)
+{
+    u->files[n].state     = URING_FREE;
+    u->files[n].next_free = u->free_file;
+    u->free_file          = n;
+}
+
+static void
+uring_complete(writer_t *w, uint64_t ud, int32_t res)
+{
+    uring_file_t *f;
+    uring_pend_t *p;
+    uring_t *u;
+    uint32_t chunk, len;
+    char *tmp;
+    int n;
+
+    u     = w->uring;
+    n     = URING_UD_FILE(ud);
+    f     = &u->files[n];
+    chunk = URING_UD_CHUNK(ud);
+    len   = URING_UD_LEN(ud);
+    u->inflight--;
+    f->inflight--;
+
+    switch (URING_UD_OP(ud))
+    {
+        case URING_OP_OPEN:
+            if (res < 0)
+            {
+                fprintf(stderr, "error opening file: %s: %s\n",
+                    (char *)URING_BUF(u, chunk, len), strerror(-res));
+                __atomic_add_fetch(&w->write_errors, 1, __ATOMIC_RELAXED);
+                f->state = URING_FAILED;
+                while ((p = f->pend))
+                {
+                    f->pend     = p->next;
+                    u->backlog -= p->len;
+                    uring_unref(u, p->chunk);
+                    pool_put(&u->pends, p);
+                }
+            }
+            else
+            {
+                /** the slot's good, send along what was waiting on it */
+                f->state = URING_OPEN;
+                while ((p = f->pend))
+                {
+                    f->pend = p->next;
+                    uring_write_sqe(w, n, p->chunk, p->boff, p->len, p->foff);
+                    pool_put(&u->pends, p);
+                }
+            }
+            f->pend_tail = &f->pend;
+            uring_unref(u, chunk);
+            break;
+        case URING_OP_WRITE:
+            u->backlog -= len;
+            if (res != (int32_t)len)
+            {
+                fprintf(stderr,
+                    "error writing slot: %d, wrote %d of %d bytes: %s\n",
+                    n, res < 0 ? 0 : res, len,
+                    res < 0 ? strerror(-res) : "short write");
+                __atomic_add_fetch(&w->write_errors, 1, __ATOMIC_RELAXED);
+                f->failed = 1;
+            }
+            else
+            {
+                __atomic_add_fetch(&w->bytes_written, len, __ATOMIC_RELAXED);
+            }
+            uring_unref(u, chunk);
+            break;
+        case URING_OP_SYNC:
+            break;
+        case URING_OP_CLOSE:
+            f->state = URING_CLOSED;
+            break;
+        case URING_OP_LINK:
+            tmp = (char *)URING_BUF(u, chunk, len);
+            if (res < 0 && res != -EEXIST)
+            {
+                fprintf(stderr, "can't link %s: %s\n", tmp, strerror(-res));
+                __atomic_add_fetch(&w->write_errors, 1, __ATOMIC_RELAXED);
+                store_done(w->store, tmp + strlen(tmp) + 1, 0);
+                uring_unref(u, chunk);
+            }
+            else
+            {
+                store_done(w->store, tmp + strlen(tmp) + 1, 1);
+                uring_unlink(w, n);
+            }
+            break;
+        case URING_OP_UNLINK:
+            if (res < 0)
+            {
+                fprintf(stderr, "can't unlink %s: %s\n",
+                    (char *)URING_BUF(u, chunk, len), strerror(-res));
+            }
+            uring_unref(u, chunk);
+            break;
+    }
+    if (f->state == URING_CLOSED)
+    {
+        /** a slot being linked in is free once that's all done */
+        if (f->inflight == 0)
+        {
+            uring_free_file(u, n);
+        }
+        return;
+    }
+    uring_close_maybe(w, n);
+}
+
+/*
+ * Once a batch: submit everything queued and run whatever completions are
+ * in, without waiting on any.
+ */
+void
+uring_flush(writer_t *w)
+{
+    struct io_uring_sqe *sqe;
+    uring_file_t *f;
+    uring_t *u;
+    time_t now;
+    uint32_t n;
+
+    u = w->uring;
+    if (w->sync_policy == WQ_SYNC_PERIODIC)
+    {
+        now = time(NULL);
+        if (now - u->last_sync >= w->sync_interval)
+        {
+            for (n = 0; n < u->nfiles; n++)
+            {
+                f = &u->files[n];
+                if (f->state == URING_OPEN && f->closing == 0 && f->dirty)
+                {
+                    sqe = uring_sqe(w);
+                    sqe->opcode      = IORING_OP_FSYNC;
+                    sqe->flags       = IOSQE_FIXED_FILE;
+                    sqe->fd          = n;
+                    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+                    sqe->user_data   = URING_UD(URING_OP_SYNC, n,
+                                           URING_NO_CHUNK, 0);
+                    uring_push(u, f);
+                    f->dirty = 0;
+                }
+            }
+            u->last_sync = now;
+        }
+    }
+    uring_submit(w, 0);
+    uring_reap(w);
+}
+
+/** wait for everything to land, then tear it all down */
+void
+uring_shutdown(writer_t *w)
+{
+    uring_t *u;
+
+    uring_flush(w);
+    while (w->uring->inflight)
+    {
+        uring_submit(w, 1);
+        uring_reap(w);
+    }
+    u        = w->uring;
+    w->uring = NULL;
+    uring_destroy(u);
+}
+
+static void
+uring_destroy(uring_t *u)
+{
+    if (u->buf != MAP_FAILED)
+    {
+        munmap(u->buf, (size_t)NFEX_URING_CHUNKS * NFEX_URING_CHUNK);
+    }
+    if (u->sqes != MAP_FAILED)
+    {
+        munmap(u->sqes, u->sqes_maplen);
+    }
+    if (u->cq_map != MAP_FAILED && u->cq_map != u->sq_map)
+    {
+        munmap(u->cq_map, u->cq_maplen);
+    }
+    if (u->sq_map != MAP_FAILED)
+    {
+        munmap(u->sq_map, u->sq_maplen);
+    }
+    if (u->fd != -1)
+    {
+        /** takes the file table and the registered buffer with it */
+        close(u->fd);
+    }
+    if (u->pends.size)
+    {
+        pool_destroy(&u->pends);
+    }
+    free(u->files);
+    free(u);
+}
+
+#else /* !HAVE_IO_URING */
+
+int
+uring_init(writer_t *w, char *errbuf)
+{
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "io_uring not supported here");
+    return (-1);
+}
+
+int
+uring_open(writer_t *w, const char *path)
+{
+    errno = ENOSYS;
+    return (-1);
+}
+
+void
+uring_write(writer_t *w, int n, const uint8_t *data, size_t len)
+{
+}
+
+void
+uring_close(writer_t *w, int n)
+{
+}
+
+void
+uring_commit(writer_t *w, int n, const char *tmp, const char *path)
+{
+}
+
+void
+uring_flush(writer_t *w)
+{
+}
+
+void
+uring_shutdown(writer_t *w)
+{
+}
+
+#endif /* HAVE_IO_URING */
+
+/** EOF */
@@ -30,6 +30,7 @@
 */
 
 #include "nfex.h"
+#include "util.h"
 #include <stdarg.h>
 #include <math.h>
 
@@ -81,6 +82,37 @@ print_simple:
     return;
 }
 
+/*
+ * src:port -> dst:port, IPv6 addresses in brackets.  dir 1 turns the 
+ * session's key round, for its second flow.
+ */
+void
+fprintsession(FILE *stream, ht_node_t *p, int dir, ncc_t *ncc)
+{
+    char addr[INET6_ADDRSTRLEN];
+    uint32_t ip[2];
+    uint16_t port[2];
+
+    port[0] = ntohs(dir ? p->ft.port_dst : p->ft.port_src);
+    port[1] = ntohs(dir ? p->ft.port_src : p->ft.port_dst);
+    if (p->ip6)
+    {
+        inet_ntop(AF_INET6, dir ? p->ip6->dst : p->ip6->src, addr, 
+            sizeof (addr));
+        fprintf(stream, "[%s]:%d -> ", addr, port[0]);
+        inet_ntop(AF_INET6, dir ? p->ip6->src : p->ip6->dst, addr, 
+            sizeof (addr));
+        fprintf(stream, "[%s]:%d", addr, port[1]);
+        return;
+    }
+    ip[0] = dir ? p->ft.ip_dst : p->ft.ip_src;
+    ip[1] = dir ? p->ft.ip_src : p->ft.ip_dst;
+    fprintip(stream, ip[0], ncc);
+    fprintf(stream, ":%d -> ", port[0]);
+    fprintip(stream, ip[1], ncc);
+    fprintf(stream, ":%d", port[1]);
+}
+
 void *
 emalloc(size_t size)
 {
@@ -109,10 +141,17 @@ ecalloc(size_t nmemb, size_t size)
     return (p);
 }
 
+/** a thread that would rather have control back than exit sets this */
+__thread jmp_buf *error_jmp;
+
 void
 error(char *msg)
 {
     fprintf(stderr, "%s", msg);
+    if (error_jmp)
+    {
+        longjmp(*error_jmp, 1);
+    }
     exit(EXIT_FAILURE);
 }
 
@@ -152,8 +191,8 @@ build_bpf_filter(register char **argv, char **buf)
     p = argv;
     if (*p == 0)
     {
-        /** our default filter of "tcp" */
-        strncpy(*buf, NFEX_PCAP_FILTER, 127);
+        /** the default filter depends on the datalink, init fills it in */
+        **buf = 0;
         return;
     }
 
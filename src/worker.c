@@ -0,0 +1,308 @@
+/*
+ * worker.c - flow sharded worker threads
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include "nfex.h"
+#include "ring.h"
+
+static void *worker_thread(void *);
+static void *worker_capture_thread(void *);
+static void worker_capture_packet(u_char *, const struct pcap_pkthdr *,
+                                  const u_char *);
+static void worker_capture_done(u_char *);
+
+/*
+ * Set up nworkers flow shards.  Each gets its own session table, timer
+ * wheel and extraction writer.  With a single worker there are no extra
+ * threads, the capture thread does the work itself.  When capturing from
+ * TPACKET_V3 rings each worker gets a ring of its own and the kernel does
+ * the sharding for us through a fanout group.
+ */
+int
+workers_init(ncc_t *ncc, int sync_policy, int sync_interval, char *errbuf)
+{
+    int i, n;
+    nwc_t *w;
+
+    ncc->workers = calloc(ncc->nworkers, sizeof (nwc_t));
+    if (ncc->workers == NULL)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "calloc(): %s", strerror(errno));
+        return (-1);
+    }
+
+    for (i = 0; i < ncc->nworkers; i++)
+    {
+        w      = &ncc->workers[i];
+        w->ncc = ncc;
+        w->id  = i;
+        w->sc  = ncc->sc;
+        w->tp.fd = -1;
+        w->epoch = ncc->sc->epoch;
+        pthread_mutex_init(&w->lock, NULL);
+        w->reasm.max = NFEX_REASM_MAX / ncc->nworkers;
+        frag_init(&w->frag, NFEX_FRAG_MAX / (ncc->nworkers + 1));
+        pool_init(&w->sessions, sizeof (ht_node_t), NFEX_POOL_SLAB);
+        pool_init(&w->extracts, sizeof (extract_list_t), NFEX_POOL_SLAB);
+        w->xbufs.max = NFEX_XBUF_MAX / NFEX_XBUF_SIZE / ncc->nworkers;
+        pool_init(&w->xbufs.bufs, NFEX_XBUF_SIZE,
+            MIN(NFEX_XBUF_SLAB, w->xbufs.max));
+        pool_init(&w->addrs, sizeof (ip6_pair_t), NFEX_POOL_SLAB);
+        arena_init(&w->results);
+
+        if (ht_init(w) == -1)
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "can't allocate session table");
+            return (-1);
+        }
+
+        /** file writes happen off to the side so we never wait on disk */
+        if (writer_init(&w->writer, sync_policy, sync_interval,
+            (ncc->flags & NFEX_NO_URING) == 0, errbuf) == -1)
+        {
+            return (-1);
+        }
+        if (ncc->flags & NFEX_STORE)
+        {
+            /** so it can say when an object's really in the store */
+            w->writer.store = &ncc->store;
+        }
+
+        if (ncc->flags & NFEX_TPACKET)
+        {
+            if (tpacket_open(&w->tp, ncc->device, ncc->ring_mb, ncc->fanout,
+                &ncc->filter, errbuf) == -1)
+            {
+                return (-1);
+            }
+        }
+
+        if (ncc->nworkers == 1)
+        {
+            if ((ncc->flags & NFEX_TPACKET) == 0)
+            {
+                /** libpcap reuses its buffer, batched packets get copied */
+                w->batch.copy = malloc(NFEX_BATCH_COPY);
+                if (w->batch.copy == NULL)
+                {
+                    snprintf(errbuf, PCAP_ERRBUF_SIZE, "malloc(): %s", 
+                        strerror(errno));
+                    return (-1);
+                }
+            }
+            continue;
+        }
+        if (ncc->flags & NFEX_TPACKET)
+        {
+            n = pthread_create(&w->thread, NULL, worker_capture_thread, w);
+        }
+        else
+        {
+            if (ring_init(&w->ring, NFEX_WORKER_RING_SIZE) == -1)
+            {
+                snprintf(errbuf, PCAP_ERRBUF_SIZE, "malloc(): %s", 
+                    strerror(errno));
+                return (-1);
+            }
+            n = pthread_create(&w->thread, NULL, worker_thread, w);
+        }
+        if (n)
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "pthread_create(): %s",
+                strerror(n));
+            return (-1);
+        }
+        w->running = 1;
+    }
+    return (1);
+}
+
+/*
+ * Between batches: move on to the newest search config if there's been a
+ * reload, and let the reclaimer know we're done with the old one.
+ */
+void
+worker_config_sync(nwc_t *w)
+{
+    nsc_t *sc;
+
+    sc = __atomic_load_n(&w->ncc->sc, __ATOMIC_ACQUIRE);
+    if (sc != w->sc)
+    {
+        w->sc = sc;
+        __atomic_store_n(&w->epoch, sc->epoch, __ATOMIC_RELEASE);
+    }
+}
+
+/** capture side: copy a packet into the worker's queue */
+void
+worker_enqueue(nwc_t *w, const struct pcap_pkthdr *header,
+const u_char *packet)
+{
+    struct pcap_pkthdr *h;
+
+    h = ring_reserve(&w->ring, sizeof (struct pcap_pkthdr) + header->caplen);
+    memcpy(h, header, sizeof (struct pcap_pkthdr));
+    memcpy(h + 1, packet, header->caplen);
+    ring_commit(&w->ring);
+}
+
+/*
+ * The worker thread.  Packets are taken in batches with the lock held so
+ * the keyboard commands that walk the session tables see a consistent
+ * picture, and ring space is handed back once the batch is done.
+ */
+static void *
+worker_thread(void *arg)
+{
+    nwc_t *w;
+    struct pcap_pkthdr *h;
+    uint64_t pos, next;
+    uint32_t len;
+    int n;
+
+    w = (nwc_t *)arg;
+    for (pos = 0; ; )
+    {
+        pthread_mutex_lock(&w->lock);
+        worker_config_sync(w);
+        for (n = 0, next = pos; n < NFEX_WORKER_BATCH; n++, pos = next)
+        {
+            h = ring_peek(&w->ring, &next, &len);
+            if (h == NULL)
+            {
+                break;
+            }
+            worker_batch_add(w, h, (u_char *)(h + 1));
+        }
+        worker_batch_flush(w);
+        pthread_mutex_unlock(&w->lock);
+
+        if (n)
+        {
+            ring_release(&w->ring, pos);
+            continue;
+        }
+
+        /** nothing queued */
+        if (__atomic_load_n(&w->ring.done, __ATOMIC_ACQUIRE) &&
+            ring_backlog(&w->ring) == 0)
+        {
+            break;
+        }
+        usleep(NFEX_RING_IDLE_USEC);
+    }
+    return (NULL);
+}
+
+/** worker thread that reads its own TPACKET_V3 ring, no copies */
+static void *
+worker_capture_thread(void *arg)
+{
+    nwc_t *w;
+
+    w = (nwc_t *)arg;
+    while (__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE) == 0)
+    {
+        worker_config_sync(w);
+        if (tpacket_wait(&w->tp, NFEX_TP_BLOCK_TOV) > 0)
+        {
+            pthread_mutex_lock(&w->lock);
+            tpacket_dispatch(&w->tp, worker_capture_packet, worker_capture_done,
+                (u_char *)w);
+            pthread_mutex_unlock(&w->lock);
+        }
+        else
+        {
+            /** quiet out there, keep the writer moving */
+            pthread_mutex_lock(&w->lock);
+            writer_flush(&w->writer);
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    return (NULL);
+}
+
+static void
+worker_capture_packet(u_char *user, const struct pcap_pkthdr *header,
+const u_char *packet)
+{
+    nwc_t *w;
+
+    w = (nwc_t *)user;
+    if ((w->ncc->flags & NFEX_EBPF) && 
+        pcap_offline_filter(&w->ncc->filter, header, packet) == 0)
+    {
+        return;
+    }
+    w->stats.total_packets++;
+    w->stats.total_bytes += (header->len + sizeof (struct pcap_pkthdr));
+    worker_batch_add(w, header, packet);
+}
+
+/** a ring block is going back to the kernel, finish what's in it */
+static void
+worker_capture_done(u_char *user)
+{
+    worker_batch_flush((nwc_t *)user);
+}
+
+/** let every worker drain its queue and exit, safe to call more than once */
+void
+workers_stop(ncc_t *ncc)
+{
+    int i;
+    nwc_t *w;
+
+    for (i = 0; i < ncc->nworkers; i++)
+    {
+        w = &ncc->workers[i];
+        if (w->running)
+        {
+            __atomic_store_n(&w->ring.done, 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+            pthread_join(w->thread, NULL);
+            w->running = 0;
+        }
+    }
+}
+
+void
+workers_destroy(ncc_t *ncc)
+{
+    int i;
+    nwc_t *w;
+
+    if (ncc->workers == NULL)
+    {
+        return;
+    }
+    workers_stop(ncc);
+    for (i = 0; i < ncc->nworkers; i++)
+    {
+        w = &ncc->workers[i];
+
+        /** close out sessions, then let the writer finish up */
+        ht_shutitdown(w);
+        writer_shutdown(&w->writer);
+        ring_free(&w->ring);
+        tpacket_close(&w->tp);
+        pool_destroy(&w->sessions);
+        pool_destroy(&w->extracts);
+        pool_destroy(&w->xbufs.bufs);
+        pool_destroy(&w->addrs);
+        frag_destroy(&w->frag);
+        arena_destroy(&w->results);
+        free(w->batch.copy);
+        pthread_mutex_destroy(&w->lock);
+    }
+    free(ncc->workers);
+    ncc->workers = NULL;
+}
+
+/** EOF */
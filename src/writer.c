@@ -0,0 +1,401 @@
+/*
+ * writer.c - extraction writer
+ *
+ * 2009, 2010 Mike Schiffman <mschiffm@cisco.com>
+ *
+ * Copyright (c) 2010 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include "nfex.h"
+#include "writer.h"
+#include "util.h"
+#include <sys/uio.h>
+#include <limits.h>
+
+static void *writer_thread(void *);
+static void writer_enqueue(writer_t *, int, uint32_t, const uint8_t *, size_t);
+static void writer_sync_dirty(writer_t *);
+static void writer_publish(writer_t *, const char *, const char *, int);
+
+/*
+ * Set up the writer, on io_uring if asked and the kernel's up to it,
+ * otherwise with a thread of its own.
+ */
+int
+writer_init(writer_t *w, int sync_policy, int sync_interval, int uring,
+char *errbuf)
+{
+    struct rlimit rl;
+    int n;
+
+    memset(w, 0, sizeof (writer_t));
+    w->sync_policy   = sync_policy;
+    w->sync_interval = sync_interval > 0 ? sync_interval : NFEX_WQ_SYNC_SECS;
+
+    if (uring && uring_init(w, errbuf) == 1)
+    {
+        return (1);
+    }
+
+    if (ring_init(&w->ring, NFEX_WQ_SIZE) == -1)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "malloc(): %s", strerror(errno));
+        return (-1);
+    }
+
+    /** one dirty and failed flag for every fd we could possibly be handed */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == RLIM_INFINITY)
+    {
+        w->ndirty = 65536;
+    }
+    else
+    {
+        w->ndirty = rl.rlim_cur;
+    }
+    w->dirty  = calloc(w->ndirty, sizeof (uint8_t));
+    w->failed = calloc(w->ndirty, sizeof (uint8_t));
+    if (w->dirty == NULL || w->failed == NULL)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "calloc(): %s", strerror(errno));
+        free(w->dirty);
+        free(w->failed);
+        ring_free(&w->ring);
+        return (-1);
+    }
+
+    n = pthread_create(&w->thread, NULL, writer_thread, w);
+    if (n)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "pthread_create(): %s",
+            strerror(n));
+        free(w->dirty);
+        free(w->failed);
+        ring_free(&w->ring);
+        return (-1);
+    }
+    w->running = 1;
+    return (1);
+}
+
+/** create a new file to extract into, returns a handle for it or -1 */
+int
+writer_open(writer_t *w, const char *path)
+{
+    if (w->uring)
+    {
+        return (uring_open(w, path));
+    }
+    return (open(path, O_WRONLY | O_CREAT | O_EXCL,
+        S_IRWXU | S_IRWXG | S_IRWXO));
+}
+
+/** queue data to be appended to fd, data is copied so packets can go */
+void
+writer_write(writer_t *w, int fd, const uint8_t *data, size_t len)
+{
+    size_t n;
+
+    if (w->uring)
+    {
+        uring_write(w, fd, data, len);
+        return;
+    }
+
+    /** keep every record well under half the ring */
+    while (len)
+    {
+        n = len < NFEX_WQ_SIZE / 4 ? len : NFEX_WQ_SIZE / 4;
+        writer_enqueue(w, fd, WQ_OP_WRITE, data, n);
+        data += n;
+        len  -= n;
+    }
+}
+
+/** queue a close of fd, behind any writes already queued for it */
+void
+writer_close(writer_t *w, int fd)
+{
+    if (w->uring)
+    {
+        uring_close(w, fd);
+        return;
+    }
+    if (w->running == 0)
+    {
+        /** never got started (or already stopped), just close it */
+        close(fd);
+        return;
+    }
+    writer_enqueue(w, fd, WQ_OP_CLOSE, NULL, 0);
+}
+
+/*
+ * Queue a close of fd, which was opened as tmp, and then have it take the
+ * name path.  If path is already there it's the same file (the name says
+ * what's in it) and tmp is just thrown away, as it is with no path or if
+ * any of it failed to write.  The store hears how it went.
+ */
+void
+writer_commit(writer_t *w, int fd, const char *tmp, const char *path)
+{
+    char names[2 * FILENAME_BUFFER_SIZE];
+    size_t n;
+
+    if (w->uring)
+    {
+        uring_commit(w, fd, tmp, path);
+        return;
+    }
+    if (w->running == 0)
+    {
+        close(fd);
+        writer_publish(w, tmp, path, 0);
+        return;
+    }
+    n = snprintf(names, sizeof (names), "%s%c%s", tmp, '\0',
+        path ? path : "");
+    writer_enqueue(w, fd, WQ_OP_COMMIT, (uint8_t *)names,
+        MIN(n + 1, sizeof (names)));
+}
+
+/** once a batch, io_uring gets what's queued and we see what's done */
+void
+writer_flush(writer_t *w)
+{
+    if (w->uring)
+    {
+        uring_flush(w);
+    }
+}
+
+/** file bytes queued and not yet written */
+uint64_t
+writer_queued(writer_t *w)
+{
+    uring_t *u;
+
+    u = w->uring;
+    if (u)
+    {
+        return (u->backlog);
+    }
+    return (ring_backlog(&w->ring));
+}
+
+/** times the producer had to wait for the writer */
+uint32_t
+writer_stalled(writer_t *w)
+{
+    uring_t *u;
+
+    u = w->uring;
+    if (u)
+    {
+        return (u->stalls);
+    }
+    return (w->ring.stalls);
+}
+
+/** drain everything that's queued and stop the writer */
+void
+writer_shutdown(writer_t *w)
+{
+    if (w->uring)
+    {
+        uring_shutdown(w);
+        return;
+    }
+    if (w->running)
+    {
+        __atomic_store_n(&w->ring.done, 1, __ATOMIC_RELEASE);
+        pthread_join(w->thread, NULL);
+        w->running = 0;
+    }
+    free(w->dirty);
+    free(w->failed);
+    ring_free(&w->ring);
+    w->dirty  = NULL;
+    w->failed = NULL;
+}
+
+static void
+writer_enqueue(writer_t *w, int fd, uint32_t op, const uint8_t *data,
+size_t len)
+{
+    wq_record_t *r;
+
+    r      = ring_reserve(&w->ring, sizeof (wq_record_t) + len);
+    r->fd  = fd;
+    r->op  = op;
+    r->len = len;
+    if (len)
+    {
+        memcpy(r + 1, data, len);
+    }
+
+    /** publish, the writer thread can see it from here on */
+    ring_commit(&w->ring);
+}
+
+/*
+ * The writer thread.  Consecutive writes to the same file are gathered into
+ * a single writev() straight out of the ring, and the ring space is only
+ * handed back once the data is with the kernel.
+ */
+static void *
+writer_thread(void *arg)
+{
+    writer_t *w;
+    wq_record_t *r;
+    struct iovec iov[NFEX_WQ_IOV_MAX];
+    uint64_t pos, next;
+    time_t last_sync, now;
+    uint32_t len;
+    ssize_t c;
+    size_t nbytes;
+    int niov, fd, failed;
+
+    w = (writer_t *)arg;
+    last_sync = time(NULL);
+
+    for (pos = 0; ; )
+    {
+        if (w->sync_policy == WQ_SYNC_PERIODIC)
+        {
+            now = time(NULL);
+            if (now - last_sync >= w->sync_interval)
+            {
+                writer_sync_dirty(w);
+                last_sync = now;
+            }
+        }
+
+        /** gather up a run of writes to the same fd */
+        for (niov = 0, nbytes = 0, fd = -1, next = pos; ; pos = next)
+        {
+            r = ring_peek(&w->ring, &next, &len);
+            if (r == NULL || r->op != WQ_OP_WRITE || (niov && r->fd != fd) ||
+                niov == NFEX_WQ_IOV_MAX)
+            {
+                break;
+            }
+            fd                 = r->fd;
+            iov[niov].iov_base = r + 1;
+            iov[niov].iov_len  = r->len;
+            nbytes            += r->len;
+            niov++;
+        }
+
+        if (niov)
+        {
+            c = writev(fd, iov, niov);
+            if (c != nbytes)
+            {
+                fprintf(stderr,
+                    "error writing fd: %d, wrote %ld of %ld bytes: %s\n",
+                    fd, (long)c, (long)nbytes, strerror(errno));
+                __atomic_add_fetch(&w->write_errors, 1, __ATOMIC_RELAXED);
+                if (fd >= 0 && fd < w->ndirty)
+                {
+                    w->failed[fd] = 1;
+                }
+            }
+            else
+            {
+                __atomic_add_fetch(&w->bytes_written, nbytes,
+                    __ATOMIC_RELAXED);
+            }
+            if (fd >= 0 && fd < w->ndirty)
+            {
+                w->dirty[fd] = 1;
+            }
+        }
+        else if (r && (r->op == WQ_OP_CLOSE || r->op == WQ_OP_COMMIT))
+        {
+            fd = r->fd;
+            if (w->sync_policy != WQ_SYNC_NONE && fd >= 0 && fd < w->ndirty &&
+                w->dirty[fd])
+            {
+                fdatasync(fd);
+            }
+            failed = 0;
+            if (fd >= 0 && fd < w->ndirty)
+            {
+                failed        = w->failed[fd];
+                w->dirty[fd]  = 0;
+                w->failed[fd] = 0;
+            }
+            close(fd);
+            if (r->op == WQ_OP_COMMIT)
+            {
+                writer_publish(w, (char *)(r + 1),
+                    (char *)(r + 1) + strlen((char *)(r + 1)) + 1, failed);
+            }
+            pos = next;
+        }
+        else
+        {
+            /** nothing queued */
+            if (__atomic_load_n(&w->ring.done, __ATOMIC_ACQUIRE) &&
+                ring_backlog(&w->ring) == 0)
+            {
+                break;
+            }
+            usleep(NFEX_RING_IDLE_USEC);
+            continue;
+        }
+
+        /** hand the space back to the producer */
+        ring_release(&w->ring, pos);
+    }
+
+    if (w->sync_policy == WQ_SYNC_PERIODIC)
+    {
+        writer_sync_dirty(w);
+    }
+    return (NULL);
+}
+
+/** flush every file written to since the last time we were here */
+static void
+writer_sync_dirty(writer_t *w)
+{
+    int fd;
+
+    for (fd = 0; fd < w->ndirty; fd++)
+    {
+        if (w->dirty[fd])
+        {
+            fdatasync(fd);
+            w->dirty[fd] = 0;
+        }
+    }
+}
+
+/*
+ * A finished file takes its real name, unless that's already there or
+ * some of it never made it to disk (failed), and the store hears which.
+ */
+static void
+writer_publish(writer_t *w, const char *tmp, const char *path, int failed)
+{
+    if (path && path[0])
+    {
+        if (failed == 0 && link(tmp, path) == -1 && errno != EEXIST)
+        {
+            fprintf(stderr, "can't link %s to %s: %s\n", tmp, path,
+                strerror(errno));
+            __atomic_add_fetch(&w->write_errors, 1, __ATOMIC_RELAXED);
+            store_done(w->store, path, 0);
+            return;
+        }
+        store_done(w->store, path, failed == 0);
+    }
+    if (unlink(tmp) == -1)
+    {
+        fprintf(stderr, "can't unlink %s: %s\n", tmp, strerror(errno));
+    }
+}
+
+/** EOF */